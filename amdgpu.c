@@ -18,19 +18,57 @@
 #include "helpers.h"
 #include "util.h"
 
+#ifndef DRI_PATH
 #ifdef __ANDROID__
 #define DRI_PATH "/vendor/lib/dri/radeonsi_dri.so"
 #else
 #define DRI_PATH "/usr/lib64/dri/radeonsi_dri.so"
 #endif
+#endif
 
 #define TILE_TYPE_LINEAR 0
 /* DRI backend decides tiling in this case. */
 #define TILE_TYPE_DRI 1
+/* Laid out here with the GFX9+ 64KiB standard swizzle. */
+#define TILE_TYPE_GFX9_64K_S 2
+
+/* Swizzle mode of the 64KiB standard swizzle in the GEM tiling metadata. */
+#define AMDGPU_SW_64KB_S 9
+
+#ifndef AMDGPU_FAMILY_AI
+#define AMDGPU_FAMILY_AI 141
+#endif
+#ifndef AMDGPU_FAMILY_RV
+#define AMDGPU_FAMILY_RV 142
+#endif
+
+#ifndef AMDGPU_TILING_SWIZZLE_MODE_SHIFT
+#define AMDGPU_TILING_SWIZZLE_MODE_SHIFT 0
+#define AMDGPU_TILING_SWIZZLE_MODE_MASK 0x1f
+#endif
+
+#ifndef AMD_FMT_MOD
+#ifndef DRM_FORMAT_MOD_VENDOR_AMD
+#define DRM_FORMAT_MOD_VENDOR_AMD 0x02
+#endif
+#define AMD_FMT_MOD fourcc_mod_code(AMD, 0)
+#define AMD_FMT_MOD_TILE_VER_GFX9 1
+#define AMD_FMT_MOD_TILE_GFX9_64K_S 9
+#define AMD_FMT_MOD_TILE_VERSION_SHIFT 0
+#define AMD_FMT_MOD_TILE_SHIFT 8
+#define AMD_FMT_MOD_SET(field, value) ((uint64_t)(value) << AMD_FMT_MOD_##field##_SHIFT)
+#endif
+
+#define AMDGPU_FORMAT_MOD_GFX9_64K_S                                                               \
+	(AMD_FMT_MOD | AMD_FMT_MOD_SET(TILE_VERSION, AMD_FMT_MOD_TILE_VER_GFX9) |                  \
+	 AMD_FMT_MOD_SET(TILE, AMD_FMT_MOD_TILE_GFX9_64K_S))
 
 struct amdgpu_priv {
 	struct dri_driver dri;
 	int drm_version;
+	/* GFX9+ parts get tiled buffers laid out here, without loading Mesa. */
+	bool native_tiling;
+	bool has_dri;
 };
 
 const static uint32_t render_target_formats[] = { DRM_FORMAT_ABGR8888, DRM_FORMAT_ARGB8888,
@@ -41,12 +79,99 @@ const static uint32_t texture_source_formats[] = { DRM_FORMAT_BGR888, DRM_FORMAT
 						   DRM_FORMAT_R8,     DRM_FORMAT_NV21,
 						   DRM_FORMAT_NV12,   DRM_FORMAT_YVU420_ANDROID };
 
+static int amdgpu_query_family(struct driver *drv, uint32_t *family)
+{
+	int ret;
+	struct drm_amdgpu_info request;
+	struct drm_amdgpu_info_device dev_info;
+
+	memset(&request, 0, sizeof(request));
+	memset(&dev_info, 0, sizeof(dev_info));
+	request.return_pointer = (uintptr_t)&dev_info;
+	request.return_size = sizeof(dev_info);
+	request.query = AMDGPU_INFO_DEV_INFO;
+
+	ret = drmCommandWrite(drv_get_fd(drv), DRM_AMDGPU_INFO, &request, sizeof(request));
+	if (ret) {
+		drv_log("DRM_AMDGPU_INFO failed\n");
+		return ret;
+	}
+
+	*family = dev_info.family;
+	return 0;
+}
+
+/*
+ * The 64KiB standard swizzle packs a square-ish block of 64KiB worth of pixels: the block is
+ * twice as wide as it is tall when the pixel count is an odd power of two.
+ */
+static void amdgpu_gfx9_64k_s_block(uint32_t bytes_per_pixel, uint32_t *block_width,
+				    uint32_t *block_height)
+{
+	uint32_t pixel_bits = 16 - drv_log_base2(bytes_per_pixel);
+
+	*block_width = 1 << DIV_ROUND_UP(pixel_bits, 2);
+	*block_height = 1 << (pixel_bits / 2);
+}
+
+static bool amdgpu_has_native_tiling(struct amdgpu_priv *priv, uint32_t format)
+{
+	uint32_t i;
+
+	if (!priv->native_tiling)
+		return false;
+
+	for (i = 0; i < ARRAY_SIZE(render_target_formats); i++)
+		if (render_target_formats[i] == format)
+			return true;
+
+	return false;
+}
+
+/*
+ * The 64K_S layout is only programmed for GFX9 (Vega and Raven). Later families changed the
+ * swizzle modes, so they keep using radeonsi.
+ */
+static bool amdgpu_family_has_64k_s(uint32_t family)
+{
+	return family >= AMDGPU_FAMILY_AI && family <= AMDGPU_FAMILY_RV;
+}
+
+/* Tiled buffers are only scanned out on planes that list the modifier in IN_FORMATS. */
+static void amdgpu_add_kms_scanout(struct driver *drv)
+{
+	uint32_t i, j;
+	struct kms_item *item;
+	struct combination *combo;
+	struct drv_array *kms_items;
+
+	kms_items = drv_query_kms(drv);
+	if (!kms_items)
+		return;
+
+	for (i = 0; i < drv_array_size(kms_items); i++) {
+		item = (struct kms_item *)drv_array_at_idx(kms_items, i);
+		if (item->modifier != AMDGPU_FORMAT_MOD_GFX9_64K_S)
+			continue;
+
+		for (j = 0; j < drv_array_size(drv->combos); j++) {
+			combo = (struct combination *)drv_array_at_idx(drv->combos, j);
+			if (combo->format == item->format &&
+			    combo->metadata.modifier == item->modifier)
+				combo->use_flags |= BO_USE_SCANOUT;
+		}
+	}
+
+	drv_array_destroy(kms_items);
+}
+
 static int amdgpu_init(struct driver *drv)
 {
 	struct amdgpu_priv *priv;
 	drmVersionPtr drm_version;
 	struct format_metadata metadata;
 	uint64_t use_flags = BO_USE_RENDER_MASK;
+	uint32_t family = 0;
 
 	priv = calloc(1, sizeof(struct amdgpu_priv));
 	if (!priv)
@@ -63,11 +188,14 @@ static int amdgpu_init(struct driver *drv)
 
 	drv->priv = priv;
 
-	if (dri_init(drv, DRI_PATH, "radeonsi")) {
-		free(priv);
-		drv->priv = NULL;
-		return -ENODEV;
-	}
+	/*
+	 * Older parts still need radeonsi to pick their tiling. Without it, they only get linear
+	 * buffers.
+	 */
+	if (!amdgpu_query_family(drv, &family) && amdgpu_family_has_64k_s(family))
+		priv->native_tiling = true;
+	else if (!dri_init(drv, DRI_PATH, "radeonsi"))
+		priv->has_dri = true;
 
 	metadata.tiling = TILE_TYPE_LINEAR;
 	metadata.priority = 1;
@@ -97,16 +225,34 @@ static int amdgpu_init(struct driver *drv)
 	drv_modify_combination(drv, DRM_FORMAT_R8, &metadata,
 			       BO_USE_CAMERA_READ | BO_USE_CAMERA_WRITE);
 
-	/*
-	 * The following formats will be allocated by the DRI backend and may be potentially tiled.
-	 * Since format modifier support hasn't been implemented fully yet, it's not
-	 * possible to enumerate the different types of buffers (like i915 can).
-	 */
 	use_flags &= ~BO_USE_RENDERSCRIPT;
 	use_flags &= ~BO_USE_SW_WRITE_OFTEN;
 	use_flags &= ~BO_USE_SW_READ_OFTEN;
 	use_flags &= ~BO_USE_LINEAR;
 
+	if (priv->native_tiling) {
+		/* Tiled buffers aren't detiled for the CPU, and cursors must be linear. */
+		use_flags &= ~(BO_USE_SW_READ_RARELY | BO_USE_SW_WRITE_RARELY | BO_USE_CURSOR);
+
+		metadata.tiling = TILE_TYPE_GFX9_64K_S;
+		metadata.priority = 2;
+		metadata.modifier = AMDGPU_FORMAT_MOD_GFX9_64K_S;
+
+		drv_add_combinations(drv, render_target_formats,
+				     ARRAY_SIZE(render_target_formats), &metadata, use_flags);
+
+		amdgpu_add_kms_scanout(drv);
+		return 0;
+	}
+
+	if (!priv->has_dri)
+		return 0;
+
+	/*
+	 * The following formats will be allocated by the DRI backend and may be potentially tiled.
+	 * Since format modifier support hasn't been implemented fully yet, it's not
+	 * possible to enumerate the different types of buffers (like i915 can).
+	 */
 	metadata.tiling = TILE_TYPE_DRI;
 	metadata.priority = 2;
 
@@ -117,43 +263,77 @@ static int amdgpu_init(struct driver *drv)
 	drv_modify_combination(drv, DRM_FORMAT_ARGB8888, &metadata, BO_USE_CURSOR | BO_USE_SCANOUT);
 	drv_modify_combination(drv, DRM_FORMAT_XRGB8888, &metadata, BO_USE_CURSOR | BO_USE_SCANOUT);
 	drv_modify_combination(drv, DRM_FORMAT_XBGR8888, &metadata, BO_USE_SCANOUT);
+
+	/* Video frames only sampled by the GPU may be tiled too, a DRI image per plane. */
+	const uint32_t nv12_format = DRM_FORMAT_NV12;
+	drv_add_combinations(drv, &nv12_format, 1, &metadata, BO_USE_TEXTURE);
 	return 0;
 }
 
 static void amdgpu_close(struct driver *drv)
 {
-	dri_close(drv);
+	struct amdgpu_priv *priv = drv->priv;
+
+	if (priv->has_dri)
+		dri_close(drv);
+
 	free(drv->priv);
 	drv->priv = NULL;
 }
 
-static int amdgpu_create_bo(struct bo *bo, uint32_t width, uint32_t height, uint32_t format,
-			    uint64_t use_flags)
+static int amdgpu_set_tiling(struct bo *bo)
 {
 	int ret;
-	uint32_t plane, stride;
-	struct combination *combo;
-	union drm_amdgpu_gem_create gem_create;
-	struct amdgpu_priv *priv = bo->drv->priv;
+	struct drm_amdgpu_gem_metadata gem_metadata;
 
-	combo = drv_get_combination(bo->drv, format, use_flags);
-	if (!combo)
-		return -EINVAL;
+	memset(&gem_metadata, 0, sizeof(gem_metadata));
+	gem_metadata.handle = bo->handles[0].u32;
+	gem_metadata.op = AMDGPU_GEM_METADATA_OP_SET_METADATA;
+	gem_metadata.data.tiling_info = AMDGPU_TILING_SET(SWIZZLE_MODE, AMDGPU_SW_64KB_S);
 
-	if (combo->metadata.tiling == TILE_TYPE_DRI)
-		return dri_bo_create(bo, width, height, format, use_flags);
+	ret = drmCommandWriteRead(drv_get_fd(bo->drv), DRM_AMDGPU_GEM_METADATA, &gem_metadata,
+				  sizeof(gem_metadata));
+	if (ret)
+		drv_log("DRM_AMDGPU_GEM_METADATA failed\n");
 
-	stride = drv_stride_from_format(format, width, 0);
-	if (format == DRM_FORMAT_YVU420_ANDROID)
-		stride = ALIGN(stride, 128);
-	else
-		stride = ALIGN(stride, 64);
+	return ret;
+}
 
-	drv_bo_from_format(bo, stride, height, format);
+static int amdgpu_create_bo_for_modifier(struct bo *bo, uint32_t width, uint32_t height,
+					 uint32_t format, uint64_t use_flags, uint64_t modifier)
+{
+	int ret;
+	uint32_t plane, stride, block_width, block_height;
+	union drm_amdgpu_gem_create gem_create;
+	struct amdgpu_priv *priv = bo->drv->priv;
 
 	memset(&gem_create, 0, sizeof(gem_create));
+
+	if (modifier == AMDGPU_FORMAT_MOD_GFX9_64K_S) {
+		amdgpu_gfx9_64k_s_block(drv_bytes_per_pixel_from_format(format, 0), &block_width,
+					&block_height);
+		stride = drv_stride_from_format(format, ALIGN(width, block_width), 0);
+		drv_bo_from_format(bo, stride, ALIGN(height, block_height), format);
+
+		bo->tiling = TILE_TYPE_GFX9_64K_S;
+		gem_create.in.alignment = 64 * 1024;
+	} else {
+		stride = drv_stride_from_format(format, width, 0);
+		if (format == DRM_FORMAT_YVU420_ANDROID)
+			stride = ALIGN(stride, 128);
+		else
+			stride = ALIGN(stride, 64);
+
+		drv_bo_from_format(bo, stride, height, format);
+
+		bo->tiling = TILE_TYPE_LINEAR;
+		gem_create.in.alignment = 256;
+	}
+
+	for (plane = 0; plane < bo->num_planes; plane++)
+		bo->format_modifiers[plane] = modifier;
+
 	gem_create.in.bo_size = bo->total_size;
-	gem_create.in.alignment = 256;
 	gem_create.in.domain_flags = 0;
 
 	if (use_flags & (BO_USE_LINEAR | BO_USE_SW))
@@ -178,20 +358,83 @@ static int amdgpu_create_bo(struct bo *bo, uint32_t width, uint32_t height, uint
 	for (plane = 0; plane < bo->num_planes; plane++)
 		bo->handles[plane].u32 = gem_create.out.handle;
 
+	if (bo->tiling == TILE_TYPE_GFX9_64K_S) {
+		ret = amdgpu_set_tiling(bo);
+		if (ret) {
+			drv_gem_bo_destroy(bo);
+			return ret;
+		}
+	}
+
 	return 0;
 }
 
+static int amdgpu_create_bo(struct bo *bo, uint32_t width, uint32_t height, uint32_t format,
+			    uint64_t use_flags)
+{
+	int ret;
+	struct combination *combo;
+
+	combo = drv_get_combination(bo->drv, format, use_flags);
+	if (!combo)
+		return -EINVAL;
+
+	if (combo->metadata.tiling == TILE_TYPE_DRI) {
+		ret = dri_bo_create(bo, width, height, format, use_flags);
+		/* radeonsi failed to load, so fall back to the linear combination. */
+		if (ret != -ENODEV)
+			return ret;
+
+		return amdgpu_create_bo_for_modifier(bo, width, height, format, use_flags,
+						     DRM_FORMAT_MOD_LINEAR);
+	}
+
+	return amdgpu_create_bo_for_modifier(bo, width, height, format, use_flags,
+					     combo->metadata.modifier);
+}
+
+static int amdgpu_create_bo_with_modifiers(struct bo *bo, uint32_t width, uint32_t height,
+					   uint32_t format, const uint64_t *modifiers,
+					   uint32_t count)
+{
+	static const uint64_t modifier_order[] = {
+		AMDGPU_FORMAT_MOD_GFX9_64K_S,
+		DRM_FORMAT_MOD_LINEAR,
+	};
+	uint64_t modifier;
+	uint32_t offset = amdgpu_has_native_tiling(bo->drv->priv, format) ? 0 : 1;
+
+	modifier = drv_pick_modifier(modifiers, count, modifier_order + offset,
+				     ARRAY_SIZE(modifier_order) - offset);
+
+	return amdgpu_create_bo_for_modifier(bo, width, height, format,
+					     modifier == DRM_FORMAT_MOD_LINEAR ? BO_USE_LINEAR
+									       : BO_USE_NONE,
+					     modifier);
+}
+
 static int amdgpu_import_bo(struct bo *bo, struct drv_import_fd_data *data)
 {
+	int ret;
 	struct combination *combo;
+
+	if (data->format_modifiers[0] == AMDGPU_FORMAT_MOD_GFX9_64K_S) {
+		ret = drv_prime_bo_import(bo, data);
+		bo->tiling = TILE_TYPE_GFX9_64K_S;
+		return ret;
+	}
+
 	combo = drv_get_combination(bo->drv, data->format, data->use_flags);
 	if (!combo)
 		return -EINVAL;
 
-	if (combo->metadata.tiling == TILE_TYPE_DRI)
-		return dri_bo_import(bo, data);
-	else
-		return drv_prime_bo_import(bo, data);
+	if (combo->metadata.tiling == TILE_TYPE_DRI) {
+		ret = dri_bo_import(bo, data);
+		if (ret != -ENODEV)
+			return ret;
+	}
+
+	return drv_prime_bo_import(bo, data);
 }
 
 static int amdgpu_destroy_bo(struct bo *bo)
@@ -210,6 +453,12 @@ static void *amdgpu_map_bo(struct bo *bo, struct vma *vma, size_t plane, uint32_
 	if (bo->priv)
 		return dri_bo_map(bo, vma, plane, map_flags);
 
+	/* There's no CPU detiler for the native swizzle modes. */
+	if (bo->tiling == TILE_TYPE_GFX9_64K_S) {
+		drv_log("Can't map tiled amdgpu buffers\n");
+		return MAP_FAILED;
+	}
+
 	memset(&gem_map, 0, sizeof(gem_map));
 	gem_map.in.handle = bo->handles[plane].u32;
 
@@ -219,9 +468,8 @@ static void *amdgpu_map_bo(struct bo *bo, struct vma *vma, size_t plane, uint32_
 		return MAP_FAILED;
 	}
 
-	vma->length = bo->total_size;
-
-	return mmap(0, bo->total_size, drv_get_prot(map_flags), MAP_SHARED, bo->drv->fd,
+	drv_vma_from_object_start(vma);
+	return mmap(0, vma->length, drv_get_prot(map_flags), MAP_SHARED, bo->drv->fd,
 		    gem_map.out.addr_ptr);
 }
 
@@ -254,6 +502,7 @@ const struct backend backend_amdgpu = {
 	.init = amdgpu_init,
 	.close = amdgpu_close,
 	.bo_create = amdgpu_create_bo,
+	.bo_create_with_modifiers = amdgpu_create_bo_with_modifiers,
 	.bo_destroy = amdgpu_destroy_bo,
 	.bo_import = amdgpu_import_bo,
 	.bo_map = amdgpu_map_bo,
@@ -0,0 +1,612 @@
+/*
+ * Copyright 2020 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CONVERT_X86
+#endif
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
+
+#include "convert.h"
+#include "drv_priv.h"
+#include "helpers.h"
+#include "util.h"
+
+/* The planes of a mapped bo. */
+struct convert_image {
+	uint32_t format;
+	uint32_t width;
+	uint32_t height;
+	uint8_t *planes[DRV_MAX_PLANES];
+	uint32_t strides[DRV_MAX_PLANES];
+};
+
+typedef void (*convert_fn)(struct convert_image *src, struct convert_image *dst,
+			   const struct rectangle *rect);
+
+static uint8_t *convert_sample(struct convert_image *image, size_t plane, uint32_t x, uint32_t y)
+{
+	return image->planes[plane] + (size_t)y * image->strides[plane] +
+	       (size_t)x * drv_bytes_per_pixel_from_format(image->format, plane);
+}
+
+#ifdef CONVERT_X86
+static bool convert_has_avx2(void)
+{
+	static int has_avx2 = -1;
+
+	if (has_avx2 < 0)
+		has_avx2 = __builtin_cpu_supports("avx2");
+
+	return has_avx2;
+}
+#endif
+
+/*
+ * 32bpp RGB formats differ in whether red or blue comes first in memory, and in whether the
+ * last byte is alpha.
+ */
+static bool convert_is_rgb32(uint32_t format, bool *red_first, bool *has_alpha)
+{
+	switch (format) {
+	case DRM_FORMAT_ARGB8888:
+	case DRM_FORMAT_XRGB8888:
+		*red_first = false;
+		*has_alpha = format == DRM_FORMAT_ARGB8888;
+		return true;
+	case DRM_FORMAT_ABGR8888:
+	case DRM_FORMAT_XBGR8888:
+		*red_first = true;
+		*has_alpha = format == DRM_FORMAT_ABGR8888;
+		return true;
+	default:
+		*red_first = false;
+		*has_alpha = false;
+		return false;
+	}
+}
+
+static bool convert_is_yvu420(uint32_t format)
+{
+	return format == DRM_FORMAT_YVU420 || format == DRM_FORMAT_YVU420_ANDROID;
+}
+
+static void convert_row_rgb32_c(const uint8_t *src, uint8_t *dst, uint32_t width, bool swap,
+				uint32_t alpha)
+{
+	uint32_t i, p;
+
+	for (i = 0; i < width; i++) {
+		memcpy(&p, src + 4 * i, 4);
+		if (swap)
+			p = (p & 0xff00ff00) | ((p >> 16) & 0xff) | ((p & 0xff) << 16);
+		p |= alpha;
+		memcpy(dst + 4 * i, &p, 4);
+	}
+}
+
+#ifdef __SSE2__
+static void convert_row_rgb32_sse2(const uint8_t *src, uint8_t *dst, uint32_t width, bool swap,
+				   uint32_t alpha)
+{
+	uint32_t i;
+	__m128i p;
+	const __m128i ag = _mm_set1_epi32((int)0xff00ff00);
+	const __m128i low = _mm_set1_epi32(0xff);
+	const __m128i a = _mm_set1_epi32((int)alpha);
+
+	for (i = 0; i + 4 <= width; i += 4) {
+		p = _mm_loadu_si128((const __m128i *)(src + 4 * i));
+		if (swap)
+			p = _mm_or_si128(_mm_and_si128(p, ag),
+					 _mm_or_si128(_mm_and_si128(_mm_srli_epi32(p, 16), low),
+						      _mm_slli_epi32(_mm_and_si128(p, low), 16)));
+		_mm_storeu_si128((__m128i *)(dst + 4 * i), _mm_or_si128(p, a));
+	}
+
+	convert_row_rgb32_c(src + 4 * i, dst + 4 * i, width - i, swap, alpha);
+}
+#endif
+
+#ifdef CONVERT_X86
+__attribute__((target("avx2"))) static void
+convert_row_rgb32_avx2(const uint8_t *src, uint8_t *dst, uint32_t width, bool swap,
+		       uint32_t alpha)
+{
+	uint32_t i;
+	__m256i p;
+	const __m256i ag = _mm256_set1_epi32((int)0xff00ff00);
+	const __m256i low = _mm256_set1_epi32(0xff);
+	const __m256i a = _mm256_set1_epi32((int)alpha);
+
+	for (i = 0; i + 8 <= width; i += 8) {
+		p = _mm256_loadu_si256((const __m256i *)(src + 4 * i));
+		if (swap)
+			p = _mm256_or_si256(
+			    _mm256_and_si256(p, ag),
+			    _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi32(p, 16), low),
+					    _mm256_slli_epi32(_mm256_and_si256(p, low), 16)));
+		_mm256_storeu_si256((__m256i *)(dst + 4 * i), _mm256_or_si256(p, a));
+	}
+
+	convert_row_rgb32_c(src + 4 * i, dst + 4 * i, width - i, swap, alpha);
+}
+#endif
+
+#ifdef __ARM_NEON
+static void convert_row_rgb32_neon(const uint8_t *src, uint8_t *dst, uint32_t width, bool swap,
+				   uint32_t alpha)
+{
+	uint32_t i;
+	uint32x4_t p;
+	const uint32x4_t ag = vdupq_n_u32(0xff00ff00);
+	const uint32x4_t low = vdupq_n_u32(0xff);
+	const uint32x4_t a = vdupq_n_u32(alpha);
+
+	for (i = 0; i + 4 <= width; i += 4) {
+		p = vreinterpretq_u32_u8(vld1q_u8(src + 4 * i));
+		if (swap)
+			p = vorrq_u32(vandq_u32(p, ag),
+				      vorrq_u32(vandq_u32(vshrq_n_u32(p, 16), low),
+						vshlq_n_u32(vandq_u32(p, low), 16)));
+		vst1q_u8(dst + 4 * i, vreinterpretq_u8_u32(vorrq_u32(p, a)));
+	}
+
+	convert_row_rgb32_c(src + 4 * i, dst + 4 * i, width - i, swap, alpha);
+}
+#endif
+
+static void convert_row_rgb32(const uint8_t *src, uint8_t *dst, uint32_t width, bool swap,
+			      uint32_t alpha)
+{
+#ifdef CONVERT_X86
+	if (convert_has_avx2()) {
+		convert_row_rgb32_avx2(src, dst, width, swap, alpha);
+		return;
+	}
+#endif
+#if defined(__SSE2__)
+	convert_row_rgb32_sse2(src, dst, width, swap, alpha);
+#elif defined(__ARM_NEON)
+	convert_row_rgb32_neon(src, dst, width, swap, alpha);
+#else
+	convert_row_rgb32_c(src, dst, width, swap, alpha);
+#endif
+}
+
+static void convert_row_split_uv_c(const uint8_t *uv, uint8_t *u, uint8_t *v, uint32_t width)
+{
+	uint32_t i;
+
+	for (i = 0; i < width; i++) {
+		u[i] = uv[2 * i];
+		v[i] = uv[2 * i + 1];
+	}
+}
+
+#ifdef __SSE2__
+static void convert_row_split_uv_sse2(const uint8_t *uv, uint8_t *u, uint8_t *v, uint32_t width)
+{
+	uint32_t i;
+	__m128i a, b;
+	const __m128i low = _mm_set1_epi16(0xff);
+
+	for (i = 0; i + 16 <= width; i += 16) {
+		a = _mm_loadu_si128((const __m128i *)(uv + 2 * i));
+		b = _mm_loadu_si128((const __m128i *)(uv + 2 * i + 16));
+		_mm_storeu_si128((__m128i *)(u + i),
+				 _mm_packus_epi16(_mm_and_si128(a, low), _mm_and_si128(b, low)));
+		_mm_storeu_si128((__m128i *)(v + i),
+				 _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8)));
+	}
+
+	convert_row_split_uv_c(uv + 2 * i, u + i, v + i, width - i);
+}
+#endif
+
+#ifdef CONVERT_X86
+__attribute__((target("avx2"))) static void
+convert_row_split_uv_avx2(const uint8_t *uv, uint8_t *u, uint8_t *v, uint32_t width)
+{
+	uint32_t i;
+	__m256i a, b, p;
+	const __m256i low = _mm256_set1_epi16(0xff);
+
+	/* Packing works within 128-bit lanes, so the quadwords need putting back in order. */
+	for (i = 0; i + 32 <= width; i += 32) {
+		a = _mm256_loadu_si256((const __m256i *)(uv + 2 * i));
+		b = _mm256_loadu_si256((const __m256i *)(uv + 2 * i + 32));
+		p = _mm256_packus_epi16(_mm256_and_si256(a, low), _mm256_and_si256(b, low));
+		_mm256_storeu_si256((__m256i *)(u + i), _mm256_permute4x64_epi64(p, 0xd8));
+		p = _mm256_packus_epi16(_mm256_srli_epi16(a, 8), _mm256_srli_epi16(b, 8));
+		_mm256_storeu_si256((__m256i *)(v + i), _mm256_permute4x64_epi64(p, 0xd8));
+	}
+
+	convert_row_split_uv_c(uv + 2 * i, u + i, v + i, width - i);
+}
+#endif
+
+#ifdef __ARM_NEON
+static void convert_row_split_uv_neon(const uint8_t *uv, uint8_t *u, uint8_t *v, uint32_t width)
+{
+	uint32_t i;
+	uint8x16x2_t p;
+
+	for (i = 0; i + 16 <= width; i += 16) {
+		p = vld2q_u8(uv + 2 * i);
+		vst1q_u8(u + i, p.val[0]);
+		vst1q_u8(v + i, p.val[1]);
+	}
+
+	convert_row_split_uv_c(uv + 2 * i, u + i, v + i, width - i);
+}
+#endif
+
+static void convert_row_split_uv(const uint8_t *uv, uint8_t *u, uint8_t *v, uint32_t width)
+{
+#ifdef CONVERT_X86
+	if (convert_has_avx2()) {
+		convert_row_split_uv_avx2(uv, u, v, width);
+		return;
+	}
+#endif
+#if defined(__SSE2__)
+	convert_row_split_uv_sse2(uv, u, v, width);
+#elif defined(__ARM_NEON)
+	convert_row_split_uv_neon(uv, u, v, width);
+#else
+	convert_row_split_uv_c(uv, u, v, width);
+#endif
+}
+
+static void convert_row_merge_uv_c(const uint8_t *u, const uint8_t *v, uint8_t *uv, uint32_t width)
+{
+	uint32_t i;
+
+	for (i = 0; i < width; i++) {
+		uv[2 * i] = u[i];
+		uv[2 * i + 1] = v[i];
+	}
+}
+
+static void convert_row_merge_uv(const uint8_t *u, const uint8_t *v, uint8_t *uv, uint32_t width)
+{
+	uint32_t i = 0;
+
+#if defined(__SSE2__)
+	__m128i a, b;
+
+	for (; i + 16 <= width; i += 16) {
+		a = _mm_loadu_si128((const __m128i *)(u + i));
+		b = _mm_loadu_si128((const __m128i *)(v + i));
+		_mm_storeu_si128((__m128i *)(uv + 2 * i), _mm_unpacklo_epi8(a, b));
+		_mm_storeu_si128((__m128i *)(uv + 2 * i + 16), _mm_unpackhi_epi8(a, b));
+	}
+#elif defined(__ARM_NEON)
+	uint8x16x2_t p;
+
+	for (; i + 16 <= width; i += 16) {
+		p.val[0] = vld1q_u8(u + i);
+		p.val[1] = vld1q_u8(v + i);
+		vst2q_u8(uv + 2 * i, p);
+	}
+#endif
+
+	convert_row_merge_uv_c(u + i, v + i, uv + 2 * i, width - i);
+}
+
+/* Same-format copies, for every format in the layout table. */
+static void convert_copy(struct convert_image *src, struct convert_image *dst,
+			 const struct rectangle *rect)
+{
+	size_t plane, num_planes = drv_num_planes_from_format(src->format);
+	uint32_t x0, x1, y0, y1, y, hsub, vsub;
+
+	for (plane = 0; plane < num_planes; plane++) {
+		hsub = drv_horizontal_subsampling_from_format(src->format, plane);
+		vsub = drv_vertical_subsampling_from_format(src->format, plane);
+		x0 = rect->x / hsub;
+		x1 = DIV_ROUND_UP(rect->x + rect->width, hsub);
+		y0 = rect->y / vsub;
+		y1 = DIV_ROUND_UP(rect->y + rect->height, vsub);
+
+		for (y = y0; y < y1; y++)
+			memcpy(convert_sample(dst, plane, x0, y), convert_sample(src, plane, x0, y),
+			       (x1 - x0) * drv_bytes_per_pixel_from_format(src->format, plane));
+	}
+}
+
+static void convert_rgb32(struct convert_image *src, struct convert_image *dst,
+			  const struct rectangle *rect)
+{
+	uint32_t y;
+	bool src_red_first, dst_red_first, src_alpha, dst_alpha;
+
+	convert_is_rgb32(src->format, &src_red_first, &src_alpha);
+	convert_is_rgb32(dst->format, &dst_red_first, &dst_alpha);
+
+	for (y = rect->y; y < rect->y + rect->height; y++)
+		convert_row_rgb32(convert_sample(src, 0, rect->x, y),
+				  convert_sample(dst, 0, rect->x, y), rect->width,
+				  src_red_first != dst_red_first,
+				  (dst_alpha && !src_alpha) ? 0xff000000 : 0);
+}
+
+static void convert_rgb565_to_rgb32(struct convert_image *src, struct convert_image *dst,
+				    const struct rectangle *rect)
+{
+	uint16_t p;
+	uint32_t x, y, r, g, b;
+	uint8_t *s, *d;
+	bool red_first, has_alpha;
+
+	convert_is_rgb32(dst->format, &red_first, &has_alpha);
+
+	for (y = rect->y; y < rect->y + rect->height; y++) {
+		s = convert_sample(src, 0, rect->x, y);
+		d = convert_sample(dst, 0, rect->x, y);
+		for (x = 0; x < rect->width; x++, s += 2, d += 4) {
+			memcpy(&p, s, 2);
+			r = p >> 11;
+			g = (p >> 5) & 0x3f;
+			b = p & 0x1f;
+			d[red_first ? 0 : 2] = (r << 3) | (r >> 2);
+			d[1] = (g << 2) | (g >> 4);
+			d[red_first ? 2 : 0] = (b << 3) | (b >> 2);
+			d[3] = 0xff;
+		}
+	}
+}
+
+static void convert_rgb32_to_rgb565(struct convert_image *src, struct convert_image *dst,
+				    const struct rectangle *rect)
+{
+	uint16_t p;
+	uint32_t x, y;
+	uint8_t *s, *d;
+	bool red_first, has_alpha;
+
+	convert_is_rgb32(src->format, &red_first, &has_alpha);
+
+	for (y = rect->y; y < rect->y + rect->height; y++) {
+		s = convert_sample(src, 0, rect->x, y);
+		d = convert_sample(dst, 0, rect->x, y);
+		for (x = 0; x < rect->width; x++, s += 4, d += 2) {
+			p = ((s[red_first ? 0 : 2] >> 3) << 11) | ((s[1] >> 2) << 5) |
+			    (s[red_first ? 2 : 0] >> 3);
+			memcpy(d, &p, 2);
+		}
+	}
+}
+
+/*
+ * NV12 interleaves Cb and Cr in its second plane, while YVU420 keeps Cr in the second plane
+ * and Cb in the third.
+ */
+static void convert_nv12_to_yvu420(struct convert_image *src, struct convert_image *dst,
+				   const struct rectangle *rect)
+{
+	uint32_t y;
+
+	for (y = rect->y / 2; y < DIV_ROUND_UP(rect->y + rect->height, 2); y++)
+		convert_row_split_uv(convert_sample(src, 1, rect->x / 2, y),
+				     convert_sample(dst, 2, rect->x / 2, y),
+				     convert_sample(dst, 1, rect->x / 2, y),
+				     DIV_ROUND_UP(rect->x + rect->width, 2) - rect->x / 2);
+
+	for (y = rect->y; y < rect->y + rect->height; y++)
+		memcpy(convert_sample(dst, 0, rect->x, y), convert_sample(src, 0, rect->x, y),
+		       rect->width);
+}
+
+static void convert_yvu420_to_nv12(struct convert_image *src, struct convert_image *dst,
+				   const struct rectangle *rect)
+{
+	uint32_t y;
+
+	for (y = rect->y / 2; y < DIV_ROUND_UP(rect->y + rect->height, 2); y++)
+		convert_row_merge_uv(convert_sample(src, 2, rect->x / 2, y),
+				     convert_sample(src, 1, rect->x / 2, y),
+				     convert_sample(dst, 1, rect->x / 2, y),
+				     DIV_ROUND_UP(rect->x + rect->width, 2) - rect->x / 2);
+
+	for (y = rect->y; y < rect->y + rect->height; y++)
+		memcpy(convert_sample(dst, 0, rect->x, y), convert_sample(src, 0, rect->x, y),
+		       rect->width);
+}
+
+/* BT.601 limited range, in 8.8 fixed point. */
+static uint8_t convert_clamp(int32_t value)
+{
+	return value < 0 ? 0 : (value > 255 ? 255 : value);
+}
+
+static void convert_rgb32_to_nv12(struct convert_image *src, struct convert_image *dst,
+				  const struct rectangle *rect)
+{
+	uint8_t *s, *d;
+	int32_t r, g, b, n;
+	uint32_t x, y, cx, cy, dx, dy, rx, gx, bx;
+	bool red_first, has_alpha;
+
+	convert_is_rgb32(src->format, &red_first, &has_alpha);
+	rx = red_first ? 0 : 2;
+	gx = 1;
+	bx = red_first ? 2 : 0;
+
+	for (y = rect->y; y < rect->y + rect->height; y++) {
+		s = convert_sample(src, 0, rect->x, y);
+		d = convert_sample(dst, 0, rect->x, y);
+		for (x = 0; x < rect->width; x++, s += 4)
+			d[x] = ((66 * s[rx] + 129 * s[gx] + 25 * s[bx] + 128) >> 8) + 16;
+	}
+
+	/* Chroma is taken from the average of each 2x2 block. */
+	for (cy = rect->y / 2; cy < DIV_ROUND_UP(rect->y + rect->height, 2); cy++) {
+		d = convert_sample(dst, 1, rect->x / 2, cy);
+		for (cx = rect->x / 2; cx < DIV_ROUND_UP(rect->x + rect->width, 2); cx++, d += 2) {
+			r = g = b = n = 0;
+			for (dy = 0; dy < 2 && 2 * cy + dy < src->height; dy++) {
+				for (dx = 0; dx < 2 && 2 * cx + dx < src->width; dx++) {
+					s = convert_sample(src, 0, 2 * cx + dx, 2 * cy + dy);
+					r += s[rx];
+					g += s[gx];
+					b += s[bx];
+					n++;
+				}
+			}
+
+			r /= n;
+			g /= n;
+			b /= n;
+			d[0] = convert_clamp(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+			d[1] = convert_clamp(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+		}
+	}
+}
+
+static void convert_nv12_to_rgb32(struct convert_image *src, struct convert_image *dst,
+				  const struct rectangle *rect)
+{
+	uint8_t *s, *uv, *d;
+	int32_t c, du, dv;
+	uint32_t x, y;
+	bool red_first, has_alpha;
+
+	convert_is_rgb32(dst->format, &red_first, &has_alpha);
+
+	for (y = rect->y; y < rect->y + rect->height; y++) {
+		s = convert_sample(src, 0, rect->x, y);
+		d = convert_sample(dst, 0, rect->x, y);
+		for (x = rect->x; x < rect->x + rect->width; x++, s++, d += 4) {
+			uv = convert_sample(src, 1, x / 2, y / 2);
+			c = 298 * (*s - 16);
+			du = uv[0] - 128;
+			dv = uv[1] - 128;
+			d[red_first ? 0 : 2] = convert_clamp((c + 409 * dv + 128) >> 8);
+			d[1] = convert_clamp((c - 100 * du - 208 * dv + 128) >> 8);
+			d[red_first ? 2 : 0] = convert_clamp((c + 516 * du + 128) >> 8);
+			d[3] = 0xff;
+		}
+	}
+}
+
+static convert_fn convert_find(uint32_t src_format, uint32_t dst_format)
+{
+	bool src_rgb32, dst_rgb32, red_first, has_alpha;
+
+	if (src_format == dst_format ||
+	    (convert_is_yvu420(src_format) && convert_is_yvu420(dst_format)))
+		return convert_copy;
+
+	src_rgb32 = convert_is_rgb32(src_format, &red_first, &has_alpha);
+	dst_rgb32 = convert_is_rgb32(dst_format, &red_first, &has_alpha);
+
+	if (src_rgb32 && dst_rgb32)
+		return convert_rgb32;
+	if (src_format == DRM_FORMAT_RGB565 && dst_rgb32)
+		return convert_rgb565_to_rgb32;
+	if (src_rgb32 && dst_format == DRM_FORMAT_RGB565)
+		return convert_rgb32_to_rgb565;
+	if (src_format == DRM_FORMAT_NV12 && convert_is_yvu420(dst_format))
+		return convert_nv12_to_yvu420;
+	if (convert_is_yvu420(src_format) && dst_format == DRM_FORMAT_NV12)
+		return convert_yvu420_to_nv12;
+	if (src_rgb32 && dst_format == DRM_FORMAT_NV12)
+		return convert_rgb32_to_nv12;
+	if (src_format == DRM_FORMAT_NV12 && dst_rgb32)
+		return convert_nv12_to_rgb32;
+
+	return NULL;
+}
+
+bool drv_can_convert(uint32_t src_format, uint32_t dst_format)
+{
+	return convert_find(src_format, dst_format) != NULL;
+}
+
+/*
+ * Maps all planes of the bo through one mapping, the way the conversions expect to find them.
+ */
+static int convert_map(struct bo *bo, const struct rectangle *rect, uint32_t map_flags,
+		       struct mapping **mapping, struct convert_image *image)
+{
+	size_t plane;
+	uint8_t *base;
+	struct vma *vma;
+
+	if (drv_num_buffers_per_bo(bo) != 1)
+		return -EINVAL;
+
+	base = drv_bo_map(bo, rect, map_flags, mapping, 0);
+	if (base == MAP_FAILED)
+		return -EFAULT;
+
+	vma = (*mapping)->vma;
+	base -= bo->offsets[0];
+	for (plane = 0; plane < bo->num_planes; plane++) {
+		if (vma->offset || bo->offsets[plane] + bo->sizes[plane] > vma->length) {
+			drv_bo_unmap(bo, *mapping);
+			return -EINVAL;
+		}
+
+		image->planes[plane] = base + bo->offsets[plane];
+		image->strides[plane] = vma->map_strides[plane];
+	}
+
+	image->format = bo->format;
+	image->width = bo->width;
+	image->height = bo->height;
+	return 0;
+}
+
+int drv_bo_convert(struct bo *src, struct bo *dst, const struct rectangle *rect)
+{
+	int ret;
+	convert_fn convert;
+	uint32_t dst_flags = BO_MAP_WRITE;
+	struct mapping *src_mapping, *dst_mapping;
+	struct convert_image src_image, dst_image;
+
+	if (src == dst || rect->x + rect->width > MIN(src->width, dst->width) ||
+	    rect->y + rect->height > MIN(src->height, dst->height))
+		return -EINVAL;
+
+	convert = convert_find(src->format, dst->format);
+	if (!convert)
+		return -EINVAL;
+
+	/* Backends with shadow copies only fill them in on read, so partial writes need one. */
+	if (rect->x || rect->y || rect->width != dst->width || rect->height != dst->height)
+		dst_flags |= BO_MAP_READ;
+
+	ret = convert_map(src, rect, BO_MAP_READ, &src_mapping, &src_image);
+	if (ret)
+		return ret;
+
+	ret = convert_map(dst, rect, dst_flags, &dst_mapping, &dst_image);
+	if (ret) {
+		drv_bo_unmap(src, src_mapping);
+		return ret;
+	}
+
+	convert(&src_image, &dst_image, rect);
+
+	/* Backends that flush keep the mapping around, but nothing else holds this one. */
+	ret = drv_bo_flush_or_unmap(dst, dst_mapping);
+	if (!ret && dst->drv->backend->bo_flush)
+		ret = drv_bo_unmap(dst, dst_mapping);
+
+	drv_bo_unmap(src, src_mapping);
+	return ret;
+}
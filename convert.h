@@ -0,0 +1,17 @@
+/*
+ * Copyright 2020 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#ifndef CONVERT_H
+#define CONVERT_H
+
+#include <stdbool.h>
+
+#include "drv.h"
+
+bool drv_can_convert(uint32_t src_format, uint32_t dst_format);
+int drv_bo_convert(struct bo *src, struct bo *dst, const struct rectangle *rect);
+
+#endif
@@ -9,6 +9,8 @@
 #include <assert.h>
 #include <sys/mman.h>
 
+#include "../trace.h"
+
 cros_gralloc_buffer::cros_gralloc_buffer(uint32_t id, struct bo *acquire_bo,
 					 struct cros_gralloc_handle *acquire_handle)
     : id_(id), bo_(acquire_bo), hnd_(acquire_handle), refcount_(1), lockcount_(0)
@@ -60,6 +62,7 @@ int32_t cros_gralloc_buffer::lock(const struct rectangle *rect, uint32_t map_fla
 		return -EINVAL;
 	}
 
+	drv_trace_begin("gralloc_lock", bo_);
 	if (map_flags) {
 		if (lock_data_[0]) {
 			drv_bo_invalidate(bo_, lock_data_[0]);
@@ -70,6 +73,7 @@ int32_t cros_gralloc_buffer::lock(const struct rectangle *rect, uint32_t map_fla
 
 		if (vaddr == MAP_FAILED) {
 			drv_log("Mapping failed.\n");
+			drv_trace_end("gralloc_lock", bo_);
 			return -EFAULT;
 		}
 	}
@@ -78,22 +82,38 @@ int32_t cros_gralloc_buffer::lock(const struct rectangle *rect, uint32_t map_fla
 		addr[plane] = static_cast<uint8_t *>(vaddr) + drv_bo_get_plane_offset(bo_, plane);
 
 	lockcount_++;
+	drv_trace_end("gralloc_lock", bo_);
 	return 0;
 }
 
-int32_t cros_gralloc_buffer::unlock()
+int32_t cros_gralloc_buffer::unlock(int32_t *release_fence)
 {
+	bool wrote;
+
 	if (lockcount_ <= 0) {
 		drv_log("Buffer was not locked.\n");
 		return -EINVAL;
 	}
 
+	drv_trace_begin("gralloc_unlock", bo_);
 	if (!--lockcount_) {
 		if (lock_data_[0]) {
+			wrote = lock_data_[0]->vma->map_flags & BO_MAP_WRITE;
 			drv_bo_flush_or_unmap(bo_, lock_data_[0]);
 			lock_data_[0] = nullptr;
+
+			/*
+			 * A flush still queued in minigbm is covered by a fence of its own; once it
+			 * has run, the kernel orders later work behind it.
+			 */
+			if (wrote && release_fence) {
+				*release_fence = drv_bo_get_flush_fence(bo_);
+				if (*release_fence < 0)
+					*release_fence = cros_gralloc_export_fence(hnd_->fds[0]);
+			}
 		}
 	}
 
+	drv_trace_end("gralloc_unlock", bo_);
 	return 0;
 }
@@ -25,7 +25,7 @@ class cros_gralloc_buffer
 
 	int32_t lock(const struct rectangle *rect, uint32_t map_flags,
 		     uint8_t *addr[DRV_MAX_PLANES]);
-	int32_t unlock();
+	int32_t unlock(int32_t *release_fence);
 
       private:
 	cros_gralloc_buffer(cros_gralloc_buffer const &);
@@ -9,6 +9,7 @@
 
 #include <cstdlib>
 #include <fcntl.h>
+#include <unistd.h>
 #include <xf86drm.h>
 
 cros_gralloc_driver::cros_gralloc_driver() : drv_(nullptr)
@@ -251,9 +252,19 @@ int32_t cros_gralloc_driver::lock(buffer_handle_t handle, int32_t acquire_fence,
 				  const struct rectangle *rect, uint32_t map_flags,
 				  uint8_t *addr[DRV_MAX_PLANES])
 {
-	int32_t ret = cros_gralloc_sync_wait(acquire_fence);
-	if (ret)
-		return ret;
+	int32_t ret;
+
+	/*
+	 * Without CPU access there is nothing to order against the fence, so don't stall the
+	 * caller on it.
+	 */
+	if (!map_flags && acquire_fence >= 0) {
+		close(acquire_fence);
+	} else {
+		ret = cros_gralloc_sync_wait(acquire_fence);
+		if (ret)
+			return ret;
+	}
 
 	std::lock_guard<std::mutex> lock(mutex_);
 	auto hnd = cros_gralloc_convert_handle(handle);
@@ -292,9 +303,12 @@ int32_t cros_gralloc_driver::unlock(buffer_handle_t handle, int32_t *release_fen
 	 *
 	 * "A value of -1 indicates that the caller may access the buffer immediately without
 	 * waiting on a fence."
+	 *
+	 * When the kernel can export the dma-buf's fences, the buffer returns one that signals
+	 * once the flush of any CPU writes has landed.
 	 */
 	*release_fence = -1;
-	return buffer->unlock();
+	return buffer->unlock(release_fence);
 }
 
 int32_t cros_gralloc_driver::get_backing_store(buffer_handle_t handle, uint64_t *out_store)
@@ -6,7 +6,17 @@
 
 #include "cros_gralloc_helpers.h"
 
+#include <linux/dma-buf.h>
 #include <sync/sync.h>
+#include <sys/ioctl.h>
+
+#ifndef DMA_BUF_IOCTL_EXPORT_SYNC_FILE
+struct dma_buf_export_sync_file {
+	__u32 flags;
+	__s32 fd;
+};
+#define DMA_BUF_IOCTL_EXPORT_SYNC_FILE _IOWR(DMA_BUF_BASE, 2, struct dma_buf_export_sync_file)
+#endif
 
 uint32_t cros_gralloc_convert_format(int format)
 {
@@ -80,3 +90,24 @@ int32_t cros_gralloc_sync_wait(int32_t acquire_fence)
 
 	return 0;
 }
+
+int32_t cros_gralloc_export_fence(int32_t dmabuf_fd)
+{
+	struct dma_buf_export_sync_file export_sync_file = {};
+
+	/*
+	 * The fence covers the pending writers of the dma-buf, such as a host transfer queued by
+	 * the flush, so a reader waiting on it sees the CPU writes.
+	 */
+	export_sync_file.flags = DMA_BUF_SYNC_READ;
+	export_sync_file.fd = -1;
+
+	if (ioctl(dmabuf_fd, DMA_BUF_IOCTL_EXPORT_SYNC_FILE, &export_sync_file) < 0) {
+		/* Older kernels lack the ioctl, in which case the flush was synchronous. */
+		if (errno != ENOTTY)
+			drv_log("Unable to export fence, err = %s\n", strerror(errno));
+		return -1;
+	}
+
+	return export_sync_file.fd;
+}
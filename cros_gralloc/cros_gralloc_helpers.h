@@ -24,4 +24,6 @@ cros_gralloc_handle_t cros_gralloc_convert_handle(buffer_handle_t handle);
 
 int32_t cros_gralloc_sync_wait(int32_t acquire_fence);
 
+int32_t cros_gralloc_export_fence(int32_t dmabuf_fd);
+
 #endif
@@ -87,6 +87,10 @@ static uint32_t gralloc0_convert_map_usage(int map_usage)
 		map_flags |= BO_MAP_READ;
 	if (map_usage & GRALLOC_USAGE_SW_WRITE_MASK)
 		map_flags |= BO_MAP_WRITE;
+	/* Frequent CPU users shouldn't pay a fault per page on their first access. */
+	if ((map_usage & GRALLOC_USAGE_SW_READ_MASK) == GRALLOC_USAGE_SW_READ_OFTEN ||
+	    (map_usage & GRALLOC_USAGE_SW_WRITE_MASK) == GRALLOC_USAGE_SW_WRITE_OFTEN)
+		map_flags |= BO_MAP_PREFAULT;
 
 	return map_flags;
 }
@@ -13,6 +13,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <time.h>
 #include <unistd.h>
 #include <xf86drm.h>
 
@@ -21,6 +22,11 @@
 #include "helpers.h"
 #include "util.h"
 
+/* How long the DRI screen stays around once its last image is gone. */
+#ifndef DRI_IDLE_TIMEOUT_SECONDS
+#define DRI_IDLE_TIMEOUT_SECONDS 10
+#endif
+
 static const struct {
 	uint32_t drm_format;
 	int dri_image_format;
@@ -36,6 +42,11 @@ static const struct {
 	{ DRM_FORMAT_ARGB2101010, __DRI_IMAGE_FORMAT_ARGB2101010 },
 };
 
+struct dri_map_data {
+	void *map_info;
+	__DRIimage *image;
+};
+
 static int drm_format_to_dri_format(uint32_t drm_format)
 {
 	uint32_t i;
@@ -63,44 +74,117 @@ static bool lookup_extension(const __DRIextension *const *extensions, const char
 	return false;
 }
 
+/*
+ * Planar images hand out one image per plane, which the caller releases with
+ * dri_put_plane_image. Single-plane images stand for their only plane.
+ */
+static __DRIimage *dri_get_plane_image(struct dri_driver *dri, struct bo *bo, size_t plane)
+{
+	__DRIimage *image = NULL;
+
+	if (bo->num_planes > 1)
+		image = dri->image_extension->fromPlanar(bo->priv, plane, NULL);
+
+	return image ? image : bo->priv;
+}
+
+static void dri_put_plane_image(struct dri_driver *dri, struct bo *bo, __DRIimage *image)
+{
+	if (image != bo->priv)
+		dri->image_extension->destroyImage(image);
+}
+
 /*
  * The DRI GEM namespace may be different from the minigbm's driver GEM namespace. We have
- * to import into minigbm.
+ * to import into minigbm, along with the layout the DRI driver picked for each plane.
  */
 static int import_into_minigbm(struct dri_driver *dri, struct bo *bo)
 {
 	uint32_t handle;
-	int prime_fd, ret;
+	size_t plane, i, end;
+	int prime_fd, ret, num_planes, stride, offset, modifier_upper, modifier_lower;
+	off_t dmabuf_sizes[DRV_MAX_PLANES];
+	uint64_t modifier = bo->format_modifiers[0];
+	__DRIimage *image;
 
-	if (!dri->image_extension->queryImage(bo->priv, __DRI_IMAGE_ATTRIB_FD, &prime_fd))
+	if (!dri->image_extension->queryImage(bo->priv, __DRI_IMAGE_ATTRIB_NUM_PLANES, &num_planes))
 		return -errno;
 
-	ret = drmPrimeFDToHandle(bo->drv->fd, prime_fd, &handle);
-	if (ret) {
-		drv_log("drmPrimeFDToHandle failed with %s\n", strerror(errno));
-		return ret;
+	if (num_planes < 1 || num_planes > DRV_MAX_PLANES)
+		return -EINVAL;
+
+	if (dri->image_extension->queryImage(bo->priv, __DRI_IMAGE_ATTRIB_MODIFIER_UPPER,
+					     &modifier_upper) &&
+	    dri->image_extension->queryImage(bo->priv, __DRI_IMAGE_ATTRIB_MODIFIER_LOWER,
+					     &modifier_lower))
+		modifier = ((uint64_t)modifier_upper << 32) | (uint32_t)modifier_lower;
+
+	bo->num_planes = num_planes;
+	for (plane = 0; plane < bo->num_planes; plane++) {
+		image = dri_get_plane_image(dri, bo, plane);
+		if (!dri->image_extension->queryImage(image, __DRI_IMAGE_ATTRIB_STRIDE, &stride) ||
+		    !dri->image_extension->queryImage(image, __DRI_IMAGE_ATTRIB_OFFSET, &offset) ||
+		    !dri->image_extension->queryImage(image, __DRI_IMAGE_ATTRIB_FD, &prime_fd)) {
+			ret = -errno;
+			dri_put_plane_image(dri, bo, image);
+			goto close_handles;
+		}
+		dri_put_plane_image(dri, bo, image);
+
+		dmabuf_sizes[plane] = lseek(prime_fd, 0, SEEK_END);
+		ret = drmPrimeFDToHandle(bo->drv->fd, prime_fd, &handle);
+		close(prime_fd);
+		if (ret) {
+			drv_log("drmPrimeFDToHandle failed with %s\n", strerror(errno));
+			goto close_handles;
+		}
+
+		bo->handles[plane].u32 = handle;
+		bo->strides[plane] = stride;
+		bo->offsets[plane] = offset;
+		bo->format_modifiers[plane] = modifier;
+	}
+
+	/* Each plane runs up to the next plane in the same buffer, or to the end of it. */
+	bo->total_size = 0;
+	for (plane = 0; plane < bo->num_planes; plane++) {
+		if (dmabuf_sizes[plane] > 0)
+			end = dmabuf_sizes[plane];
+		else
+			end = bo->offsets[plane] +
+			      (size_t)bo->strides[plane] *
+				  drv_height_from_format(bo->format, bo->height, plane);
+
+		for (i = 0; i < bo->num_planes; i++)
+			if (bo->handles[i].u32 == bo->handles[plane].u32 &&
+			    bo->offsets[i] > bo->offsets[plane] && bo->offsets[i] < end)
+				end = bo->offsets[i];
+
+		bo->sizes[plane] = end - bo->offsets[plane];
+		bo->total_size = MAX(bo->total_size, end);
 	}
 
-	bo->handles[0].u32 = handle;
-	close(prime_fd);
 	return 0;
+
+close_handles:
+	bo->num_planes = plane;
+	drv_gem_bo_destroy(bo);
+	return ret;
 }
 
 /*
- * The caller is responsible for setting drv->priv to a structure that derives from dri_driver.
+ * Opens the DRI driver library and looks up its entry points. Called with dri->lock held.
  */
-int dri_init(struct driver *drv, const char *dri_so_path, const char *driver_suffix)
+static int dri_open(struct dri_driver *dri)
 {
 	char fname[128];
 	const __DRIextension **(*get_extensions)();
-	const __DRIextension *loader_extensions[] = { NULL };
 
-	struct dri_driver *dri = drv->priv;
-	dri->driver_handle = dlopen(dri_so_path, RTLD_NOW | RTLD_GLOBAL);
+	dri->driver_handle = dlopen(dri->dri_so_path, RTLD_NOW | RTLD_GLOBAL);
 	if (!dri->driver_handle)
 		return -ENODEV;
 
-	snprintf(fname, sizeof(fname), __DRI_DRIVER_GET_EXTENSIONS "_%s", driver_suffix);
+	snprintf(fname, sizeof(fname), __DRI_DRIVER_GET_EXTENSIONS "_%s", dri->driver_suffix);
 	get_extensions = dlsym(dri->driver_handle, fname);
 	if (!get_extensions)
 		goto free_handle;
@@ -118,10 +202,29 @@ int dri_init(struct driver *drv, const char *dri_so_path, const char *driver_suf
 			      (const __DRIextension **)&dri->dri2_extension))
 		goto free_handle;
 
-	dri->device = dri->dri2_extension->createNewScreen2(0, drv_get_fd(drv), loader_extensions,
+	return 0;
+
+free_handle:
+	dlclose(dri->driver_handle);
+	dri->driver_handle = NULL;
+	return -ENODEV;
+}
+
+/*
+ * Creates the DRI screen and context, opening the driver first if needed. Called with
+ * dri->lock held.
+ */
+static int dri_load(struct dri_driver *dri)
+{
+	const __DRIextension *loader_extensions[] = { NULL };
+
+	if (!dri->driver_handle && dri_open(dri))
+		goto fail;
+
+	dri->device = dri->dri2_extension->createNewScreen2(0, dri->fd, loader_extensions,
 							    dri->extensions, &dri->configs, NULL);
 	if (!dri->device)
-		goto free_handle;
+		goto fail;
 
 	dri->context =
 	    dri->dri2_extension->createNewContext(dri->device, *dri->configs, NULL, NULL);
@@ -141,14 +244,122 @@ int dri_init(struct driver *drv, const char *dri_so_path, const char *driver_suf
 
 free_context:
 	dri->core_extension->destroyContext(dri->context);
+	dri->context = NULL;
 free_screen:
 	dri->core_extension->destroyScreen(dri->device);
-free_handle:
-	dlclose(dri->driver_handle);
-	dri->driver_handle = NULL;
+	dri->device = NULL;
+fail:
+	drv_log("Failed to load the DRI driver %s\n", dri->dri_so_path);
+	dri->load_failed = true;
 	return -ENODEV;
 }
 
+/*
+ * Called with dri->lock held, once no images are left. The library stays open, since Mesa
+ * drivers aren't built to be closed and reopened within a process.
+ */
+static void dri_unload(struct dri_driver *dri)
+{
+	dri->core_extension->destroyContext(dri->context);
+	dri->core_extension->destroyScreen(dri->device);
+	dri->context = NULL;
+	dri->device = NULL;
+}
+
+/*
+ * Destroys the DRI screen once it has gone DRI_IDLE_TIMEOUT_SECONDS without any images, then
+ * exits. The next image to be created loads the screen again and starts a new one.
+ */
+static void *dri_idle_thread(void *arg)
+{
+	int ret;
+	struct timespec deadline;
+	struct dri_driver *dri = arg;
+
+	pthread_mutex_lock(&dri->lock);
+	while (dri->device && !dri->closing) {
+		if (dri->num_images) {
+			pthread_cond_wait(&dri->idle_cond, &dri->lock);
+			continue;
+		}
+
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += DRI_IDLE_TIMEOUT_SECONDS;
+		ret = pthread_cond_timedwait(&dri->idle_cond, &dri->lock, &deadline);
+		if (ret == ETIMEDOUT && !dri->num_images && !dri->closing)
+			dri_unload(dri);
+	}
+	pthread_mutex_unlock(&dri->lock);
+
+	return NULL;
+}
+
+/*
+ * Takes a reference on the DRI driver for a new image, loading it if needed.
+ */
+static int dri_get(struct dri_driver *dri)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&dri->lock);
+	if (dri->load_failed) {
+		ret = -ENODEV;
+		goto out;
+	}
+
+	if (!dri->device) {
+		/* A previous idle thread has unloaded the driver and is on its way out. */
+		if (dri->has_idle_thread) {
+			pthread_join(dri->idle_thread, NULL);
+			dri->has_idle_thread = false;
+		}
+
+		ret = dri_load(dri);
+		if (ret)
+			goto out;
+
+		if (!pthread_create(&dri->idle_thread, NULL, dri_idle_thread, dri))
+			dri->has_idle_thread = true;
+	}
+
+	dri->num_images++;
+	pthread_cond_signal(&dri->idle_cond);
+
+out:
+	pthread_mutex_unlock(&dri->lock);
+	return ret;
+}
+
+static void dri_put(struct dri_driver *dri)
+{
+	pthread_mutex_lock(&dri->lock);
+	assert(dri->num_images);
+	if (!--dri->num_images)
+		pthread_cond_signal(&dri->idle_cond);
+	pthread_mutex_unlock(&dri->lock);
+}
+
+/*
+ * The caller is responsible for setting drv->priv to a structure that derives from dri_driver.
+ * The driver itself isn't loaded until the first image is created or imported. If that fails,
+ * every DRI image fails with -ENODEV from then on, and the caller should fall back to its own
+ * layouts.
+ */
+int dri_init(struct driver *drv, const char *dri_so_path, const char *driver_suffix)
+{
+	struct dri_driver *dri = drv->priv;
+
+	if (access(dri_so_path, R_OK))
+		return -ENODEV;
+
+	dri->dri_so_path = dri_so_path;
+	dri->driver_suffix = driver_suffix;
+	dri->fd = drv_get_fd(drv);
+	pthread_mutex_init(&dri->lock, NULL);
+	pthread_cond_init(&dri->idle_cond, NULL);
+	return 0;
+}
+
 /*
  * The caller is responsible for freeing drv->priv.
  */
@@ -156,20 +367,127 @@ void dri_close(struct driver *drv)
 {
 	struct dri_driver *dri = drv->priv;
 
-	dri->core_extension->destroyContext(dri->context);
-	dri->core_extension->destroyScreen(dri->device);
-	dlclose(dri->driver_handle);
-	dri->driver_handle = NULL;
+	pthread_mutex_lock(&dri->lock);
+	dri->closing = true;
+	pthread_cond_signal(&dri->idle_cond);
+	pthread_mutex_unlock(&dri->lock);
+
+	if (dri->has_idle_thread)
+		pthread_join(dri->idle_thread, NULL);
+
+	if (dri->device)
+		dri_unload(dri);
+	if (dri->driver_handle)
+		dlclose(dri->driver_handle);
+
+	pthread_cond_destroy(&dri->idle_cond);
+	pthread_mutex_destroy(&dri->lock);
+}
+
+/*
+ * Shared images are fresh GEM allocations, which the kernel zeroes, but nothing stops the driver
+ * from handing out memory it recycled itself. Callers that need zeroes get them cleared through
+ * a write-only mapping.
+ */
+static int dri_bo_clear(struct dri_driver *dri, struct bo *bo)
+{
+	int stride, ret = 0;
+	size_t plane, num_planes;
+	uint32_t width, height;
+	void *addr, *map_info;
+	__DRIimage *image;
+
+	/* Auxiliary planes past the format's own hold metadata, not pixels. */
+	num_planes = MIN(bo->num_planes, drv_num_planes_from_format(bo->format));
+
+	pthread_mutex_lock(&bo->drv->driver_lock);
+
+	for (plane = 0; plane < num_planes; plane++) {
+		width = DIV_ROUND_UP(bo->width,
+				     drv_horizontal_subsampling_from_format(bo->format, plane));
+		height = drv_height_from_format(bo->format, bo->height, plane);
+		image = dri_get_plane_image(dri, bo, plane);
+
+		map_info = NULL;
+		addr = dri->image_extension->mapImage(dri->context, image, 0, 0, width, height,
+						      BO_MAP_WRITE, &stride, &map_info);
+		if (!addr) {
+			ret = -errno;
+			dri_put_plane_image(dri, bo, image);
+			break;
+		}
+
+		drv_clear_memory(addr, (size_t)stride * height);
+
+		dri->image_extension->unmapImage(dri->context, image, map_info);
+		dri_put_plane_image(dri, bo, image);
+	}
+
+	dri->flush_extension->flush_with_flags(dri->context, NULL, __DRI2_FLUSH_CONTEXT, 0);
+
+	pthread_mutex_unlock(&bo->drv->driver_lock);
+	return ret;
+}
+
+/*
+ * Planar formats have no __DRI_IMAGE_FORMAT, so each plane is allocated as an R8 or GR88 image
+ * of its own, and the planes are put together by importing them as one image of the format. The
+ * driver keeps the layout it picked for each plane with its buffer, as for any implicit import.
+ */
+static __DRIimage *dri_create_planar_image(struct dri_driver *dri, uint32_t width,
+					   uint32_t height, uint32_t format, unsigned int dri_use)
+{
+	size_t plane, num_planes = drv_num_planes_from_format(format);
+	int dri_format, fds[DRV_MAX_PLANES], strides[DRV_MAX_PLANES], offsets[DRV_MAX_PLANES];
+	__DRIimage *image = NULL, *planes[DRV_MAX_PLANES] = { NULL };
+
+	for (plane = 0; plane < num_planes; plane++)
+		fds[plane] = -1;
+
+	for (plane = 0; plane < num_planes; plane++) {
+		dri_format = drv_bytes_per_pixel_from_format(format, plane) == 1
+				 ? __DRI_IMAGE_FORMAT_R8
+				 : __DRI_IMAGE_FORMAT_GR88;
+		planes[plane] = dri->image_extension->createImage(
+		    dri->device,
+		    DIV_ROUND_UP(width, drv_horizontal_subsampling_from_format(format, plane)),
+		    drv_height_from_format(format, height, plane), dri_format, dri_use, NULL);
+		if (!planes[plane])
+			goto destroy_planes;
+
+		if (!dri->image_extension->queryImage(planes[plane], __DRI_IMAGE_ATTRIB_STRIDE,
+						      &strides[plane]) ||
+		    !dri->image_extension->queryImage(planes[plane], __DRI_IMAGE_ATTRIB_OFFSET,
+						      &offsets[plane]) ||
+		    !dri->image_extension->queryImage(planes[plane], __DRI_IMAGE_ATTRIB_FD,
+						      &fds[plane])) {
+			errno = EINVAL;
+			goto destroy_planes;
+		}
+	}
+
+	/* The planes' own images go away below, but the planar image keeps their buffers. */
+	image = dri->image_extension->createImageFromFds(dri->device, width, height, format, fds,
+							 num_planes, strides, offsets, NULL);
+
+destroy_planes:
+	for (plane = 0; plane < num_planes; plane++) {
+		if (fds[plane] >= 0)
+			close(fds[plane]);
+		if (planes[plane])
+			dri->image_extension->destroyImage(planes[plane]);
+	}
+
+	return image;
 }
 
 int dri_bo_create(struct bo *bo, uint32_t width, uint32_t height, uint32_t format,
 		  uint64_t use_flags)
 {
 	unsigned int dri_use;
-	int ret, dri_format, stride, offset;
+	int ret, dri_format;
 	struct dri_driver *dri = bo->drv->priv;
 
-	assert(bo->num_planes == 1);
 	dri_format = drm_format_to_dri_format(format);
 
 	/* Gallium drivers require shared to get the handle and stride. */
@@ -181,10 +499,18 @@ int dri_bo_create(struct bo *bo, uint32_t width, uint32_t height, uint32_t forma
 	if (use_flags & BO_USE_LINEAR)
 		dri_use |= __DRI_IMAGE_USE_LINEAR;
 
-	bo->priv = dri->image_extension->createImage(dri->device, width, height, dri_format,
-						     dri_use, NULL);
+	ret = dri_get(dri);
+	if (ret)
+		return ret;
+
+	if (drv_num_planes_from_format(format) > 1)
+		bo->priv = dri_create_planar_image(dri, width, height, format, dri_use);
+	else
+		bo->priv = dri->image_extension->createImage(dri->device, width, height,
+							     dri_format, dri_use, NULL);
 	if (!bo->priv) {
 		ret = -errno;
+		dri_put(dri);
 		return ret;
 	}
 
@@ -192,24 +518,21 @@ int dri_bo_create(struct bo *bo, uint32_t width, uint32_t height, uint32_t forma
 	if (ret)
 		goto free_image;
 
-	if (!dri->image_extension->queryImage(bo->priv, __DRI_IMAGE_ATTRIB_STRIDE, &stride)) {
-		ret = -errno;
-		goto free_image;
-	}
-
-	if (!dri->image_extension->queryImage(bo->priv, __DRI_IMAGE_ATTRIB_OFFSET, &offset)) {
-		ret = -errno;
-		goto free_image;
+	if (use_flags & BO_USE_CLEAR) {
+		ret = dri_bo_clear(dri, bo);
+		if (ret)
+			goto close_handle;
 	}
 
-	bo->strides[0] = stride;
-	bo->sizes[0] = stride * height;
-	bo->offsets[0] = offset;
-	bo->total_size = offset + bo->sizes[0];
 	return 0;
 
+close_handle:
+	drv_gem_bo_destroy(bo);
+
 free_image:
 	dri->image_extension->destroyImage(bo->priv);
+	bo->priv = NULL;
+	dri_put(dri);
 	return ret;
 }
 
@@ -218,7 +541,9 @@ int dri_bo_import(struct bo *bo, struct drv_import_fd_data *data)
 	int ret;
 	struct dri_driver *dri = bo->drv->priv;
 
-	assert(bo->num_planes == 1);
+	ret = dri_get(dri);
+	if (ret)
+		return ret;
 
 	// clang-format off
 	bo->priv = dri->image_extension->createImageFromFds(dri->device, data->width, data->height,
@@ -226,12 +551,17 @@ int dri_bo_import(struct bo *bo, struct drv_import_fd_data *data)
 							    (int *)data->strides,
 							    (int *)data->offsets, NULL);
 	// clang-format on
-	if (!bo->priv)
-		return -errno;
+	if (!bo->priv) {
+		ret = -errno;
+		dri_put(dri);
+		return ret;
+	}
 
 	ret = import_into_minigbm(dri, bo);
 	if (ret) {
 		dri->image_extension->destroyImage(bo->priv);
+		bo->priv = NULL;
+		dri_put(dri);
 		return ret;
 	}
 
@@ -245,6 +575,7 @@ int dri_bo_destroy(struct bo *bo)
 	assert(bo->priv);
 	dri->image_extension->destroyImage(bo->priv);
 	bo->priv = NULL;
+	dri_put(dri);
 	return 0;
 }
 
@@ -259,14 +590,60 @@ int dri_bo_destroy(struct bo *bo)
  */
 void *dri_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint32_t map_flags)
 {
+	int stride;
+	size_t end = vma->offset + vma->length;
+	uint32_t width, height, y0, y1;
+	struct dri_map_data *data;
 	struct dri_driver *dri = bo->drv->priv;
 
+	/* There's nothing to map in auxiliary planes. */
+	if (plane >= drv_num_planes_from_format(bo->format))
+		return MAP_FAILED;
+
+	width = DIV_ROUND_UP(bo->width, drv_horizontal_subsampling_from_format(bo->format, plane));
+	height = drv_height_from_format(bo->format, bo->height, plane);
+
+	/* Only have the rows the caller needs blitted. */
+	y0 = 0;
+	y1 = height;
+	if (vma->offset > bo->offsets[plane])
+		y0 = (vma->offset - bo->offsets[plane]) / bo->strides[plane];
+	if (end > bo->offsets[plane])
+		y1 = MIN(y1, DIV_ROUND_UP(end - bo->offsets[plane], bo->strides[plane]));
+	if (y0 >= y1) {
+		y0 = 0;
+		y1 = height;
+	}
+
+	data = calloc(1, sizeof(*data));
+	if (!data)
+		return MAP_FAILED;
+
+	data->image = dri_get_plane_image(dri, bo, plane);
+
 	/* GBM flags and DRI flags are the same. */
-	vma->addr =
-	    dri->image_extension->mapImage(dri->context, bo->priv, 0, 0, bo->width, bo->height,
-					   map_flags, (int *)&vma->map_strides[plane], &vma->priv);
-	if (!vma->addr)
+	vma->addr = dri->image_extension->mapImage(dri->context, data->image, 0, y0, width,
+						   y1 - y0, map_flags, &stride, &data->map_info);
+	if (!vma->addr) {
+		dri_put_plane_image(dri, bo, data->image);
+		free(data);
 		return MAP_FAILED;
+	}
+
+	vma->priv = data;
+
+	/*
+	 * The map may be a staging copy with a stride of its own; describe it in that layout.
+	 * Planes of planar images are mapped separately, so only those cover the whole bo.
+	 */
+	vma->map_strides[plane] = stride;
+	if (y0 == 0 && y1 == height && bo->num_planes == 1) {
+		vma->offset = 0;
+		vma->length = bo->total_size;
+	} else {
+		vma->offset = bo->offsets[plane] + (size_t)y0 * stride;
+		vma->length = (size_t)(y1 - y0) * stride;
+	}
 
 	return vma->addr;
 }
@@ -274,9 +651,13 @@ void *dri_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint32_t map_flag
 int dri_bo_unmap(struct bo *bo, struct vma *vma)
 {
 	struct dri_driver *dri = bo->drv->priv;
+	struct dri_map_data *data = vma->priv;
 
-	assert(vma->priv);
-	dri->image_extension->unmapImage(dri->context, bo->priv, vma->priv);
+	assert(data);
+	dri->image_extension->unmapImage(dri->context, data->image, data->map_info);
+	dri_put_plane_image(dri, bo, data->image);
+	free(data);
+	vma->priv = NULL;
 
 	/*
 	 * From gbm_dri.c in Mesa:
@@ -284,9 +665,13 @@ int dri_bo_unmap(struct bo *bo, struct vma *vma)
 	 * "Not all DRI drivers use direct maps. They may queue up DMA operations
 	 *  on the mapping context. Since there is no explicit gbm flush mechanism,
 	 *  we need to flush here."
+	 *
+	 * Read-only maps don't queue a write back. Every write map does, and nothing else is sure
+	 * to submit it, so each of them flushes.
 	 */
-
-	dri->flush_extension->flush_with_flags(dri->context, NULL, __DRI2_FLUSH_CONTEXT, 0);
+	if (vma->map_flags & BO_MAP_WRITE)
+		dri->flush_extension->flush_with_flags(dri->context, NULL, __DRI2_FLUSH_CONTEXT,
+						       0);
 	return 0;
 }
 
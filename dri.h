@@ -6,6 +6,9 @@
 
 #ifdef DRV_AMDGPU
 
+#include <pthread.h>
+#include <stdbool.h>
+
 typedef int GLint;
 typedef unsigned int GLuint;
 typedef unsigned char GLboolean;
@@ -14,6 +17,23 @@ typedef unsigned char GLboolean;
 #include "drv.h"
 
 struct dri_driver {
+	/*
+	 * The DRI driver is only loaded once an image is needed. Its screen is destroyed again
+	 * after it has had no images for a while, but the library stays open until dri_close.
+	 * lock protects everything below it.
+	 */
+	const char *dri_so_path;
+	const char *driver_suffix;
+	int fd;
+	pthread_mutex_t lock;
+	pthread_cond_t idle_cond;
+	pthread_t idle_thread;
+	bool has_idle_thread;
+	bool closing;
+	/* Set once loading has failed, so later images fail fast instead of retrying. */
+	bool load_failed;
+	uint32_t num_images;
+
 	void *driver_handle;
 	__DRIscreen *device;
 	__DRIcontext *context; /* Needed for map/unmap operations. */
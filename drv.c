@@ -21,8 +21,10 @@
 #include <libgen.h>
 #endif
 
+#include "convert.h"
 #include "drv_priv.h"
 #include "helpers.h"
+#include "trace.h"
 #include "util.h"
 
 #ifdef DRV_AMDGPU
@@ -124,6 +126,132 @@ static const struct backend *drv_get_backend(int fd)
 	return NULL;
 }
 
+/*
+ * Setting MINIGBM_ASYNC_FLUSH to a thread count moves backend flushes (re-tiling, shadow copies,
+ * cache flushes, host transfers) onto a pool of worker threads. Flushes of the same buffer run in
+ * the order they were queued, and anything that needs the flushed contents waits for them.
+ */
+static struct flush_job *drv_next_flush_job(struct driver *drv)
+{
+	struct flush_job *job, *prior;
+
+	for (job = drv->flush_jobs; job; job = job->next) {
+		if (job->running)
+			continue;
+
+		for (prior = drv->flush_jobs; prior != job; prior = prior->next)
+			if (prior->mapping->vma->handle == job->mapping->vma->handle)
+				break;
+
+		if (prior == job)
+			return job;
+	}
+
+	return NULL;
+}
+
+static void *drv_flush_thread(void *arg)
+{
+	int ret;
+	uint32_t inc = 1;
+	struct flush_job *job, **link;
+	struct driver *drv = (struct driver *)arg;
+
+	pthread_mutex_lock(&drv->flush_lock);
+	while (true) {
+		job = drv_next_flush_job(drv);
+		if (!job) {
+			if (drv->flush_exit && !drv->flush_jobs)
+				break;
+
+			pthread_cond_wait(&drv->flush_cond, &drv->flush_lock);
+			continue;
+		}
+
+		job->running = true;
+		pthread_mutex_unlock(&drv->flush_lock);
+
+		ret = drv->backend->bo_flush(job->bo, job->mapping);
+		if (ret)
+			drv_log("Asynchronous flush failed with %d\n", ret);
+
+		pthread_mutex_lock(&drv->flush_lock);
+		for (link = &drv->flush_jobs; *link != job; link = &(*link)->next)
+			;
+		*link = job->next;
+		if (job->timeline_fd >= 0) {
+			drmIoctl(job->timeline_fd, SW_SYNC_IOC_INC, &inc);
+			close(job->timeline_fd);
+		}
+		free(job);
+		pthread_cond_broadcast(&drv->flush_cond);
+	}
+	pthread_mutex_unlock(&drv->flush_lock);
+
+	return NULL;
+}
+
+static void drv_start_flush_threads(struct driver *drv)
+{
+	long i, count;
+	const char *env = getenv("MINIGBM_ASYNC_FLUSH");
+
+	pthread_mutex_init(&drv->flush_lock, NULL);
+	pthread_cond_init(&drv->flush_cond, NULL);
+
+	if (!env || !drv->backend->bo_flush)
+		return;
+
+	count = MIN(strtol(env, NULL, 0), DRV_MAX_FLUSH_THREADS);
+	for (i = 0; i < count; i++) {
+		if (pthread_create(&drv->flush_threads[i], NULL, drv_flush_thread, drv)) {
+			drv_log("Unable to start flush thread\n");
+			break;
+		}
+
+		drv->num_flush_threads++;
+	}
+}
+
+static void drv_stop_flush_threads(struct driver *drv)
+{
+	uint32_t i;
+
+	pthread_mutex_lock(&drv->flush_lock);
+	drv->flush_exit = true;
+	pthread_cond_broadcast(&drv->flush_cond);
+	pthread_mutex_unlock(&drv->flush_lock);
+
+	for (i = 0; i < drv->num_flush_threads; i++)
+		pthread_join(drv->flush_threads[i], NULL);
+
+	pthread_cond_destroy(&drv->flush_cond);
+	pthread_mutex_destroy(&drv->flush_lock);
+}
+
+static int drv_queue_flush(struct bo *bo, struct mapping *mapping)
+{
+	struct flush_job *job, **link;
+	struct driver *drv = bo->drv;
+
+	job = (struct flush_job *)calloc(1, sizeof(*job));
+	if (!job)
+		return drv->backend->bo_flush(bo, mapping);
+
+	job->bo = bo;
+	job->mapping = mapping;
+	job->timeline_fd = -1;
+
+	pthread_mutex_lock(&drv->flush_lock);
+	for (link = &drv->flush_jobs; *link; link = &(*link)->next)
+		;
+	*link = job;
+	pthread_cond_broadcast(&drv->flush_cond);
+	pthread_mutex_unlock(&drv->flush_lock);
+
+	return 0;
+}
+
 struct driver *drv_create(int fd)
 {
 	struct driver *drv;
@@ -134,8 +262,11 @@ struct driver *drv_create(int fd)
 	if (!drv)
 		return NULL;
 
+	drv_trace_init();
+
 	drv->fd = fd;
 	drv->backend = drv_get_backend(fd);
+	drv->numa_node = drv_get_numa_node(fd);
 
 	if (!drv->backend)
 		goto free_driver;
@@ -151,20 +282,28 @@ struct driver *drv_create(int fd)
 	if (!drv->mappings)
 		goto free_buffer_table;
 
+	drv->format_stats = drv_array_init(sizeof(struct drv_format_stats));
+	if (!drv->format_stats)
+		goto free_mappings;
+
 	drv->combos = drv_array_init(sizeof(struct combination));
 	if (!drv->combos)
-		goto free_mappings;
+		goto free_format_stats;
 
 	if (drv->backend->init) {
 		ret = drv->backend->init(drv);
 		if (ret) {
 			drv_array_destroy(drv->combos);
-			goto free_mappings;
+			goto free_format_stats;
 		}
 	}
 
+	drv_start_flush_threads(drv);
+
 	return drv;
 
+free_format_stats:
+	drv_array_destroy(drv->format_stats);
 free_mappings:
 	drv_array_destroy(drv->mappings);
 free_buffer_table:
@@ -178,6 +317,9 @@ free_driver:
 
 void drv_destroy(struct driver *drv)
 {
+	drv_stop_flush_threads(drv);
+	drv_trace_dump();
+
 	pthread_mutex_lock(&drv->driver_lock);
 
 	if (drv->backend->close)
@@ -185,6 +327,7 @@ void drv_destroy(struct driver *drv)
 
 	drmHashDestroy(drv->buffer_table);
 	drv_array_destroy(drv->mappings);
+	drv_array_destroy(drv->format_stats);
 	drv_array_destroy(drv->combos);
 
 	pthread_mutex_unlock(&drv->driver_lock);
@@ -210,6 +353,8 @@ struct combination *drv_get_combination(struct driver *drv, uint32_t format, uin
 	if (format == DRM_FORMAT_NONE || use_flags == BO_USE_NONE)
 		return 0;
 
+	use_flags &= ~BO_USE_MEMORY_HINTS;
+
 	best = NULL;
 	uint32_t i;
 	for (i = 0; i < drv_array_size(drv->combos); i++) {
@@ -222,6 +367,67 @@ struct combination *drv_get_combination(struct driver *drv, uint32_t format, uin
 	return best;
 }
 
+/*
+ * Collects the modifiers of the combinations that support format with use_flags, ranked by
+ * the backend's priority for them, so the most bandwidth-efficient layouts come first. Copies up
+ * to max_modifiers of them and returns how many there are in all.
+ */
+uint32_t drv_query_modifiers(struct driver *drv, uint32_t format, uint64_t use_flags,
+			     uint64_t *modifiers, uint32_t max_modifiers)
+{
+	uint32_t i, j, count = 0;
+	struct combination *curr, **ranked;
+
+	use_flags &= ~BO_USE_MEMORY_HINTS;
+
+	ranked = calloc(drv_array_size(drv->combos), sizeof(*ranked));
+	if (!ranked)
+		return 0;
+
+	/*
+	 * Insertion sort by descending priority. A modifier is listed once, at the highest
+	 * priority any combination gives it.
+	 */
+	for (i = 0; i < drv_array_size(drv->combos); i++) {
+		curr = drv_array_at_idx(drv->combos, i);
+		if (format != curr->format || use_flags != (curr->use_flags & use_flags))
+			continue;
+
+		for (j = 0; j < count; j++)
+			if (ranked[j]->metadata.modifier == curr->metadata.modifier)
+				break;
+
+		if (j < count) {
+			if (ranked[j]->metadata.priority >= curr->metadata.priority)
+				continue;
+
+			memmove(&ranked[j], &ranked[j + 1], (count - j - 1) * sizeof(*ranked));
+			count--;
+		}
+
+		for (j = count; j > 0 && ranked[j - 1]->metadata.priority < curr->metadata.priority;
+		     j--)
+			ranked[j] = ranked[j - 1];
+
+		ranked[j] = curr;
+		count++;
+	}
+
+	for (i = 0; i < count && i < max_modifiers; i++)
+		modifiers[i] = ranked[i]->metadata.modifier;
+
+	free(ranked);
+	return count;
+}
+
+uint32_t drv_num_planes_from_modifier(struct driver *drv, uint32_t format, uint64_t modifier)
+{
+	if (drv->backend->num_planes_from_modifier)
+		return drv->backend->num_planes_from_modifier(format, modifier);
+
+	return drv_num_planes_from_format(format);
+}
+
 struct bo *drv_bo_new(struct driver *drv, uint32_t width, uint32_t height, uint32_t format,
 		      uint64_t use_flags)
 {
@@ -247,6 +453,31 @@ struct bo *drv_bo_new(struct driver *drv, uint32_t width, uint32_t height, uint3
 	return bo;
 }
 
+/*
+ * Checks an allocation of size bytes against the budget, with the driver lock held. A size of 0
+ * checks whether anything is left, so callers can fail before the backend does any work.
+ */
+static bool drv_over_budget(struct driver *drv, size_t size)
+{
+	if (!drv->stats.budget || drv->stats.bytes + MAX(size, 1) <= drv->stats.budget)
+		return false;
+
+	drv_log("Memory budget of %llu bytes exhausted\n", (unsigned long long)drv->stats.budget);
+	drv_stats_log(drv);
+	return true;
+}
+
+static bool drv_budget_exhausted(struct driver *drv)
+{
+	bool exhausted;
+
+	pthread_mutex_lock(&drv->driver_lock);
+	exhausted = drv_over_budget(drv, 0);
+	pthread_mutex_unlock(&drv->driver_lock);
+
+	return exhausted;
+}
+
 struct bo *drv_bo_create(struct driver *drv, uint32_t width, uint32_t height, uint32_t format,
 			 uint64_t use_flags)
 {
@@ -254,20 +485,36 @@ struct bo *drv_bo_create(struct driver *drv, uint32_t width, uint32_t height, ui
 	size_t plane;
 	struct bo *bo;
 
+	if (drv_budget_exhausted(drv)) {
+		errno = ENOSPC;
+		return NULL;
+	}
+
 	bo = drv_bo_new(drv, width, height, format, use_flags);
 
 	if (!bo)
 		return NULL;
 
+	drv_trace_begin("drv_bo_create", bo);
 	ret = drv->backend->bo_create(bo, width, height, format, use_flags);
 
 	if (ret) {
+		drv_trace_end("drv_bo_create", bo);
 		free(bo);
 		return NULL;
 	}
 
 	pthread_mutex_lock(&drv->driver_lock);
 
+	if (drv_over_budget(drv, bo->total_size)) {
+		pthread_mutex_unlock(&drv->driver_lock);
+		drv->backend->bo_destroy(bo);
+		drv_trace_end("drv_bo_create", bo);
+		free(bo);
+		errno = ENOSPC;
+		return NULL;
+	}
+
 	for (plane = 0; plane < bo->num_planes; plane++) {
 		if (plane > 0)
 			assert(bo->offsets[plane] >= bo->offsets[plane - 1]);
@@ -275,8 +522,10 @@ struct bo *drv_bo_create(struct driver *drv, uint32_t width, uint32_t height, ui
 		drv_increment_reference_count(drv, bo, plane);
 	}
 
+	drv_stats_add_bo(drv, bo);
 	pthread_mutex_unlock(&drv->driver_lock);
 
+	drv_trace_end("drv_bo_create", bo);
 	return bo;
 }
 
@@ -292,20 +541,36 @@ struct bo *drv_bo_create_with_modifiers(struct driver *drv, uint32_t width, uint
 		return NULL;
 	}
 
+	if (drv_budget_exhausted(drv)) {
+		errno = ENOSPC;
+		return NULL;
+	}
+
 	bo = drv_bo_new(drv, width, height, format, BO_USE_NONE);
 
 	if (!bo)
 		return NULL;
 
+	drv_trace_begin("drv_bo_create_with_modifiers", bo);
 	ret = drv->backend->bo_create_with_modifiers(bo, width, height, format, modifiers, count);
 
 	if (ret) {
+		drv_trace_end("drv_bo_create_with_modifiers", bo);
 		free(bo);
 		return NULL;
 	}
 
 	pthread_mutex_lock(&drv->driver_lock);
 
+	if (drv_over_budget(drv, bo->total_size)) {
+		pthread_mutex_unlock(&drv->driver_lock);
+		drv->backend->bo_destroy(bo);
+		drv_trace_end("drv_bo_create_with_modifiers", bo);
+		free(bo);
+		errno = ENOSPC;
+		return NULL;
+	}
+
 	for (plane = 0; plane < bo->num_planes; plane++) {
 		if (plane > 0)
 			assert(bo->offsets[plane] >= bo->offsets[plane - 1]);
@@ -313,8 +578,10 @@ struct bo *drv_bo_create_with_modifiers(struct driver *drv, uint32_t width, uint
 		drv_increment_reference_count(drv, bo, plane);
 	}
 
+	drv_stats_add_bo(drv, bo);
 	pthread_mutex_unlock(&drv->driver_lock);
 
+	drv_trace_end("drv_bo_create_with_modifiers", bo);
 	return bo;
 }
 
@@ -324,11 +591,17 @@ void drv_bo_destroy(struct bo *bo)
 	uintptr_t total = 0;
 	struct driver *drv = bo->drv;
 
+	drv_trace_begin("drv_bo_destroy", bo);
+	drv_bo_wait_flush(bo);
+
 	pthread_mutex_lock(&drv->driver_lock);
 
 	for (plane = 0; plane < bo->num_planes; plane++)
 		drv_decrement_reference_count(drv, bo, plane);
 
+	if (!bo->imported)
+		drv_stats_remove_bo(drv, bo);
+
 	for (plane = 0; plane < bo->num_planes; plane++)
 		total += drv_get_reference_count(drv, bo, plane);
 
@@ -339,6 +612,7 @@ void drv_bo_destroy(struct bo *bo)
 		bo->drv->backend->bo_destroy(bo);
 	}
 
+	drv_trace_end("drv_bo_destroy", bo);
 	free(bo);
 }
 
@@ -354,8 +628,13 @@ struct bo *drv_bo_import(struct driver *drv, struct drv_import_fd_data *data)
 	if (!bo)
 		return NULL;
 
+	/* Imports stay out of the stats and the budget: their memory belongs to the exporter. */
+	bo->imported = true;
+
+	drv_trace_begin("drv_bo_import", bo);
 	ret = drv->backend->bo_import(bo, data);
 	if (ret) {
+		drv_trace_end("drv_bo_import", bo);
 		free(bo);
 		return NULL;
 	}
@@ -385,18 +664,81 @@ struct bo *drv_bo_import(struct driver *drv, struct drv_import_fd_data *data)
 		bo->total_size += bo->sizes[plane];
 	}
 
+	drv_trace_end("drv_bo_import", bo);
 	return bo;
 
 destroy_bo:
+	drv_trace_end("drv_bo_import", bo);
 	drv_bo_destroy(bo);
 	return NULL;
 }
 
+/*
+ * Computes the byte range of the plane's GEM object that a map of rect needs. Without
+ * BO_MAP_RECT_ONLY that is the whole object; with it, the page-aligned rows the rect covers,
+ * laid out with the given strides.
+ */
+static void drv_bo_map_range(struct bo *bo, const struct rectangle *rect, size_t plane,
+			     bool rect_only, const uint32_t *strides, size_t *start, size_t *end)
+{
+	size_t i, extent = 0;
+	uint32_t vsub;
+	bool shared = true;
+
+	for (i = 0; i < bo->num_planes; i++) {
+		if (bo->handles[i].u32 == bo->handles[plane].u32)
+			extent = MAX(extent, bo->offsets[i] + bo->sizes[i]);
+		else
+			shared = false;
+	}
+
+	*start = 0;
+	*end = shared ? bo->total_size : extent;
+	if (!rect_only || !rect->height)
+		return;
+
+	vsub = drv_vertical_subsampling_from_format(bo->format, plane);
+	i = bo->offsets[plane] + (size_t)(rect->y / vsub) * strides[plane];
+	*start = i & ~(size_t)4095;
+	i = bo->offsets[plane] +
+	    (size_t)DIV_ROUND_UP(rect->y + rect->height, vsub) * strides[plane];
+	*end = MIN(ALIGN(i, 4096), *end);
+}
+
+/*
+ * Backends may map with strides of their own, so whether a vma covers rect is worked out in
+ * its layout.
+ */
+static bool drv_vma_covers(struct bo *bo, struct vma *vma, const struct rectangle *rect,
+			   size_t plane, bool rect_only)
+{
+	size_t start, end;
+
+	drv_bo_map_range(bo, rect, plane, rect_only, vma->map_strides, &start, &end);
+	return vma->offset <= start && vma->offset + vma->length >= end;
+}
+
+/* For callers that already waited for queued flushes, before taking driver_lock. */
+static int drv_bo_invalidate_nowait(struct bo *bo, struct mapping *mapping)
+{
+	assert(mapping);
+	assert(mapping->vma);
+	assert(mapping->refcount > 0);
+	assert(mapping->vma->refcount > 0);
+
+	if (!bo->drv->backend->bo_invalidate)
+		return 0;
+
+	return bo->drv->backend->bo_invalidate(bo, mapping);
+}
+
 void *drv_bo_map(struct bo *bo, const struct rectangle *rect, uint32_t map_flags,
 		 struct mapping **map_data, size_t plane)
 {
-	uint32_t i;
+	uint32_t i, vsub;
 	uint8_t *addr;
+	bool prefault, rect_only;
+	size_t start, end;
 	struct mapping mapping;
 
 	assert(rect->width >= 0);
@@ -407,16 +749,25 @@ void *drv_bo_map(struct bo *bo, const struct rectangle *rect, uint32_t map_flags
 	/* No CPU access for protected buffers. */
 	assert(!(bo->use_flags & BO_USE_PROTECTED));
 
+	/* Prefaulting and the range are properties of this call, not of the mapping. */
+	prefault = map_flags & BO_MAP_PREFAULT;
+	rect_only = map_flags & BO_MAP_RECT_ONLY;
+	map_flags &= ~(BO_MAP_PREFAULT | BO_MAP_RECT_ONLY);
+
 	memset(&mapping, 0, sizeof(mapping));
 	mapping.rect = *rect;
 	mapping.refcount = 1;
 
+	drv_trace_begin("drv_bo_map", bo);
+	drv_bo_wait_flush(bo);
+
 	pthread_mutex_lock(&bo->drv->driver_lock);
 
 	for (i = 0; i < drv_array_size(bo->drv->mappings); i++) {
 		struct mapping *prior = (struct mapping *)drv_array_at_idx(bo->drv->mappings, i);
 		if (prior->vma->handle != bo->handles[plane].u32 ||
-		    prior->vma->map_flags != map_flags)
+		    prior->vma->map_flags != map_flags ||
+		    !drv_vma_covers(bo, prior->vma, rect, plane, rect_only))
 			continue;
 
 		if (rect->x != prior->rect.x || rect->y != prior->rect.y ||
@@ -431,7 +782,8 @@ void *drv_bo_map(struct bo *bo, const struct rectangle *rect, uint32_t map_flags
 	for (i = 0; i < drv_array_size(bo->drv->mappings); i++) {
 		struct mapping *prior = (struct mapping *)drv_array_at_idx(bo->drv->mappings, i);
 		if (prior->vma->handle != bo->handles[plane].u32 ||
-		    prior->vma->map_flags != map_flags)
+		    prior->vma->map_flags != map_flags ||
+		    !drv_vma_covers(bo, prior->vma, rect, plane, rect_only))
 			continue;
 
 		prior->vma->refcount++;
@@ -441,11 +793,15 @@ void *drv_bo_map(struct bo *bo, const struct rectangle *rect, uint32_t map_flags
 
 	mapping.vma = calloc(1, sizeof(*mapping.vma));
 	memcpy(mapping.vma->map_strides, bo->strides, sizeof(mapping.vma->map_strides));
+	drv_bo_map_range(bo, rect, plane, rect_only, bo->strides, &start, &end);
+	mapping.vma->offset = start;
+	mapping.vma->length = end - start;
 	addr = bo->drv->backend->bo_map(bo, mapping.vma, plane, map_flags);
 	if (addr == MAP_FAILED) {
 		*map_data = NULL;
 		free(mapping.vma);
 		pthread_mutex_unlock(&bo->drv->driver_lock);
+		drv_trace_end("drv_bo_map", bo);
 		return MAP_FAILED;
 	}
 
@@ -454,13 +810,43 @@ void *drv_bo_map(struct bo *bo, const struct rectangle *rect, uint32_t map_flags
 	mapping.vma->handle = bo->handles[plane].u32;
 	mapping.vma->map_flags = map_flags;
 
+	drv_stats_add_mapping(bo->drv, mapping.vma);
+
 success:
 	*map_data = drv_array_append(bo->drv->mappings, &mapping);
 exact_match:
-	drv_bo_invalidate(bo, *map_data);
-	addr = (uint8_t *)((*map_data)->vma->addr);
-	addr += drv_bo_get_plane_offset(bo, plane);
+	/* A CPU view that the backend can't fill in must not be handed out, or flushed back. */
+	if (drv_bo_invalidate_nowait(bo, *map_data)) {
+		pthread_mutex_unlock(&bo->drv->driver_lock);
+		drv_bo_unmap(bo, *map_data);
+		*map_data = NULL;
+		drv_trace_end("drv_bo_map", bo);
+		return MAP_FAILED;
+	}
+
+	/* The vma may start past the plane, so only ever step forward from its start. */
+	start = drv_bo_get_plane_offset(bo, plane);
+	if (rect_only) {
+		vsub = drv_vertical_subsampling_from_format(bo->format, plane);
+		start += (size_t)(rect->y / vsub) * (*map_data)->vma->map_strides[plane];
+	}
+	addr = (uint8_t *)((*map_data)->vma->addr) + (start - (*map_data)->vma->offset);
+
+	/*
+	 * Faulting pages in can take a while, so it happens outside driver_lock, with a reference
+	 * that keeps other users of the mapping from unmapping it under us.
+	 */
+	if (prefault)
+		(*map_data)->refcount++;
+
 	pthread_mutex_unlock(&bo->drv->driver_lock);
+
+	if (prefault) {
+		drv_prefault_mapping(bo, *map_data);
+		drv_bo_unmap(bo, *map_data);
+	}
+
+	drv_trace_end("drv_bo_map", bo);
 	return (void *)addr;
 }
 
@@ -469,6 +855,8 @@ int drv_bo_unmap(struct bo *bo, struct mapping *mapping)
 	uint32_t i;
 	int ret = 0;
 
+	drv_bo_wait_flush(bo);
+
 	pthread_mutex_lock(&bo->drv->driver_lock);
 
 	if (--mapping->refcount)
@@ -476,6 +864,7 @@ int drv_bo_unmap(struct bo *bo, struct mapping *mapping)
 
 	if (!--mapping->vma->refcount) {
 		ret = bo->drv->backend->bo_unmap(bo, mapping->vma);
+		drv_stats_remove_mapping(bo->drv, mapping->vma);
 		free(mapping->vma);
 	}
 
@@ -493,16 +882,14 @@ out:
 
 int drv_bo_invalidate(struct bo *bo, struct mapping *mapping)
 {
-	int ret = 0;
-
-	assert(mapping);
-	assert(mapping->vma);
-	assert(mapping->refcount > 0);
-	assert(mapping->vma->refcount > 0);
+	int ret;
 
-	if (bo->drv->backend->bo_invalidate)
-		ret = bo->drv->backend->bo_invalidate(bo, mapping);
+	drv_bo_wait_flush(bo);
 
+	/* Backends look at the bo's other mappings, which driver_lock protects. */
+	pthread_mutex_lock(&bo->drv->driver_lock);
+	ret = drv_bo_invalidate_nowait(bo, mapping);
+	pthread_mutex_unlock(&bo->drv->driver_lock);
 	return ret;
 }
 
@@ -516,14 +903,204 @@ int drv_bo_flush_or_unmap(struct bo *bo, struct mapping *mapping)
 	assert(mapping->vma->refcount > 0);
 	assert(!(bo->use_flags & BO_USE_PROTECTED));
 
-	if (bo->drv->backend->bo_flush)
+	drv_trace_begin("drv_bo_flush_or_unmap", bo);
+	if (bo->drv->backend->bo_flush && bo->drv->num_flush_threads)
+		ret = drv_queue_flush(bo, mapping);
+	else if (bo->drv->backend->bo_flush)
 		ret = bo->drv->backend->bo_flush(bo, mapping);
 	else
 		ret = drv_bo_unmap(bo, mapping);
 
+	drv_trace_end("drv_bo_flush_or_unmap", bo);
 	return ret;
 }
 
+/*
+ * Has the backend send out the flushes it batched up, for callers about to hand bo over to
+ * someone else. Failures are logged by the backend, and the caller has no one to report them to.
+ */
+static void drv_bo_submit(struct bo *bo)
+{
+	if (!bo->drv->backend->bo_submit)
+		return;
+
+	pthread_mutex_lock(&bo->drv->driver_lock);
+	bo->drv->backend->bo_submit(bo);
+	pthread_mutex_unlock(&bo->drv->driver_lock);
+}
+
+void drv_bo_wait_flush(struct bo *bo)
+{
+	size_t plane;
+	struct flush_job *job;
+	struct driver *drv = bo->drv;
+
+	if (!drv->num_flush_threads)
+		return;
+
+	pthread_mutex_lock(&drv->flush_lock);
+	job = drv->flush_jobs;
+	while (job) {
+		for (plane = 0; plane < bo->num_planes; plane++)
+			if (job->mapping->vma->handle == bo->handles[plane].u32)
+				break;
+
+		if (plane == bo->num_planes) {
+			job = job->next;
+			continue;
+		}
+
+		/* The list changes while we sleep, so rescan from the start. */
+		pthread_cond_wait(&drv->flush_cond, &drv->flush_lock);
+		job = drv->flush_jobs;
+	}
+	pthread_mutex_unlock(&drv->flush_lock);
+}
+
+/*
+ * The fence covers the last flush queued for the bo. Flushes of one handle run in queue order,
+ * so that is enough unless the bo has flushes pending on several handles. Fences are sync_files
+ * on a sw_sync timeline of the job's own, which the worker advances once the flush is done.
+ * Without sw_sync, or with flushes on several handles, we wait for the flushes here instead.
+ */
+int drv_bo_get_flush_fence(struct bo *bo)
+{
+	size_t plane;
+	int fd = -1;
+	uint32_t handle = 0;
+	bool several = false;
+	struct flush_job *job, *last = NULL;
+	struct sw_sync_create_fence_data create;
+	struct driver *drv = bo->drv;
+
+	/* Without the pool, flushes may still be batched up in the backend. */
+	if (!drv->num_flush_threads) {
+		drv_bo_submit(bo);
+		return -1;
+	}
+
+	pthread_mutex_lock(&drv->flush_lock);
+	for (job = drv->flush_jobs; job; job = job->next) {
+		for (plane = 0; plane < bo->num_planes; plane++)
+			if (job->mapping->vma->handle == bo->handles[plane].u32)
+				break;
+
+		if (plane == bo->num_planes)
+			continue;
+
+		if (last && job->mapping->vma->handle != handle)
+			several = true;
+
+		handle = job->mapping->vma->handle;
+		last = job;
+	}
+
+	if (last && !several && !drv->no_sw_sync) {
+		if (last->timeline_fd < 0) {
+			last->timeline_fd = open(SW_SYNC_PATH, O_RDWR | O_CLOEXEC);
+			drv->no_sw_sync = last->timeline_fd < 0;
+		}
+
+		memset(&create, 0, sizeof(create));
+		create.value = 1;
+		strcpy(create.name, "minigbm flush");
+		if (last->timeline_fd >= 0 &&
+		    !drmIoctl(last->timeline_fd, SW_SYNC_IOC_CREATE_FENCE, &create))
+			fd = create.fence;
+	}
+	pthread_mutex_unlock(&drv->flush_lock);
+
+	if (last && fd < 0)
+		drv_bo_wait_flush(bo);
+
+	return fd;
+}
+
+static bool drv_bo_is_mapped(struct bo *bo)
+{
+	size_t plane;
+	uint32_t i;
+	struct mapping *mapping;
+	bool mapped = false;
+
+	pthread_mutex_lock(&bo->drv->driver_lock);
+	for (i = 0; i < drv_array_size(bo->drv->mappings) && !mapped; i++) {
+		mapping = (struct mapping *)drv_array_at_idx(bo->drv->mappings, i);
+		for (plane = 0; plane < bo->num_planes; plane++)
+			if (mapping->vma->handle == bo->handles[plane].u32)
+				mapped = true;
+	}
+	pthread_mutex_unlock(&bo->drv->driver_lock);
+
+	return mapped;
+}
+
+int drv_bo_copy(struct bo *dst, struct bo *src, const struct rectangle *rect)
+{
+	int ret;
+
+	if (src->format != dst->format)
+		return -EINVAL;
+
+	drv_bo_wait_flush(src);
+	drv_bo_wait_flush(dst);
+
+	/*
+	 * Backend copies go straight to the buffer contents, so they would miss shadow copies
+	 * held by live CPU mappings.
+	 */
+	if (src->drv == dst->drv && dst->drv->backend->bo_copy && !drv_bo_is_mapped(src) &&
+	    !drv_bo_is_mapped(dst)) {
+		ret = dst->drv->backend->bo_copy(dst, src, rect);
+		if (ret != -EOPNOTSUPP)
+			return ret;
+	}
+
+	return drv_bo_convert(src, dst, rect);
+}
+
+void drv_get_stats(struct driver *drv, struct drv_stats *stats)
+{
+	pthread_mutex_lock(&drv->driver_lock);
+	*stats = drv->stats;
+	pthread_mutex_unlock(&drv->driver_lock);
+}
+
+/*
+ * Copies up to max_entries per-format totals into entries, and returns how many there are in all.
+ */
+uint32_t drv_get_format_stats(struct driver *drv, struct drv_format_stats *entries,
+			      uint32_t max_entries)
+{
+	uint32_t i, count = 0;
+	struct drv_format_stats *entry;
+
+	pthread_mutex_lock(&drv->driver_lock);
+	for (i = 0; i < drv_array_size(drv->format_stats); i++) {
+		entry = drv_array_at_idx(drv->format_stats, i);
+		if (!entry->num_bos)
+			continue;
+
+		if (count < max_entries)
+			entries[count] = *entry;
+		count++;
+	}
+	pthread_mutex_unlock(&drv->driver_lock);
+
+	return count;
+}
+
+/*
+ * Caps the bytes of live bos at bytes, or lifts the cap when bytes is 0. Creations past the cap
+ * fail with ENOSPC. Imports are neither counted nor refused, since their memory already exists.
+ */
+void drv_set_memory_budget(struct driver *drv, uint64_t bytes)
+{
+	pthread_mutex_lock(&drv->driver_lock);
+	drv->stats.budget = bytes;
+	pthread_mutex_unlock(&drv->driver_lock);
+}
+
 uint32_t drv_bo_get_width(struct bo *bo)
 {
 	return bo->width;
@@ -559,6 +1136,10 @@ int drv_bo_get_plane_fd(struct bo *bo, size_t plane)
 	int ret, fd;
 	assert(plane < bo->num_planes);
 
+	drv_bo_wait_flush(bo);
+	if (!bo->drv->num_flush_threads)
+		drv_bo_submit(bo);
+
 	ret = drmPrimeHandleToFD(bo->drv->fd, bo->handles[plane].u32, DRM_CLOEXEC | DRM_RDWR, &fd);
 
 	// Older DRM implementations blocked DRM_RDWR, but gave a read/write mapping anyways
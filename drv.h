@@ -38,6 +38,13 @@ extern "C" {
 #define BO_USE_RENDERSCRIPT		(1ull << 16)
 #define BO_USE_TEXTURE			(1ull << 17)
 #define BO_USE_HW_VIDEO_DECODER		(1ull << 18)
+/* New buffers must read back as zeroes; without it their initial contents are undefined. */
+#define BO_USE_CLEAR			(1ull << 19)
+/*
+ * The CPU streams through the buffer: back its CPU mappings and copies with huge pages, on the
+ * GPU's NUMA node, where the kernel allows it.
+ */
+#define BO_USE_HUGE_PAGES		(1ull << 20)
 
 
 /* Map flags */
@@ -45,6 +52,13 @@ extern "C" {
 #define BO_MAP_READ (1 << 0)
 #define BO_MAP_WRITE (1 << 1)
 #define BO_MAP_READ_WRITE (BO_MAP_READ | BO_MAP_WRITE)
+/* Fault in the pages covering the mapped rectangle before returning. */
+#define BO_MAP_PREFAULT (1 << 2)
+/*
+ * Only the pages covering the rectangle within the plane need to be mapped. drv_bo_map() then
+ * returns the address of row rect->y of the plane rather than of its first row.
+ */
+#define BO_MAP_RECT_ONLY (1 << 3)
 
 /* This is our extension to <drm_fourcc.h>.  We need to make sure we don't step
  * on the namespace of already defined formats, which can be done by using invalid
@@ -56,6 +70,11 @@ extern "C" {
 #define DRM_FORMAT_FLEX_IMPLEMENTATION_DEFINED	fourcc_code('9', '9', '9', '8')
 #define DRM_FORMAT_FLEX_YCbCr_420_888		fourcc_code('9', '9', '9', '9')
 
+/* Older <drm_fourcc.h> lacks the 10 bit YUV 4:2:0 format. */
+#ifndef DRM_FORMAT_P010
+#define DRM_FORMAT_P010				fourcc_code('P', '0', '1', '0')
+#endif
+
 // clang-format on
 struct driver;
 struct bo;
@@ -80,8 +99,15 @@ struct drv_import_fd_data {
 	uint64_t use_flags;
 };
 
+/*
+ * On entry to a backend's bo_map, offset and length hold the byte range of the handle's object
+ * the caller needs. Backends whose map call takes an offset map exactly that. Maps through a fake
+ * mmap offset start at the object start and only trim the end, and the rest map the whole bo and
+ * reset offset to 0.
+ */
 struct vma {
 	void *addr;
+	size_t offset;
 	size_t length;
 	uint32_t handle;
 	uint32_t map_flags;
@@ -103,6 +129,24 @@ struct mapping {
 	uint32_t refcount;
 };
 
+/* Running totals of the buffers a driver created and of its mappings, with high-water marks. */
+struct drv_stats {
+	uint64_t num_bos;
+	uint64_t bytes;
+	uint64_t mapped_bytes;
+	uint64_t peak_num_bos;
+	uint64_t peak_bytes;
+	uint64_t peak_mapped_bytes;
+	uint64_t budget;
+};
+
+struct drv_format_stats {
+	uint32_t format;
+	uint64_t use_flags;
+	uint64_t num_bos;
+	uint64_t bytes;
+};
+
 struct driver *drv_create(int fd);
 
 void drv_destroy(struct driver *drv);
@@ -113,6 +157,11 @@ const char *drv_get_name(struct driver *drv);
 
 struct combination *drv_get_combination(struct driver *drv, uint32_t format, uint64_t use_flags);
 
+uint32_t drv_query_modifiers(struct driver *drv, uint32_t format, uint64_t use_flags,
+			     uint64_t *modifiers, uint32_t max_modifiers);
+
+uint32_t drv_num_planes_from_modifier(struct driver *drv, uint32_t format, uint64_t modifier);
+
 struct bo *drv_bo_new(struct driver *drv, uint32_t width, uint32_t height, uint32_t format,
 		      uint64_t use_flags);
 
@@ -135,6 +184,23 @@ int drv_bo_invalidate(struct bo *bo, struct mapping *mapping);
 
 int drv_bo_flush_or_unmap(struct bo *bo, struct mapping *mapping);
 
+void drv_bo_wait_flush(struct bo *bo);
+
+/*
+ * Returns a sync_file that signals once the flushes queued so far for bo are done, or -1 when
+ * none are left. Where no sync_file can be made, waits for the flushes and returns -1.
+ */
+int drv_bo_get_flush_fence(struct bo *bo);
+
+int drv_bo_copy(struct bo *dst, struct bo *src, const struct rectangle *rect);
+
+void drv_get_stats(struct driver *drv, struct drv_stats *stats);
+
+uint32_t drv_get_format_stats(struct driver *drv, struct drv_format_stats *entries,
+			      uint32_t max_entries);
+
+void drv_set_memory_budget(struct driver *drv, uint64_t bytes);
+
 uint32_t drv_bo_get_width(struct bo *bo);
 
 uint32_t drv_bo_get_height(struct bo *bo);
@@ -161,6 +227,10 @@ uint32_t drv_bytes_per_pixel_from_format(uint32_t format, size_t plane);
 
 uint32_t drv_stride_from_format(uint32_t format, uint32_t width, size_t plane);
 
+uint32_t drv_horizontal_subsampling_from_format(uint32_t format, size_t plane);
+
+uint32_t drv_vertical_subsampling_from_format(uint32_t format, size_t plane);
+
 uint32_t drv_resolve_format(struct driver *drv, uint32_t format, uint64_t use_flags);
 
 size_t drv_num_planes_from_format(uint32_t format);
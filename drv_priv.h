@@ -8,8 +8,10 @@
 #define DRV_PRIV_H
 
 #include <pthread.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <sys/ioctl.h>
 #include <sys/types.h>
 
 #include "drv.h"
@@ -28,6 +30,8 @@ struct bo {
 	uint64_t format_modifiers[DRV_MAX_PLANES];
 	uint64_t use_flags;
 	size_t total_size;
+	/* Set on bos from drv_bo_import(), which the stats leave out. */
+	bool imported;
 	void *priv;
 };
 
@@ -49,6 +53,31 @@ struct combination {
 	uint64_t use_flags;
 };
 
+struct flush_job {
+	struct bo *bo;
+	struct mapping *mapping;
+	bool running;
+	/* A sw_sync timeline advanced once the flush is done, or -1. */
+	int timeline_fd;
+	struct flush_job *next;
+};
+
+#define DRV_MAX_FLUSH_THREADS 8
+
+#ifndef SW_SYNC_PATH
+#define SW_SYNC_PATH "/sys/kernel/debug/sync/sw_sync"
+#endif
+
+/* The sw_sync uAPI, which the kernel doesn't export. */
+struct sw_sync_create_fence_data {
+	uint32_t value;
+	char name[32];
+	int32_t fence;
+};
+
+#define SW_SYNC_IOC_CREATE_FENCE _IOWR('W', 0, struct sw_sync_create_fence_data)
+#define SW_SYNC_IOC_INC _IOW('W', 1, uint32_t)
+
 struct driver {
 	int fd;
 	const struct backend *backend;
@@ -57,6 +86,19 @@ struct driver {
 	struct drv_array *mappings;
 	struct drv_array *combos;
 	pthread_mutex_t driver_lock;
+	int numa_node;
+	struct drv_stats stats;
+	struct drv_array *format_stats;
+
+	/* Optional pool running backend flushes off the caller's thread. */
+	uint32_t num_flush_threads;
+	pthread_t flush_threads[DRV_MAX_FLUSH_THREADS];
+	pthread_mutex_t flush_lock;
+	pthread_cond_t flush_cond;
+	struct flush_job *flush_jobs;
+	bool flush_exit;
+	/* Set once opening SW_SYNC_PATH failed, so flush fences aren't tried again. */
+	bool no_sw_sync;
 };
 
 struct backend {
@@ -73,7 +115,10 @@ struct backend {
 	int (*bo_unmap)(struct bo *bo, struct vma *vma);
 	int (*bo_invalidate)(struct bo *bo, struct mapping *mapping);
 	int (*bo_flush)(struct bo *bo, struct mapping *mapping);
+	int (*bo_submit)(struct bo *bo);
+	int (*bo_copy)(struct bo *dst, struct bo *src, const struct rectangle *rect);
 	uint32_t (*resolve_format)(uint32_t format, uint64_t use_flags);
+	uint32_t (*num_planes_from_modifier)(uint32_t format, uint64_t modifier);
 };
 
 // clang-format off
@@ -92,6 +137,9 @@ struct backend {
 
 #define BO_USE_SW_RARELY BO_USE_SW_READ_RARELY | BO_USE_SW_WRITE_RARELY
 
+/* Requests about a buffer's memory, which any combination can honor. */
+#define BO_USE_MEMORY_HINTS (BO_USE_CLEAR | BO_USE_HUGE_PAGES)
+
 #ifndef DRM_FORMAT_MOD_LINEAR
 #define DRM_FORMAT_MOD_LINEAR DRM_FORMAT_MOD_NONE
 #endif
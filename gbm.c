@@ -5,12 +5,14 @@
  */
 
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <unistd.h>
 #include <xf86drm.h>
 
 #include "drv.h"
@@ -41,6 +43,102 @@ PUBLIC int gbm_device_is_format_supported(struct gbm_device *gbm, uint32_t forma
 	return (drv_get_combination(gbm->drv, format, use_flags) != NULL);
 }
 
+PUBLIC int gbm_device_query_modifiers(struct gbm_device *gbm, uint32_t format, uint32_t usage,
+				      uint64_t *modifiers, uint32_t *count)
+{
+	if (!count)
+		return -EINVAL;
+
+	*count = drv_query_modifiers(gbm->drv, format, gbm_convert_usage(usage), modifiers,
+				     modifiers ? *count : 0);
+	return 0;
+}
+
+PUBLIC int gbm_device_get_format_modifier_plane_count(struct gbm_device *gbm, uint32_t format,
+						      uint64_t modifier)
+{
+	uint32_t i, count;
+	uint64_t *modifiers;
+	int ret = -1;
+
+	count = drv_query_modifiers(gbm->drv, format, BO_USE_NONE, NULL, 0);
+	modifiers = calloc(count, sizeof(*modifiers));
+	if (!modifiers)
+		return -1;
+
+	count = MIN(count, drv_query_modifiers(gbm->drv, format, BO_USE_NONE, modifiers, count));
+	for (i = 0; i < count; i++)
+		if (modifiers[i] == modifier)
+			ret = drv_num_planes_from_modifier(gbm->drv, format, modifier);
+
+	free(modifiers);
+	return ret;
+}
+
+PUBLIC int gbm_device_get_stats(struct gbm_device *gbm, struct gbm_device_stats *stats,
+				struct gbm_format_stats *formats, uint32_t *num_formats)
+{
+	struct drv_stats drv_stats;
+	struct drv_format_stats *entries = NULL;
+	uint32_t i, j, count, num_entries;
+
+	drv_get_stats(gbm->drv, &drv_stats);
+	stats->num_bos = drv_stats.num_bos;
+	stats->bytes = drv_stats.bytes;
+	stats->mapped_bytes = drv_stats.mapped_bytes;
+	stats->peak_num_bos = drv_stats.peak_num_bos;
+	stats->peak_bytes = drv_stats.peak_bytes;
+	stats->peak_mapped_bytes = drv_stats.peak_mapped_bytes;
+	stats->budget = drv_stats.budget;
+
+	if (!num_formats)
+		return 0;
+
+	/* The driver splits formats by use flags too, so merge those entries back together. */
+	num_entries = drv_get_format_stats(gbm->drv, NULL, 0);
+	if (num_entries) {
+		entries = calloc(num_entries, sizeof(*entries));
+		if (!entries)
+			return -ENOMEM;
+
+		num_entries =
+		    MIN(num_entries, drv_get_format_stats(gbm->drv, entries, num_entries));
+	}
+
+	count = 0;
+	for (i = 0; i < num_entries; i++) {
+		for (j = 0; j < i; j++)
+			if (entries[j].format == entries[i].format)
+				break;
+
+		if (j < i)
+			continue;
+
+		if (formats && count < *num_formats) {
+			formats[count].format = entries[i].format;
+			formats[count].num_bos = 0;
+			formats[count].bytes = 0;
+			for (j = i; j < num_entries; j++) {
+				if (entries[j].format != entries[i].format)
+					continue;
+
+				formats[count].num_bos += entries[j].num_bos;
+				formats[count].bytes += entries[j].bytes;
+			}
+		}
+		count++;
+	}
+
+	free(entries);
+	*num_formats = count;
+	return 0;
+}
+
+PUBLIC void gbm_device_set_memory_budget(struct gbm_device *gbm, uint64_t bytes)
+{
+	drv_set_memory_budget(gbm->drv, bytes);
+}
+
 PUBLIC struct gbm_device *gbm_create_device(int fd)
 {
 	struct gbm_device *gbm;
@@ -68,26 +166,127 @@ PUBLIC void gbm_device_destroy(struct gbm_device *gbm)
 PUBLIC struct gbm_surface *gbm_surface_create(struct gbm_device *gbm, uint32_t width,
 					      uint32_t height, uint32_t format, uint32_t usage)
 {
-	struct gbm_surface *surface = (struct gbm_surface *)malloc(sizeof(*surface));
+	uint32_t i;
+	struct gbm_surface *surface = (struct gbm_surface *)calloc(1, sizeof(*surface));
 
 	if (!surface)
 		return NULL;
 
+	pthread_mutex_init(&surface->lock, NULL);
+
+	for (i = 0; i < GBM_SURFACE_NUM_BUFFERS; i++) {
+		surface->bos[i] = gbm_bo_create(gbm, width, height, format, usage);
+		if (!surface->bos[i]) {
+			gbm_surface_destroy(surface);
+			return NULL;
+		}
+	}
+
 	return surface;
 }
 
 PUBLIC void gbm_surface_destroy(struct gbm_surface *surface)
 {
+	uint32_t i;
+
+	for (i = 0; i < GBM_SURFACE_NUM_BUFFERS; i++)
+		if (surface->bos[i])
+			gbm_bo_destroy(surface->bos[i]);
+
+	pthread_mutex_destroy(&surface->lock);
 	free(surface);
 }
 
+static int gbm_surface_find(struct gbm_surface *surface, enum gbm_surface_buffer_state state)
+{
+	int i;
+
+	for (i = 0; i < GBM_SURFACE_NUM_BUFFERS; i++)
+		if (surface->states[i] == state)
+			return i;
+
+	return -1;
+}
+
+PUBLIC struct gbm_bo *gbm_surface_acquire_back_buffer(struct gbm_surface *surface)
+{
+	int idx;
+	struct gbm_bo *bo = NULL;
+
+	pthread_mutex_lock(&surface->lock);
+	if (gbm_surface_find(surface, GBM_SURFACE_BUFFER_BACK) < 0) {
+		idx = gbm_surface_find(surface, GBM_SURFACE_BUFFER_FREE);
+		if (idx >= 0) {
+			surface->states[idx] = GBM_SURFACE_BUFFER_BACK;
+			bo = surface->bos[idx];
+		}
+	}
+	pthread_mutex_unlock(&surface->lock);
+
+	return bo;
+}
+
+PUBLIC int gbm_surface_swap_buffers(struct gbm_surface *surface)
+{
+	int back, swapped;
+
+	pthread_mutex_lock(&surface->lock);
+	back = gbm_surface_find(surface, GBM_SURFACE_BUFFER_BACK);
+	if (back < 0) {
+		pthread_mutex_unlock(&surface->lock);
+		return -EINVAL;
+	}
+
+	/* A frame the compositor never locked is dropped for the newer one. */
+	swapped = gbm_surface_find(surface, GBM_SURFACE_BUFFER_SWAPPED);
+	if (swapped >= 0)
+		surface->states[swapped] = GBM_SURFACE_BUFFER_FREE;
+
+	surface->states[back] = GBM_SURFACE_BUFFER_SWAPPED;
+	pthread_mutex_unlock(&surface->lock);
+
+	return 0;
+}
+
 PUBLIC struct gbm_bo *gbm_surface_lock_front_buffer(struct gbm_surface *surface)
 {
-	return NULL;
+	int idx;
+	struct gbm_bo *bo = NULL;
+
+	pthread_mutex_lock(&surface->lock);
+	idx = gbm_surface_find(surface, GBM_SURFACE_BUFFER_SWAPPED);
+	if (idx >= 0) {
+		surface->states[idx] = GBM_SURFACE_BUFFER_LOCKED;
+		bo = surface->bos[idx];
+	}
+	pthread_mutex_unlock(&surface->lock);
+
+	return bo;
 }
 
 PUBLIC void gbm_surface_release_buffer(struct gbm_surface *surface, struct gbm_bo *bo)
 {
+	uint32_t i;
+
+	pthread_mutex_lock(&surface->lock);
+	for (i = 0; i < GBM_SURFACE_NUM_BUFFERS; i++) {
+		if (surface->bos[i] == bo && surface->states[i] == GBM_SURFACE_BUFFER_LOCKED) {
+			surface->states[i] = GBM_SURFACE_BUFFER_FREE;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&surface->lock);
+}
+
+PUBLIC int gbm_surface_has_free_buffers(struct gbm_surface *surface)
+{
+	int ret;
+
+	pthread_mutex_lock(&surface->lock);
+	ret = gbm_surface_find(surface, GBM_SURFACE_BUFFER_FREE) >= 0;
+	pthread_mutex_unlock(&surface->lock);
+
+	return ret;
 }
 
 static struct gbm_bo *gbm_bo_new(struct gbm_device *gbm, uint32_t format)
@@ -223,6 +422,17 @@ PUBLIC struct gbm_bo *gbm_bo_import(struct gbm_device *gbm, uint32_t type, void
 	return bo;
 }
 
+static uint32_t gbm_convert_transfer_flags(uint32_t transfer_flags)
+{
+	uint32_t map_flags;
+
+	map_flags = (transfer_flags & GBM_BO_TRANSFER_READ) ? BO_MAP_READ : BO_MAP_NONE;
+	map_flags |= (transfer_flags & GBM_BO_TRANSFER_WRITE) ? BO_MAP_WRITE : BO_MAP_NONE;
+	map_flags |= (transfer_flags & GBM_BO_TRANSFER_PREFAULT) ? BO_MAP_PREFAULT : BO_MAP_NONE;
+
+	return map_flags;
+}
+
 PUBLIC void *gbm_bo_map(struct gbm_bo *bo, uint32_t x, uint32_t y, uint32_t width, uint32_t height,
 			uint32_t transfer_flags, uint32_t *stride, void **map_data, size_t plane)
 {
@@ -230,11 +440,16 @@ PUBLIC void *gbm_bo_map(struct gbm_bo *bo, uint32_t x, uint32_t y, uint32_t widt
 	off_t offset;
 	uint32_t map_flags;
 	struct rectangle rect = { .x = x, .y = y, .width = width, .height = height };
+
 	if (!bo || width == 0 || height == 0 || !stride || !map_data)
 		return NULL;
 
-	map_flags = (transfer_flags & GBM_BO_TRANSFER_READ) ? BO_MAP_READ : BO_MAP_NONE;
-	map_flags |= (transfer_flags & GBM_BO_TRANSFER_WRITE) ? BO_MAP_WRITE : BO_MAP_NONE;
+	map_flags = gbm_convert_transfer_flags(transfer_flags);
+	/*
+	 * Callers only get a pointer to the rectangle, so the rest of the bo needn't be mapped,
+	 * and the map starts at row y.
+	 */
+	map_flags |= BO_MAP_RECT_ONLY;
 
 	addr = drv_bo_map(bo->bo, &rect, map_flags, (struct mapping **)map_data, plane);
 	if (addr == MAP_FAILED)
@@ -242,15 +457,79 @@ PUBLIC void *gbm_bo_map(struct gbm_bo *bo, uint32_t x, uint32_t y, uint32_t widt
 
 	*stride = ((struct mapping *)*map_data)->vma->map_strides[plane];
 
-	offset = *stride * rect.y;
-	offset += drv_stride_from_format(bo->gbm_format, rect.x, plane);
+	offset = drv_stride_from_format(bo->gbm_format, rect.x, plane);
 	return (void *)((uint8_t *)addr + offset);
 }
 
+PUBLIC int gbm_bo_map2(struct gbm_bo *bo, uint32_t x, uint32_t y, uint32_t width, uint32_t height,
+			uint32_t transfer_flags, void *addrs[GBM_MAX_PLANES],
+			uint32_t strides[GBM_MAX_PLANES], void **map_data)
+{
+	uint8_t *base;
+	size_t plane, num_planes;
+	uint32_t format, hsub, vsub;
+	struct vma *vma;
+	struct rectangle rect = { .x = x, .y = y, .width = width, .height = height };
+
+	if (!bo || width == 0 || height == 0 || !addrs || !strides || !map_data)
+		return -EINVAL;
+
+	/* All planes have to live in the one buffer the mapping covers. */
+	if (drv_num_buffers_per_bo(bo->bo) != 1)
+		return -EINVAL;
+
+	base = drv_bo_map(bo->bo, &rect, gbm_convert_transfer_flags(transfer_flags),
+			  (struct mapping **)map_data, 0);
+	if (base == MAP_FAILED)
+		return -EFAULT;
+
+	vma = ((struct mapping *)*map_data)->vma;
+	base -= drv_bo_get_plane_offset(bo->bo, 0);
+	format = drv_bo_get_format(bo->bo);
+	num_planes = drv_bo_get_num_planes(bo->bo);
+	for (plane = 0; plane < num_planes; plane++) {
+		/* Backends that map planes separately only cover the first one. */
+		if (vma->offset || drv_bo_get_plane_offset(bo->bo, plane) +
+					   drv_bo_get_plane_size(bo->bo, plane) >
+				       vma->length) {
+			drv_bo_unmap(bo->bo, *map_data);
+			*map_data = NULL;
+			return -EINVAL;
+		}
+
+		hsub = drv_horizontal_subsampling_from_format(format, plane);
+		vsub = drv_vertical_subsampling_from_format(format, plane);
+
+		strides[plane] = vma->map_strides[plane];
+		addrs[plane] = base + drv_bo_get_plane_offset(bo->bo, plane) +
+			       (size_t)(y / vsub) * strides[plane] +
+			       (size_t)(x / hsub) * drv_bytes_per_pixel_from_format(format, plane);
+	}
+
+	return 0;
+}
+
 PUBLIC void gbm_bo_unmap(struct gbm_bo *bo, void *map_data)
 {
+	int fence;
+
 	assert(bo);
 	drv_bo_flush_or_unmap(bo->bo, map_data);
+
+	/* gbm has no release fences, so writes are sent off at unmap rather than batched up. */
+	fence = drv_bo_get_flush_fence(bo->bo);
+	if (fence >= 0)
+		close(fence);
+}
+
+PUBLIC int gbm_bo_blit(struct gbm_bo *dst, struct gbm_bo *src, uint32_t x, uint32_t y,
+		       uint32_t width, uint32_t height)
+{
+	struct rectangle rect = { .x = x, .y = y, .width = width, .height = height };
+
+	assert(dst);
+	assert(src);
+	return drv_bo_copy(dst->bo, src->bo, &rect);
 }
 
 PUBLIC uint32_t gbm_bo_get_width(struct gbm_bo *bo)
@@ -269,6 +269,16 @@ enum gbm_bo_flags {
     * The buffer will be written by a video decode accelerator.
     */
    GBM_BO_USE_HW_VIDEO_DECODER = (1 << 13),
+   /**
+    * New buffers must read back as zeroes. Without this flag their initial
+    * contents are undefined.
+    */
+   GBM_BO_USE_CLEAR = (1 << 14),
+   /**
+    * The CPU streams through the buffer. Back its mappings with huge pages,
+    * on the GPU's NUMA node, where the kernel allows it.
+    */
+   GBM_BO_USE_HUGE_PAGES = (1 << 15),
 };
 
 int
@@ -281,12 +291,78 @@ int
 gbm_device_is_format_supported(struct gbm_device *gbm,
                                uint32_t format, uint32_t usage);
 
+/**
+ * Totals of the buffers a device created and of its mappings, with peaks.
+ */
+struct gbm_device_stats {
+   uint64_t num_bos;
+   uint64_t bytes;
+   uint64_t mapped_bytes;
+   uint64_t peak_num_bos;
+   uint64_t peak_bytes;
+   uint64_t peak_mapped_bytes;
+   /**
+    * The limit set with gbm_device_set_memory_budget(), or 0 if there is none.
+    */
+   uint64_t budget;
+};
+
+struct gbm_format_stats {
+   uint32_t format;
+   uint64_t num_bos;
+   uint64_t bytes;
+};
+
+/**
+ * Fills in stats. If formats is not NULL, it receives up to *num_formats
+ * per-format totals. On return *num_formats holds the number of formats in
+ * use, which may be more than were written.
+ *
+ * Returns 0, or a negative errno on failure.
+ */
+int
+gbm_device_get_stats(struct gbm_device *gbm, struct gbm_device_stats *stats,
+                     struct gbm_format_stats *formats, uint32_t *num_formats);
+
+/**
+ * Limits the bytes of live buffers on the device. Once the budget is used
+ * up, buffer creation fails with errno set to ENOSPC. Imported buffers
+ * are left out of the budget and the stats, and are never refused. A
+ * budget of 0 means no limit.
+ */
+void
+gbm_device_set_memory_budget(struct gbm_device *gbm, uint64_t bytes);
+
 void
 gbm_device_destroy(struct gbm_device *gbm);
 
 struct gbm_device *
 gbm_create_device(int fd);
 
+/**
+ * Lists the modifiers buffers of format can be allocated with for usage,
+ * ranked by preference: layouts that save the most memory bandwidth come
+ * first. If modifiers is not NULL, it receives up to *count of them. On
+ * return *count holds the number of supported modifiers, which may be more
+ * than were written. A usage of 0 matches any usage.
+ *
+ * Returns 0, or a negative errno on failure.
+ */
+int
+gbm_device_query_modifiers(struct gbm_device *gbm, uint32_t format,
+                           uint32_t usage, uint64_t *modifiers,
+                           uint32_t *count);
+
+/**
+ * Returns the number of memory planes a buffer of format with modifier has,
+ * including auxiliary planes such as compression metadata, or -1 if the
+ * device doesn't support the combination.
+ */
+int
+gbm_device_get_format_modifier_plane_count(struct gbm_device *gbm,
+                                           uint32_t format,
+                                           uint64_t modifier);
+
 struct gbm_bo *
 gbm_bo_create(struct gbm_device *gbm,
               uint32_t width, uint32_t height,
@@ -350,6 +426,10 @@ enum gbm_bo_transfer_flags {
     * Read/modify/write
     */
    GBM_BO_TRANSFER_READ_WRITE = (GBM_BO_TRANSFER_READ | GBM_BO_TRANSFER_WRITE),
+   /**
+    * Fault in the mapped region up front instead of on first access.
+    */
+   GBM_BO_TRANSFER_PREFAULT   = (1 << 2),
 };
 
 void *
@@ -357,9 +437,34 @@ gbm_bo_map(struct gbm_bo *bo,
            uint32_t x, uint32_t y, uint32_t width, uint32_t height,
            uint32_t flags, uint32_t *stride, void **map_data, size_t plane);
 
+/**
+ * Maps every plane of the buffer through a single mapping. On success,
+ * addrs[i] and strides[i] give the address of pixel (x, y) of plane i and
+ * that plane's stride, for each plane of the buffer. The mapping is released
+ * with gbm_bo_unmap().
+ *
+ * Returns 0, or a negative errno if the planes can't share one mapping.
+ */
+int
+gbm_bo_map2(struct gbm_bo *bo,
+            uint32_t x, uint32_t y, uint32_t width, uint32_t height,
+            uint32_t flags, void *addrs[GBM_MAX_PLANES],
+            uint32_t strides[GBM_MAX_PLANES], void **map_data);
+
 void
 gbm_bo_unmap(struct gbm_bo *bo, void *map_data);
 
+/**
+ * Copies the rectangle at (x, y) of src to the same place in dst. Both
+ * buffers must have the same format. The backend copies the buffers
+ * directly when it can, otherwise they are copied through CPU mappings.
+ *
+ * Returns 0, or a negative errno on failure.
+ */
+int
+gbm_bo_blit(struct gbm_bo *dst, struct gbm_bo *src,
+            uint32_t x, uint32_t y, uint32_t width, uint32_t height);
+
 uint32_t
 gbm_bo_get_width(struct gbm_bo *bo);
 
@@ -424,6 +529,42 @@ gbm_surface_create(struct gbm_device *gbm,
                    uint32_t width, uint32_t height,
 		   uint32_t format, uint32_t flags);
 
+/*
+ * minigbm extension: Mesa's libgbm has no such entry points, since there the
+ * EGL implementation draws into surface buffers and swaps them. Clients that
+ * draw into them directly should check for this version, and fall back to
+ * their own gbm_bo_create() buffers where it is not defined.
+ */
+#define MINIGBM_SURFACE_SWAP_VERSION 1
+
+/**
+ * minigbm extension, see MINIGBM_SURFACE_SWAP_VERSION.
+ *
+ * Hands out a free buffer of the surface for the client to draw into. Only
+ * one back buffer can be out at a time.
+ *
+ * Returns NULL if a back buffer is already out or no buffer is free.
+ */
+struct gbm_bo *
+gbm_surface_acquire_back_buffer(struct gbm_surface *surface);
+
+/**
+ * minigbm extension, see MINIGBM_SURFACE_SWAP_VERSION.
+ *
+ * Makes the back buffer the surface's newest frame, which the next
+ * gbm_surface_lock_front_buffer() returns. A previous frame that was never
+ * locked becomes free again.
+ *
+ * Returns 0, or -EINVAL if no back buffer was acquired.
+ */
+int
+gbm_surface_swap_buffers(struct gbm_surface *surface);
+
+/**
+ * Locks the last swapped buffer for scanout until it is released.
+ *
+ * Returns NULL if nothing was swapped since the last lock.
+ */
 struct gbm_bo *
 gbm_surface_lock_front_buffer(struct gbm_surface *surface);
 
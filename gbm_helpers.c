@@ -42,6 +42,10 @@ uint64_t gbm_convert_usage(uint32_t usage)
 		use_flags |= BO_USE_SW_WRITE_RARELY;
 	if (usage & GBM_BO_USE_HW_VIDEO_DECODER)
 		use_flags |= BO_USE_HW_VIDEO_DECODER;
+	if (usage & GBM_BO_USE_CLEAR)
+		use_flags |= BO_USE_CLEAR;
+	if (usage & GBM_BO_USE_HUGE_PAGES)
+		use_flags |= BO_USE_HUGE_PAGES;
 
 	return use_flags;
 }
@@ -7,6 +7,8 @@
 #ifndef GBM_PRIV_H
 #define GBM_PRIV_H
 
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <sys/types.h>
@@ -18,7 +20,27 @@ struct gbm_device {
 	struct driver *drv;
 };
 
+#define GBM_SURFACE_NUM_BUFFERS 3
+
+enum gbm_surface_buffer_state {
+	GBM_SURFACE_BUFFER_FREE,
+	GBM_SURFACE_BUFFER_BACK,
+	GBM_SURFACE_BUFFER_SWAPPED,
+	GBM_SURFACE_BUFFER_LOCKED,
+};
+
+/*
+ * A surface is a fixed set of buffers allocated up front, so steady state
+ * swapping never allocates. A buffer goes from free to back when the client
+ * acquires it for drawing, to swapped when the client swaps it, to locked
+ * when the compositor locks it as the front buffer, and back to free when
+ * the compositor releases it. Only the last swapped buffer can be locked;
+ * swapping again frees a swapped buffer nobody locked.
+ */
 struct gbm_surface {
+	pthread_mutex_t lock;
+	struct gbm_bo *bos[GBM_SURFACE_NUM_BUFFERS];
+	enum gbm_surface_buffer_state states[GBM_SURFACE_NUM_BUFFERS];
 };
 
 struct gbm_bo {
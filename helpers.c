@@ -6,11 +6,16 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 
@@ -62,6 +67,13 @@ static const struct planar_layout biplanar_yuv_420_layout = {
 	.bytes_per_pixel = { 1, 2 }
 };
 
+static const struct planar_layout biplanar_yuv_p010_layout = {
+	.num_planes = 2,
+	.horizontal_subsampling = { 1, 2 },
+	.vertical_subsampling = { 1, 2 },
+	.bytes_per_pixel = { 2, 4 }
+};
+
 static const struct planar_layout triplanar_yuv_420_layout = {
 	.num_planes = 3,
 	.horizontal_subsampling = { 1, 2, 2 },
@@ -88,6 +100,9 @@ static const struct planar_layout *layout_from_format(uint32_t format)
 	case DRM_FORMAT_NV21:
 		return &biplanar_yuv_420_layout;
 
+	case DRM_FORMAT_P010:
+		return &biplanar_yuv_p010_layout;
+
 	case DRM_FORMAT_ABGR1555:
 	case DRM_FORMAT_ABGR4444:
 	case DRM_FORMAT_ARGB1555:
@@ -166,6 +181,24 @@ uint32_t drv_height_from_format(uint32_t format, uint32_t height, size_t plane)
 	return DIV_ROUND_UP(height, layout->vertical_subsampling[plane]);
 }
 
+uint32_t drv_horizontal_subsampling_from_format(uint32_t format, size_t plane)
+{
+	const struct planar_layout *layout = layout_from_format(format);
+
+	assert(plane < layout->num_planes);
+
+	return layout->horizontal_subsampling[plane];
+}
+
+uint32_t drv_vertical_subsampling_from_format(uint32_t format, size_t plane)
+{
+	const struct planar_layout *layout = layout_from_format(format);
+
+	assert(plane < layout->num_planes);
+
+	return layout->vertical_subsampling[plane];
+}
+
 uint32_t drv_bytes_per_pixel_from_format(uint32_t format, size_t plane)
 {
 	const struct planar_layout *layout = layout_from_format(format);
@@ -251,12 +284,18 @@ int drv_bo_from_format(struct bo *bo, uint32_t stride, uint32_t aligned_height,
 	return 0;
 }
 
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+
+#define DRV_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
 int drv_dumb_bo_create(struct bo *bo, uint32_t width, uint32_t height, uint32_t format,
 		       uint64_t use_flags)
 {
 	int ret;
 	size_t plane;
-	uint32_t aligned_width, aligned_height;
+	uint32_t aligned_width, aligned_height, pitch;
 	struct drm_mode_create_dumb create_dumb;
 
 	aligned_width = width;
@@ -274,9 +313,20 @@ int drv_dumb_bo_create(struct bo *bo, uint32_t width, uint32_t height, uint32_t
 	}
 
 	memset(&create_dumb, 0, sizeof(create_dumb));
+	create_dumb.bpp = layout_from_format(format)->bytes_per_pixel[0] * 8;
+
+	/*
+	 * The kernel only backs whole huge pages of an object with huge pages, so large buffers
+	 * that asked for them are padded to the next one rather than ending in small pages.
+	 */
+	pitch = DIV_ROUND_UP(aligned_width * create_dumb.bpp, 8);
+	if ((use_flags & BO_USE_HUGE_PAGES) && (size_t)pitch * aligned_height >= DRV_HUGE_PAGE_SIZE)
+		aligned_height = DIV_ROUND_UP(ALIGN((size_t)pitch * aligned_height,
+						    DRV_HUGE_PAGE_SIZE),
+					      pitch);
+
 	create_dumb.height = aligned_height;
 	create_dumb.width = aligned_width;
-	create_dumb.bpp = layout_from_format(format)->bytes_per_pixel[0] * 8;
 	create_dumb.flags = 0;
 
 	ret = drmIoctl(bo->drv->fd, DRM_IOCTL_MODE_CREATE_DUMB, &create_dumb);
@@ -380,7 +430,6 @@ int drv_prime_bo_import(struct bo *bo, struct drv_import_fd_data *data)
 void *drv_dumb_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint32_t map_flags)
 {
 	int ret;
-	size_t i;
 	struct drm_mode_map_dumb map_dumb;
 
 	memset(&map_dumb, 0, sizeof(map_dumb));
@@ -392,12 +441,71 @@ void *drv_dumb_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint32_t map
 		return MAP_FAILED;
 	}
 
-	for (i = 0; i < bo->num_planes; i++)
-		if (bo->handles[i].u32 == bo->handles[plane].u32)
-			vma->length += bo->sizes[i];
+	drv_vma_from_object_start(vma);
+	return drv_mmap_object(bo, vma->length, drv_get_prot(map_flags), map_dumb.offset);
+}
+
+/* Applies the placement hints for huge pages on the GPU's node to page-aligned memory. */
+static void drv_place_memory(struct bo *bo, void *addr, size_t size)
+{
+	unsigned long nodemask;
+	int node = bo->drv->numa_node;
+
+#ifdef MADV_HUGEPAGE
+	madvise(addr, size, MADV_HUGEPAGE);
+#endif
+
+#ifdef SYS_mbind
+	if (node >= 0 && node < (int)(8 * sizeof(nodemask))) {
+		nodemask = 1ul << node;
+		syscall(SYS_mbind, addr, size, MPOL_PREFERRED, &nodemask, 8 * sizeof(nodemask), 0);
+	}
+#endif
+}
+
+/*
+ * Maps length bytes of a GEM object from its fake offset in the device's mmap space. The kernel
+ * can only map a huge page of the object where the address is just as aligned, so buffers that
+ * asked for huge pages get a mapping that starts on a huge page boundary, and the hints.
+ */
+void *drv_mmap_object(struct bo *bo, size_t length, int prot, uint64_t offset)
+{
+	uint8_t *reserved, *addr;
+	size_t head, reserved_size;
+
+	if (length < DRV_HUGE_PAGE_SIZE || !(bo->use_flags & BO_USE_HUGE_PAGES))
+		return mmap(0, length, prot, MAP_SHARED, bo->drv->fd, offset);
+
+	/* Reserve a huge page more than needed, map over its aligned part, give back the rest. */
+	reserved_size = ALIGN(length, 4096) + DRV_HUGE_PAGE_SIZE;
+	reserved = mmap(0, reserved_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+			-1, 0);
+	if (reserved == MAP_FAILED)
+		return MAP_FAILED;
+
+	addr = (uint8_t *)ALIGN((uintptr_t)reserved, DRV_HUGE_PAGE_SIZE);
+	if (mmap(addr, length, prot, MAP_SHARED | MAP_FIXED, bo->drv->fd, offset) == MAP_FAILED) {
+		munmap(reserved, reserved_size);
+		return MAP_FAILED;
+	}
+
+	head = addr - reserved;
+	if (head)
+		munmap(reserved, head);
+	munmap(addr + ALIGN(length, 4096), DRV_HUGE_PAGE_SIZE - head);
 
-	return mmap(0, vma->length, drv_get_prot(map_flags), MAP_SHARED, bo->drv->fd,
-		    map_dumb.offset);
+	drv_place_memory(bo, addr, length);
+	return addr;
+}
+
+/*
+ * DRM looks up the fake mmap offsets of GEM objects exactly, so a map through one has to start at
+ * the beginning of the object. Widens vma to begin there, keeping its end.
+ */
+void drv_vma_from_object_start(struct vma *vma)
+{
+	vma->length += vma->offset;
+	vma->offset = 0;
 }
 
 int drv_bo_munmap(struct bo *bo, struct vma *vma)
@@ -433,6 +541,7 @@ int drv_mapping_destroy(struct bo *bo)
 					return ret;
 				}
 
+				drv_stats_remove_mapping(bo->drv, mapping->vma);
 				free(mapping->vma);
 			}
 
@@ -444,11 +553,195 @@ int drv_mapping_destroy(struct bo *bo)
 	return 0;
 }
 
+/*
+ * Returns whether the flush pool still has a flush of vma queued behind the one that is
+ * running. Backends can use this to batch work until the last of them.
+ */
+bool drv_flush_pending(struct driver *drv, struct vma *vma)
+{
+	bool pending = false;
+	struct flush_job *job;
+
+	if (!drv->num_flush_threads)
+		return false;
+
+	pthread_mutex_lock(&drv->flush_lock);
+	for (job = drv->flush_jobs; job; job = job->next) {
+		if (!job->running && job->mapping->vma == vma) {
+			pending = true;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&drv->flush_lock);
+
+	return pending;
+}
+
 int drv_get_prot(uint32_t map_flags)
 {
 	return (BO_MAP_WRITE & map_flags) ? PROT_WRITE | PROT_READ : PROT_READ;
 }
 
+#define DRV_CLEAR_MAX_THREADS 4
+#define DRV_CLEAR_MIN_CHUNK (4 * 1024 * 1024)
+
+struct drv_clear_range {
+	uint8_t *addr;
+	size_t size;
+};
+
+static void *drv_clear_thread(void *arg)
+{
+	struct drv_clear_range *range = (struct drv_clear_range *)arg;
+	memset(range->addr, 0, range->size);
+	return NULL;
+}
+
+/*
+ * Zeroes memory, splitting large ranges across a few threads. A single core can't saturate the
+ * bus on write-combined GPU mappings, so this cuts the cost of clearing big buffers.
+ */
+void drv_clear_memory(void *addr, size_t size)
+{
+	uint32_t i, count, started;
+	size_t chunk, offset;
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	pthread_t threads[DRV_CLEAR_MAX_THREADS];
+	struct drv_clear_range ranges[DRV_CLEAR_MAX_THREADS];
+
+	count = MIN(size / DRV_CLEAR_MIN_CHUNK, DRV_CLEAR_MAX_THREADS);
+	if (cpus > 0)
+		count = MIN(count, (uint32_t)cpus);
+
+	if (count <= 1) {
+		memset(addr, 0, size);
+		return;
+	}
+
+	chunk = ALIGN(DIV_ROUND_UP(size, count), 4096);
+	for (i = 0, offset = 0; i < count; i++, offset += chunk) {
+		ranges[i].addr = (uint8_t *)addr + offset;
+		ranges[i].size = MIN(chunk, size - offset);
+	}
+
+	/* The caller's thread takes the first range. */
+	for (started = 1; started < count; started++)
+		if (pthread_create(&threads[started], NULL, drv_clear_thread, &ranges[started]))
+			break;
+
+	drv_clear_thread(&ranges[0]);
+
+	/* Whatever couldn't get a thread is cleared here. */
+	for (i = started; i < count; i++)
+		drv_clear_thread(&ranges[i]);
+
+	for (i = 1; i < started; i++)
+		pthread_join(threads[i], NULL);
+}
+
+/* Returns the NUMA node the device behind fd is attached to, or -1 if unknown. */
+int drv_get_numa_node(int fd)
+{
+	int node = -1;
+	FILE *file;
+	char path[64];
+	struct stat st;
+
+	if (fstat(fd, &st) || !S_ISCHR(st.st_mode))
+		return -1;
+
+	snprintf(path, sizeof(path), "/sys/dev/char/%u:%u/device/numa_node", major(st.st_rdev),
+		 minor(st.st_rdev));
+
+	file = fopen(path, "r");
+	if (!file)
+		return -1;
+
+	if (fscanf(file, "%d", &node) != 1)
+		node = -1;
+
+	fclose(file);
+	return node;
+}
+
+/* Shadows of at least a huge page of buffers that asked for huge pages. */
+static bool drv_shadow_is_placed(struct bo *bo, size_t size)
+{
+	return size >= DRV_HUGE_PAGE_SIZE && (bo->use_flags & BO_USE_HUGE_PAGES);
+}
+
+/*
+ * Allocates a CPU shadow of bo, for backends that detile or cache buffers in system memory.
+ * Placement hints only take effect on anonymous memory that isn't populated yet, so placed
+ * shadows get fresh mappings; the rest come from malloc, which reuses warm memory.
+ */
+void *drv_shadow_alloc(struct bo *bo, size_t size)
+{
+	void *addr;
+
+	if (!drv_shadow_is_placed(bo, size))
+		return malloc(size);
+
+	addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (addr == MAP_FAILED)
+		return NULL;
+
+	drv_place_memory(bo, addr, size);
+	return addr;
+}
+
+void drv_shadow_free(struct bo *bo, void *addr, size_t size)
+{
+	if (!drv_shadow_is_placed(bo, size))
+		free(addr);
+	else if (addr)
+		munmap(addr, size);
+}
+
+#ifndef MADV_POPULATE_READ
+#define MADV_POPULATE_READ 22
+#endif
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
+/*
+ * Faults in the rows of every plane that the mapping's rectangle covers, so the caller's first
+ * pass over the buffer doesn't take a fault per page. Kernels without MADV_POPULATE_* get the
+ * pages touched by hand, which at least populates them for reading.
+ */
+void drv_prefault_mapping(struct bo *bo, struct mapping *mapping)
+{
+	size_t plane;
+	uint32_t vsub;
+	uintptr_t start, end, page;
+	struct vma *vma = mapping->vma;
+	uintptr_t base = (uintptr_t)vma->addr - vma->offset;
+	int advice = (vma->map_flags & BO_MAP_WRITE) ? MADV_POPULATE_WRITE : MADV_POPULATE_READ;
+
+	for (plane = 0; plane < bo->num_planes; plane++) {
+		if (bo->handles[plane].u32 != vma->handle)
+			continue;
+
+		vsub = drv_vertical_subsampling_from_format(bo->format, plane);
+		start = base + bo->offsets[plane] +
+			(uintptr_t)(mapping->rect.y / vsub) * vma->map_strides[plane];
+		end = base + bo->offsets[plane] +
+		      (uintptr_t)DIV_ROUND_UP(mapping->rect.y + mapping->rect.height, vsub) *
+			  vma->map_strides[plane];
+		end = MIN(end, (uintptr_t)vma->addr + vma->length);
+		start = MAX(start & ~(uintptr_t)4095, (uintptr_t)vma->addr);
+		if (start >= end)
+			continue;
+
+		if (!madvise((void *)start, end - start, advice))
+			continue;
+
+		for (page = start; page < end; page += 4096)
+			(void)*(volatile uint8_t *)page;
+	}
+}
+
 uintptr_t drv_get_reference_count(struct driver *drv, struct bo *bo, size_t plane)
 {
 	void *count;
@@ -479,6 +772,83 @@ void drv_decrement_reference_count(struct driver *drv, struct bo *bo, size_t pla
 		drmHashInsert(drv->buffer_table, bo->handles[plane].u32, (void *)(num - 1));
 }
 
+static struct drv_format_stats *drv_find_format_stats(struct driver *drv, struct bo *bo)
+{
+	uint32_t i;
+	struct drv_format_stats *entry, new_entry = { 0 };
+
+	for (i = 0; i < drv_array_size(drv->format_stats); i++) {
+		entry = drv_array_at_idx(drv->format_stats, i);
+		if (entry->format == bo->format && entry->use_flags == bo->use_flags)
+			return entry;
+	}
+
+	new_entry.format = bo->format;
+	new_entry.use_flags = bo->use_flags;
+	return drv_array_append(drv->format_stats, &new_entry);
+}
+
+/* The stats helpers expect the driver lock to be held. */
+void drv_stats_add_bo(struct driver *drv, struct bo *bo)
+{
+	struct drv_format_stats *entry = drv_find_format_stats(drv, bo);
+
+	if (entry) {
+		entry->num_bos++;
+		entry->bytes += bo->total_size;
+	}
+
+	drv->stats.num_bos++;
+	drv->stats.bytes += bo->total_size;
+	drv->stats.peak_num_bos = MAX(drv->stats.peak_num_bos, drv->stats.num_bos);
+	drv->stats.peak_bytes = MAX(drv->stats.peak_bytes, drv->stats.bytes);
+}
+
+void drv_stats_remove_bo(struct driver *drv, struct bo *bo)
+{
+	struct drv_format_stats *entry = drv_find_format_stats(drv, bo);
+
+	if (entry) {
+		entry->num_bos--;
+		entry->bytes -= bo->total_size;
+	}
+
+	drv->stats.num_bos--;
+	drv->stats.bytes -= bo->total_size;
+}
+
+void drv_stats_add_mapping(struct driver *drv, struct vma *vma)
+{
+	drv->stats.mapped_bytes += vma->length;
+	drv->stats.peak_mapped_bytes = MAX(drv->stats.peak_mapped_bytes, drv->stats.mapped_bytes);
+}
+
+void drv_stats_remove_mapping(struct driver *drv, struct vma *vma)
+{
+	drv->stats.mapped_bytes -= vma->length;
+}
+
+void drv_stats_log(struct driver *drv)
+{
+	uint32_t i;
+	struct drv_format_stats *entry;
+
+	drv_log("%llu bos, %llu bytes (peak %llu), %llu bytes mapped, budget %llu\n",
+		(unsigned long long)drv->stats.num_bos, (unsigned long long)drv->stats.bytes,
+		(unsigned long long)drv->stats.peak_bytes,
+		(unsigned long long)drv->stats.mapped_bytes, (unsigned long long)drv->stats.budget);
+
+	for (i = 0; i < drv_array_size(drv->format_stats); i++) {
+		entry = drv_array_at_idx(drv->format_stats, i);
+		if (!entry->num_bos)
+			continue;
+
+		drv_log("  drv_format: %4.4s, use_flags: %llu: %llu bos, %llu bytes\n",
+			(char *)&entry->format, (unsigned long long)entry->use_flags,
+			(unsigned long long)entry->num_bos, (unsigned long long)entry->bytes);
+	}
+}
+
 uint32_t drv_log_base2(uint32_t value)
 {
 	int ret = 0;
@@ -517,11 +887,65 @@ void drv_modify_combination(struct driver *drv, uint32_t format, struct format_m
 	}
 }
 
+static void drv_add_kms_item(struct drv_array *kms_items, uint32_t format, uint64_t modifier,
+			     uint64_t use_flag)
+{
+	uint32_t i;
+	struct kms_item *item;
+	struct kms_item new_item = {
+		.format = format, .modifier = modifier, .use_flags = use_flag
+	};
+
+	for (i = 0; i < drv_array_size(kms_items); i++) {
+		item = drv_array_at_idx(kms_items, i);
+		if (item->format == format && item->modifier == modifier) {
+			item->use_flags |= use_flag;
+			return;
+		}
+	}
+
+	drv_array_append(kms_items, &new_item);
+}
+
+/*
+ * Adds an item for every format and modifier pair of a plane's IN_FORMATS blob. Linear is left
+ * to the caller, since planes without the property support it implicitly.
+ */
+static void drv_add_kms_modifiers(struct driver *drv, struct drv_array *kms_items,
+				  uint32_t blob_id, uint64_t use_flag)
+{
+	uint32_t i, j;
+	uint32_t *formats;
+	struct drm_format_modifier *modifiers;
+	struct drm_format_modifier_blob *header;
+	drmModePropertyBlobPtr blob;
+
+	blob = drmModeGetPropertyBlob(drv->fd, blob_id);
+	if (!blob)
+		return;
+
+	header = blob->data;
+	formats = (uint32_t *)((char *)header + header->formats_offset);
+	modifiers = (struct drm_format_modifier *)((char *)header + header->modifiers_offset);
+
+	for (i = 0; i < header->count_modifiers; i++) {
+		if (modifiers[i].modifier == DRM_FORMAT_MOD_LINEAR)
+			continue;
+
+		for (j = 0; j < 64 && modifiers[i].offset + j < header->count_formats; j++)
+			if (modifiers[i].formats & (1ull << j))
+				drv_add_kms_item(kms_items, formats[modifiers[i].offset + j],
+						 modifiers[i].modifier, use_flag);
+	}
+
+	drmModeFreePropertyBlob(blob);
+}
+
 struct drv_array *drv_query_kms(struct driver *drv)
 {
 	struct drv_array *kms_items;
-	uint64_t plane_type, use_flag;
-	uint32_t i, j, k;
+	uint64_t plane_type, use_flag, in_formats;
+	uint32_t i, j;
 
 	drmModePlanePtr plane;
 	drmModePropertyPtr prop;
@@ -555,11 +979,15 @@ struct drv_array *drv_query_kms(struct driver *drv)
 		if (!props)
 			goto out;
 
+		plane_type = DRM_PLANE_TYPE_OVERLAY;
+		in_formats = 0;
 		for (j = 0; j < props->count_props; j++) {
 			prop = drmModeGetProperty(drv->fd, props->props[j]);
 			if (prop) {
 				if (strcmp(prop->name, "type") == 0) {
 					plane_type = props->prop_values[j];
+				} else if (strcmp(prop->name, "IN_FORMATS") == 0) {
+					in_formats = props->prop_values[j];
 				}
 
 				drmModeFreeProperty(prop);
@@ -578,26 +1006,12 @@ struct drv_array *drv_query_kms(struct driver *drv)
 			assert(0);
 		}
 
-		for (j = 0; j < plane->count_formats; j++) {
-			bool found = false;
-			for (k = 0; k < drv_array_size(kms_items); k++) {
-				struct kms_item *item = drv_array_at_idx(kms_items, k);
-				if (item->format == plane->formats[j] &&
-				    item->modifier == DRM_FORMAT_MOD_LINEAR) {
-					item->use_flags |= use_flag;
-					found = true;
-					break;
-				}
-			}
-
-			if (!found) {
-				struct kms_item item = { .format = plane->formats[j],
-							 .modifier = DRM_FORMAT_MOD_LINEAR,
-							 .use_flags = use_flag };
+		for (j = 0; j < plane->count_formats; j++)
+			drv_add_kms_item(kms_items, plane->formats[j], DRM_FORMAT_MOD_LINEAR,
+					 use_flag);
 
-				drv_array_append(kms_items, &item);
-			}
-		}
+		if (in_formats)
+			drv_add_kms_modifiers(drv, kms_items, in_formats, use_flag);
 
 		drmModeFreeObjectProperties(props);
 		drmModeFreePlane(plane);
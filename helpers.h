@@ -7,6 +7,8 @@
 #ifndef HELPERS_H
 #define HELPERS_H
 
+#include <stdbool.h>
+
 #include "drv.h"
 #include "helpers_array.h"
 
@@ -19,12 +21,25 @@ int drv_dumb_bo_destroy(struct bo *bo);
 int drv_gem_bo_destroy(struct bo *bo);
 int drv_prime_bo_import(struct bo *bo, struct drv_import_fd_data *data);
 void *drv_dumb_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint32_t map_flags);
+void drv_vma_from_object_start(struct vma *vma);
+void *drv_mmap_object(struct bo *bo, size_t length, int prot, uint64_t offset);
 int drv_bo_munmap(struct bo *bo, struct vma *vma);
 int drv_mapping_destroy(struct bo *bo);
+bool drv_flush_pending(struct driver *drv, struct vma *vma);
 int drv_get_prot(uint32_t map_flags);
+void drv_clear_memory(void *addr, size_t size);
+int drv_get_numa_node(int fd);
+void *drv_shadow_alloc(struct bo *bo, size_t size);
+void drv_shadow_free(struct bo *bo, void *addr, size_t size);
+void drv_prefault_mapping(struct bo *bo, struct mapping *mapping);
 uintptr_t drv_get_reference_count(struct driver *drv, struct bo *bo, size_t plane);
 void drv_increment_reference_count(struct driver *drv, struct bo *bo, size_t plane);
 void drv_decrement_reference_count(struct driver *drv, struct bo *bo, size_t plane);
+void drv_stats_add_bo(struct driver *drv, struct bo *bo);
+void drv_stats_remove_bo(struct driver *drv, struct bo *bo);
+void drv_stats_add_mapping(struct driver *drv, struct vma *vma);
+void drv_stats_remove_mapping(struct driver *drv, struct vma *vma);
+void drv_stats_log(struct driver *drv);
 uint32_t drv_log_base2(uint32_t value);
 int drv_add_combination(struct driver *drv, uint32_t format, struct format_metadata *metadata,
 			uint64_t usage);
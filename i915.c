@@ -9,6 +9,11 @@
 #include <assert.h>
 #include <errno.h>
 #include <i915_drm.h>
+#ifdef __SSE4_1__
+#include <smmintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
@@ -28,29 +33,111 @@ static const uint32_t render_target_formats[] = { DRM_FORMAT_ABGR8888,    DRM_FO
 						  DRM_FORMAT_XBGR8888,    DRM_FORMAT_XRGB1555,
 						  DRM_FORMAT_XRGB2101010, DRM_FORMAT_XRGB8888 };
 
+static const uint32_t ccs_render_target_formats[] = { DRM_FORMAT_ABGR8888, DRM_FORMAT_ARGB8888,
+						      DRM_FORMAT_XBGR8888, DRM_FORMAT_XRGB8888 };
+
 static const uint32_t tileable_texture_source_formats[] = { DRM_FORMAT_GR88, DRM_FORMAT_R8,
 							    DRM_FORMAT_UYVY, DRM_FORMAT_YUYV };
 
 static const uint32_t texture_source_formats[] = { DRM_FORMAT_YVU420, DRM_FORMAT_YVU420_ANDROID,
 						   DRM_FORMAT_NV12 };
 
+// clang-format off
+enum i915_map_strategy {
+	I915_MAP_GTT,
+	I915_MAP_WB,
+	I915_MAP_WC,
+};
+
+enum i915_transfer_type {
+	I915_READ_TILED_BUFFER,
+	I915_WRITE_TILED_BUFFER,
+};
+// clang-format on
+
 struct i915_device {
 	uint32_t gen;
 	int32_t has_llc;
+	int32_t has_mmap_offset;
+};
+
+struct i915_private_map_data {
+	enum i915_map_strategy strategy;
+	void *tiled;
+	void *untiled;
+};
+
+// clang-format off
+static const uint16_t gen3_ids[] = { 0x2582, 0x2592, 0x2772, 0x27A2, 0x27AE,
+				     0x29C2, 0x29B2, 0x29D2, 0xA001, 0xA011 };
+
+/* Skylake, Broxton, Kabylake, Geminilake, Amberlake, Coffeelake, Whiskeylake and Cometlake. */
+static const uint16_t gen9_ids[] = {
+	0x0A84, 0x1902, 0x1906, 0x190A, 0x190B, 0x190E, 0x1912, 0x1913, 0x1915, 0x1916,
+	0x1917, 0x191A, 0x191B, 0x191D, 0x191E, 0x1921, 0x1923, 0x1926, 0x1927, 0x192A,
+	0x192B, 0x192D, 0x1932, 0x193A, 0x193B, 0x193D, 0x1A84, 0x1A85, 0x3184, 0x3185,
+	0x3E90, 0x3E91, 0x3E92, 0x3E93, 0x3E94, 0x3E96, 0x3E98, 0x3E99, 0x3E9A, 0x3E9B,
+	0x3E9C, 0x3EA0, 0x3EA1, 0x3EA2, 0x3EA3, 0x3EA4, 0x3EA5, 0x3EA6, 0x3EA7, 0x3EA8,
+	0x3EA9, 0x5902, 0x5906, 0x5908, 0x590A, 0x590B, 0x590E, 0x5912, 0x5913, 0x5915,
+	0x5916, 0x5917, 0x591A, 0x591B, 0x591C, 0x591D, 0x591E, 0x5921, 0x5923, 0x5926,
+	0x5927, 0x593B, 0x5A84, 0x5A85, 0x87C0, 0x87CA, 0x9B21, 0x9B41, 0x9BA0, 0x9BA2,
+	0x9BA4, 0x9BA5, 0x9BA8, 0x9BAA, 0x9BAB, 0x9BAC, 0x9BC0, 0x9BC2, 0x9BC4, 0x9BC5,
+	0x9BC6, 0x9BC8, 0x9BCA, 0x9BCB, 0x9BCC, 0x9BE6, 0x9BF6,
+};
+
+/* Icelake, Elkhartlake and Jasperlake. */
+static const uint16_t gen11_ids[] = {
+	0x4500, 0x4541, 0x4551, 0x4555, 0x4557, 0x4571, 0x4E51, 0x4E55, 0x4E57, 0x4E61,
+	0x4E71, 0x8A50, 0x8A51, 0x8A52, 0x8A53, 0x8A54, 0x8A56, 0x8A57, 0x8A58, 0x8A59,
+	0x8A5A, 0x8A5B, 0x8A5C, 0x8A5D, 0x8A70, 0x8A71,
 };
+// clang-format on
 
+/*
+ * Only the generations that change what we allocate are told apart. Anything
+ * not listed, including parts newer than gen11, is treated as gen4.
+ */
 static uint32_t i915_get_gen(int device_id)
 {
-	const uint16_t gen3_ids[] = { 0x2582, 0x2592, 0x2772, 0x27A2, 0x27AE,
-				      0x29C2, 0x29B2, 0x29D2, 0xA001, 0xA011 };
 	unsigned i;
 	for (i = 0; i < ARRAY_SIZE(gen3_ids); i++)
 		if (gen3_ids[i] == device_id)
 			return 3;
 
+	for (i = 0; i < ARRAY_SIZE(gen9_ids); i++)
+		if (gen9_ids[i] == device_id)
+			return 9;
+
+	for (i = 0; i < ARRAY_SIZE(gen11_ids); i++)
+		if (gen11_ids[i] == device_id)
+			return 11;
+
 	return 4;
 }
 
+/*
+ * Render compression (CCS_E) is available on gen9 through gen11. Gen12 uses a
+ * different aux layout with its own modifiers, which we don't support yet.
+ */
+static bool i915_has_ccs(const struct i915_device *i915)
+{
+	return i915->gen == 9 || i915->gen == 11;
+}
+
+static bool i915_can_compress(const struct i915_device *i915, uint32_t format)
+{
+	uint32_t i;
+
+	if (!i915_has_ccs(i915))
+		return false;
+
+	for (i = 0; i < ARRAY_SIZE(ccs_render_target_formats); i++)
+		if (ccs_render_target_formats[i] == format)
+			return true;
+
+	return false;
+}
+
 /*
  * We allow allocation of ARGB formats for SCANOUT if the corresponding XRGB
  * formats supports it. It's up to the caller (chrome ozone) to ultimately not
@@ -93,10 +180,10 @@ static int i915_add_kms_item(struct driver *drv, const struct kms_item *item)
 		if (item->modifier == DRM_FORMAT_MOD_LINEAR &&
 		    combo->metadata.tiling == I915_TILING_X) {
 			/*
-			 * FIXME: drv_query_kms() does not report the available modifiers
-			 * yet, but we know that all hardware can scanout from X-tiled
-			 * buffers, so let's add this to our combinations, except for
-			 * cursor, which must not be tiled.
+			 * Kernels without IN_FORMATS don't report the available
+			 * modifiers, but we know that all hardware can scanout from
+			 * X-tiled buffers, so let's add this to our combinations, except
+			 * for cursor, which must not be tiled.
 			 */
 			combo->use_flags |= item->use_flags & ~BO_USE_CURSOR;
 		}
@@ -105,7 +192,14 @@ static int i915_add_kms_item(struct driver *drv, const struct kms_item *item)
 		if (item->format == DRM_FORMAT_NV12)
 			combo->use_flags |= item->use_flags;
 
-		if (combo->metadata.modifier == item->modifier)
+		/*
+		 * Of the tiled modifiers KMS lists, only CCS is taken up. Plain scanout
+		 * buffers stay X-tiled even where KMS could show Y tiles, since callers
+		 * that don't pass modifiers can't tell drmModeAddFB() about them.
+		 */
+		if (combo->metadata.modifier == item->modifier &&
+		    (item->modifier == DRM_FORMAT_MOD_LINEAR ||
+		     item->modifier == I915_FORMAT_MOD_Y_TILED_CCS))
 			combo->use_flags |= item->use_flags;
 	}
 
@@ -116,6 +210,7 @@ static int i915_add_combinations(struct driver *drv)
 {
 	int ret;
 	uint32_t i;
+	struct i915_device *i915 = drv->priv;
 	struct drv_array *kms_items;
 	struct format_metadata metadata;
 	uint64_t render_use_flags, texture_use_flags;
@@ -187,6 +282,23 @@ static int i915_add_combinations(struct driver *drv)
 	drv_add_combinations(drv, &nv12_format, 1, &metadata,
 			     BO_USE_TEXTURE | BO_USE_HW_VIDEO_DECODER);
 
+	/*
+	 * Compressed render targets are only usable by the GPU, and only by
+	 * consumers that understand the aux plane, so they are never handed
+	 * out by i915_bo_create(). The combinations are here so that modifier
+	 * aware callers can discover them. Scanout is only added once KMS
+	 * lists the modifier for a plane.
+	 */
+	if (i915_has_ccs(i915)) {
+		metadata.tiling = I915_TILING_Y;
+		metadata.priority = 4;
+		metadata.modifier = I915_FORMAT_MOD_Y_TILED_CCS;
+
+		drv_add_combinations(drv, ccs_render_target_formats,
+				     ARRAY_SIZE(ccs_render_target_formats), &metadata,
+				     BO_USE_RENDERING | BO_USE_TEXTURE);
+	}
+
 	kms_items = drv_query_kms(drv);
 	if (!kms_items)
 		return 0;
@@ -272,6 +384,7 @@ static int i915_init(struct driver *drv)
 {
 	int ret;
 	int device_id;
+	int mmap_gtt_version = 0;
 	struct i915_device *i915;
 	drm_i915_getparam_t get_param;
 
@@ -301,6 +414,13 @@ static int i915_init(struct driver *drv)
 		return -EINVAL;
 	}
 
+	/* Version 4 of the GTT mmap interface introduced mmap_offset with caching modes. */
+	memset(&get_param, 0, sizeof(get_param));
+	get_param.param = I915_PARAM_MMAP_GTT_VERSION;
+	get_param.value = &mmap_gtt_version;
+	ret = drmIoctl(drv->fd, DRM_IOCTL_I915_GETPARAM, &get_param);
+	i915->has_mmap_offset = !ret && mmap_gtt_version >= 4;
+
 	drv->priv = i915;
 
 	return i915_add_combinations(drv);
@@ -335,6 +455,39 @@ static int i915_bo_from_format(struct bo *bo, uint32_t width, uint32_t height, u
 	return 0;
 }
 
+/*
+ * Lays out a Y-tiled main surface followed by its color control surface (CCS).
+ * Each 4 KiB CCS tile covers 32x16 Y tiles of the main surface, and both
+ * surfaces start on a 4 KiB boundary. Only depends on the format and
+ * dimensions, so it doesn't touch the kernel.
+ */
+static int i915_ccs_bo_from_format(struct bo *bo, uint32_t width, uint32_t height,
+				   uint32_t format)
+{
+	uint32_t stride = drv_stride_from_format(format, width, 0);
+	uint32_t width_in_tiles = DIV_ROUND_UP(stride, 128);
+	uint32_t height_in_tiles = DIV_ROUND_UP(height, 32);
+	uint32_t ccs_width_in_tiles = DIV_ROUND_UP(width_in_tiles, 32);
+	uint32_t ccs_height_in_tiles = DIV_ROUND_UP(height_in_tiles, 16);
+
+	if (drv_num_planes_from_format(format) != 1)
+		return -EINVAL;
+
+	bo->num_planes = 2;
+
+	bo->strides[0] = width_in_tiles * 128;
+	bo->sizes[0] = width_in_tiles * height_in_tiles * 4096;
+	bo->offsets[0] = 0;
+
+	bo->strides[1] = ccs_width_in_tiles * 128;
+	bo->sizes[1] = ccs_width_in_tiles * ccs_height_in_tiles * 4096;
+	bo->offsets[1] = bo->sizes[0];
+
+	bo->total_size = bo->offsets[1] + bo->sizes[1];
+
+	return 0;
+}
+
 static int i915_bo_create_for_modifier(struct bo *bo, uint32_t width, uint32_t height,
 				       uint32_t format, uint64_t modifier)
 {
@@ -351,13 +504,16 @@ static int i915_bo_create_for_modifier(struct bo *bo, uint32_t width, uint32_t h
 		bo->tiling = I915_TILING_X;
 		break;
 	case I915_FORMAT_MOD_Y_TILED:
+	case I915_FORMAT_MOD_Y_TILED_CCS:
 		bo->tiling = I915_TILING_Y;
 		break;
 	}
 
-	bo->format_modifiers[0] = modifier;
-
-	if (format == DRM_FORMAT_YVU420_ANDROID) {
+	if (modifier == I915_FORMAT_MOD_Y_TILED_CCS) {
+		ret = i915_ccs_bo_from_format(bo, width, height, format);
+		if (ret)
+			return ret;
+	} else if (format == DRM_FORMAT_YVU420_ANDROID) {
 		/*
 		 * We only need to be able to use this as a linear texture,
 		 * which doesn't put any HW restrictions on how we lay it
@@ -372,6 +528,9 @@ static int i915_bo_create_for_modifier(struct bo *bo, uint32_t width, uint32_t h
 		i915_bo_from_format(bo, width, height, format);
 	}
 
+	for (plane = 0; plane < bo->num_planes; plane++)
+		bo->format_modifiers[plane] = modifier;
+
 	memset(&gem_create, 0, sizeof(gem_create));
 	gem_create.size = bo->total_size;
 
@@ -406,30 +565,60 @@ static int i915_bo_create_for_modifier(struct bo *bo, uint32_t width, uint32_t h
 static int i915_bo_create(struct bo *bo, uint32_t width, uint32_t height, uint32_t format,
 			  uint64_t use_flags)
 {
-	struct combination *combo;
+	uint32_t i;
+	struct combination *curr, *best = NULL;
+
+	/*
+	 * Callers that don't negotiate modifiers can't deal with the aux plane, so the
+	 * best combination is picked with CCS left out.
+	 */
+	use_flags &= ~BO_USE_MEMORY_HINTS;
+	for (i = 0; i < drv_array_size(bo->drv->combos); i++) {
+		curr = drv_array_at_idx(bo->drv->combos, i);
+		if (curr->metadata.modifier == I915_FORMAT_MOD_Y_TILED_CCS)
+			continue;
 
-	combo = drv_get_combination(bo->drv, format, use_flags);
-	if (!combo)
+		if (format == curr->format && use_flags == (curr->use_flags & use_flags))
+			if (!best || best->metadata.priority < curr->metadata.priority)
+				best = curr;
+	}
+
+	if (!best)
 		return -EINVAL;
 
-	return i915_bo_create_for_modifier(bo, width, height, format, combo->metadata.modifier);
+	return i915_bo_create_for_modifier(bo, width, height, format, best->metadata.modifier);
 }
 
 static int i915_bo_create_with_modifiers(struct bo *bo, uint32_t width, uint32_t height,
 					 uint32_t format, const uint64_t *modifiers, uint32_t count)
 {
-	static const uint64_t modifier_order[] = {
-		I915_FORMAT_MOD_Y_TILED,
-		I915_FORMAT_MOD_X_TILED,
-		DRM_FORMAT_MOD_LINEAR,
-	};
+	struct i915_device *i915 = bo->drv->priv;
+	uint64_t modifier_order[4];
+	uint32_t order_count = 0;
 	uint64_t modifier;
 
-	modifier = drv_pick_modifier(modifiers, count, modifier_order, ARRAY_SIZE(modifier_order));
+	/* Only consider CCS on hardware that has it, and for formats it can compress. */
+	if (i915_can_compress(i915, format))
+		modifier_order[order_count++] = I915_FORMAT_MOD_Y_TILED_CCS;
+
+	modifier_order[order_count++] = I915_FORMAT_MOD_Y_TILED;
+	modifier_order[order_count++] = I915_FORMAT_MOD_X_TILED;
+	modifier_order[order_count++] = DRM_FORMAT_MOD_LINEAR;
+
+	modifier = drv_pick_modifier(modifiers, count, modifier_order, order_count);
 
 	return i915_bo_create_for_modifier(bo, width, height, format, modifier);
 }
 
+static uint32_t i915_num_planes_from_modifier(uint32_t format, uint64_t modifier)
+{
+	/* The CCS is an extra plane on top of the format's planes. */
+	if (modifier == I915_FORMAT_MOD_Y_TILED_CCS)
+		return drv_num_planes_from_format(format) + 1;
+
+	return drv_num_planes_from_format(format);
+}
+
 static void i915_close(struct driver *drv)
 {
 	free(drv->priv);
@@ -441,6 +630,8 @@ static int i915_bo_import(struct bo *bo, struct drv_import_fd_data *data)
 	int ret;
 	struct drm_i915_gem_get_tiling gem_get_tiling;
 
+	bo->num_planes = i915_num_planes_from_modifier(bo->format, data->format_modifiers[0]);
+
 	ret = drv_prime_bo_import(bo, data);
 	if (ret)
 		return ret;
@@ -460,30 +651,75 @@ static int i915_bo_import(struct bo *bo, struct drv_import_fd_data *data)
 	return 0;
 }
 
-static void *i915_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint32_t map_flags)
+/*
+ * Picks how CPU maps of a buffer are set up. Tiled buffers are mapped through
+ * their backing pages and detiled into a linear shadow, unless the kernel
+ * applies bit 6 swizzling or the buffer uses the gen3 tile layouts, in which
+ * case we fall back to the fenced GTT aperture. For the backing pages, WB is
+ * used wherever the CPU is coherent with the GPU or reads from the buffer
+ * often enough that uncached reads would hurt; otherwise WC. UC is never
+ * preferable to WC for CPU access, so it isn't used.
+ */
+static enum i915_map_strategy i915_pick_map_strategy(struct bo *bo)
+{
+	int ret;
+	struct i915_device *i915 = bo->drv->priv;
+	struct drm_i915_gem_get_tiling gem_get_tiling;
+
+	if (bo->tiling != I915_TILING_NONE) {
+		if (i915->gen == 3)
+			return I915_MAP_GTT;
+
+		memset(&gem_get_tiling, 0, sizeof(gem_get_tiling));
+		gem_get_tiling.handle = bo->handles[0].u32;
+
+		ret = drmIoctl(bo->drv->fd, DRM_IOCTL_I915_GEM_GET_TILING, &gem_get_tiling);
+		if (ret || gem_get_tiling.swizzle_mode != I915_BIT_6_SWIZZLE_NONE)
+			return I915_MAP_GTT;
+	}
+
+	if ((bo->use_flags & BO_USE_SCANOUT) && !(bo->use_flags & BO_USE_RENDERSCRIPT))
+		return I915_MAP_WC;
+
+	if (i915->has_llc || (bo->use_flags & (BO_USE_SW_READ_OFTEN | BO_USE_RENDERSCRIPT)))
+		return I915_MAP_WB;
+
+	return I915_MAP_WC;
+}
+
+static void *i915_mmap_pages(struct bo *bo, struct vma *vma, enum i915_map_strategy strategy,
+			     uint32_t map_flags)
 {
 	int ret;
 	void *addr;
 
-	if (bo->tiling == I915_TILING_NONE) {
-		struct drm_i915_gem_mmap gem_map;
+#ifdef DRM_IOCTL_I915_GEM_MMAP_OFFSET
+	struct i915_device *i915 = bo->drv->priv;
+	if (i915->has_mmap_offset) {
+		struct drm_i915_gem_mmap_offset gem_map;
 		memset(&gem_map, 0, sizeof(gem_map));
 
-		if ((bo->use_flags & BO_USE_SCANOUT) && !(bo->use_flags & BO_USE_RENDERSCRIPT))
-			gem_map.flags = I915_MMAP_WC;
-
 		gem_map.handle = bo->handles[0].u32;
-		gem_map.offset = 0;
-		gem_map.size = bo->total_size;
-
-		ret = drmIoctl(bo->drv->fd, DRM_IOCTL_I915_GEM_MMAP, &gem_map);
+		if (strategy == I915_MAP_GTT)
+			gem_map.flags = I915_MMAP_OFFSET_GTT;
+		else if (strategy == I915_MAP_WC)
+			gem_map.flags = I915_MMAP_OFFSET_WC;
+		else
+			gem_map.flags = I915_MMAP_OFFSET_WB;
+
+		ret = drmIoctl(bo->drv->fd, DRM_IOCTL_I915_GEM_MMAP_OFFSET, &gem_map);
 		if (ret) {
-			drv_log("DRM_IOCTL_I915_GEM_MMAP failed\n");
+			drv_log("DRM_IOCTL_I915_GEM_MMAP_OFFSET failed\n");
 			return MAP_FAILED;
 		}
 
-		addr = (void *)(uintptr_t)gem_map.addr_ptr;
-	} else {
+		drv_vma_from_object_start(vma);
+		return mmap(0, vma->length, drv_get_prot(map_flags), MAP_SHARED, bo->drv->fd,
+			    gem_map.offset);
+	}
+#endif
+
+	if (strategy == I915_MAP_GTT) {
 		struct drm_i915_gem_mmap_gtt gem_map;
 		memset(&gem_map, 0, sizeof(gem_map));
 
@@ -495,35 +731,233 @@ static void *i915_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint32_t
 			return MAP_FAILED;
 		}
 
-		addr = mmap(0, bo->total_size, drv_get_prot(map_flags), MAP_SHARED, bo->drv->fd,
+		drv_vma_from_object_start(vma);
+		return mmap(0, vma->length, drv_get_prot(map_flags), MAP_SHARED, bo->drv->fd,
 			    gem_map.offset);
+	} else {
+		struct drm_i915_gem_mmap gem_map;
+		memset(&gem_map, 0, sizeof(gem_map));
+
+		if (strategy == I915_MAP_WC)
+			gem_map.flags = I915_MMAP_WC;
+
+		gem_map.handle = bo->handles[0].u32;
+		gem_map.offset = vma->offset;
+		gem_map.size = vma->length;
+
+		ret = drmIoctl(bo->drv->fd, DRM_IOCTL_I915_GEM_MMAP, &gem_map);
+		if (ret) {
+			drv_log("DRM_IOCTL_I915_GEM_MMAP failed\n");
+			return MAP_FAILED;
+		}
+
+		addr = (void *)(uintptr_t)gem_map.addr_ptr;
+	}
+
+	return addr;
+}
+
+/*
+ * Copies one 16 byte OWord, the unit Y tiles are swizzled in. Reads from
+ * write-combined memory use streaming loads where available, since regular
+ * loads from WC memory are uncached.
+ */
+static inline void i915_copy_oword(uint8_t *dst, const uint8_t *src, bool from_wc)
+{
+#ifdef __SSE4_1__
+	if (from_wc) {
+		_mm_storeu_si128((__m128i *)dst, _mm_stream_load_si128((__m128i *)(uintptr_t)src));
+		return;
 	}
+#endif
+#ifdef __SSE2__
+	_mm_storeu_si128((__m128i *)dst, _mm_loadu_si128((const __m128i *)src));
+#else
+	memcpy(dst, src, 16);
+#endif
+}
 
+/*
+ * Converts the bytes [x0, x1) of rows [y0, y1) of a Y-tiled plane. Y tiles
+ * are 128 bytes x 32 rows, stored as eight columns of 16 byte x 32 rows, so
+ * we walk a tile column at a time and copy whole OWords wherever the range
+ * covers them. Partial OWords at the edges are copied byte exact, so that a
+ * write never clobbers pixels outside of the range.
+ */
+static void i915_transfer_y_tiled(uint8_t *tiled, uint8_t *untiled, uint32_t stride, uint32_t x0,
+				  uint32_t x1, uint32_t y0, uint32_t y1,
+				  enum i915_transfer_type type, bool from_wc)
+{
+	uint32_t x, y, row, next_y, begin, end;
+	uint8_t *column, *t, *l;
+
+	for (y = y0; y < y1; y = next_y) {
+		next_y = MIN(ALIGN(y + 1, 32), y1);
+
+		for (x = x0 & ~15u; x < x1; x += 16) {
+			column = tiled + (size_t)(y / 32) * stride * 32 + (x / 128) * 4096 +
+				 ((x % 128) / 16) * 512;
+			begin = MAX(x, x0);
+			end = MIN(x + 16, x1);
+
+			for (row = y; row < next_y; row++) {
+				t = column + (row % 32) * 16 + (begin - x);
+				l = untiled + (size_t)row * stride + begin;
+
+				if (end - begin == 16 && type == I915_READ_TILED_BUFFER)
+					i915_copy_oword(l, t, from_wc);
+				else if (end - begin == 16)
+					i915_copy_oword(t, l, false);
+				else if (type == I915_READ_TILED_BUFFER)
+					memcpy(l, t, end - begin);
+				else
+					memcpy(t, l, end - begin);
+			}
+		}
+	}
+}
+
+/*
+ * Converts the bytes [x0, x1) of rows [y0, y1) of an X-tiled plane. X tiles
+ * are 512 bytes x 8 rows stored row by row, so each tile row is a single
+ * contiguous copy.
+ */
+static void i915_transfer_x_tiled(uint8_t *tiled, uint8_t *untiled, uint32_t stride, uint32_t x0,
+				  uint32_t x1, uint32_t y0, uint32_t y1,
+				  enum i915_transfer_type type)
+{
+	uint32_t x, y, next_x;
+	uint8_t *t, *l;
+
+	for (y = y0; y < y1; y++) {
+		for (x = x0; x < x1; x = next_x) {
+			next_x = MIN(ALIGN(x + 1, 512), x1);
+			t = tiled + (size_t)(y / 8) * stride * 8 + (x / 512) * 4096 +
+			    (y % 8) * 512 + x % 512;
+			l = untiled + (size_t)y * stride + x;
+
+			if (type == I915_READ_TILED_BUFFER)
+				memcpy(l, t, next_x - x);
+			else
+				memcpy(t, l, next_x - x);
+		}
+	}
+}
+
+/*
+ * Converts the part of each plane covered by rect between the tiled buffer
+ * and its linear shadow, which uses the same strides and offsets.
+ */
+static void i915_transfer_tiled_memory(struct bo *bo, struct i915_private_map_data *priv,
+				       const struct rectangle *rect, enum i915_transfer_type type)
+{
+	size_t plane;
+	uint32_t hsub, vsub, bpp, stride, rows, x0, x1, y0, y1;
+	bool from_wc = priv->strategy == I915_MAP_WC;
+
+	for (plane = 0; plane < bo->num_planes; plane++) {
+		hsub = drv_horizontal_subsampling_from_format(bo->format, plane);
+		vsub = drv_vertical_subsampling_from_format(bo->format, plane);
+		bpp = drv_bytes_per_pixel_from_format(bo->format, plane);
+		stride = bo->strides[plane];
+		rows = bo->sizes[plane] / stride;
+
+		x0 = (rect->x / hsub) * bpp;
+		x1 = MIN(DIV_ROUND_UP(rect->x + rect->width, hsub) * bpp, stride);
+		y0 = rect->y / vsub;
+		y1 = MIN(DIV_ROUND_UP(rect->y + rect->height, vsub), rows);
+
+		if (bo->tiling == I915_TILING_X)
+			i915_transfer_x_tiled((uint8_t *)priv->tiled + bo->offsets[plane],
+					      (uint8_t *)priv->untiled + bo->offsets[plane], stride,
+					      x0, x1, y0, y1, type);
+		else
+			i915_transfer_y_tiled((uint8_t *)priv->tiled + bo->offsets[plane],
+					      (uint8_t *)priv->untiled + bo->offsets[plane], stride,
+					      x0, x1, y0, y1, type, from_wc);
+	}
+}
+
+static void *i915_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint32_t map_flags)
+{
+	void *addr;
+	struct i915_private_map_data *priv;
+
+	/* The main surface of a compressed buffer is meaningless without resolving it. */
+	if (bo->format_modifiers[0] == I915_FORMAT_MOD_Y_TILED_CCS)
+		return MAP_FAILED;
+
+	priv = calloc(1, sizeof(*priv));
+	if (!priv)
+		return MAP_FAILED;
+
+	priv->strategy = i915_pick_map_strategy(bo);
+
+	/* Tiled rows aren't contiguous in memory, so tiled buffers are always mapped whole. */
+	if (bo->tiling != I915_TILING_NONE) {
+		vma->offset = 0;
+		vma->length = bo->total_size;
+	}
+
+	addr = i915_mmap_pages(bo, vma, priv->strategy, map_flags);
 	if (addr == MAP_FAILED) {
 		drv_log("i915 GEM mmap failed\n");
+		free(priv);
 		return addr;
 	}
 
-	vma->length = bo->total_size;
+	vma->priv = priv;
+
+	if (bo->tiling != I915_TILING_NONE && priv->strategy != I915_MAP_GTT) {
+		priv->untiled = drv_shadow_alloc(bo, bo->total_size);
+		if (!priv->untiled) {
+			munmap(addr, bo->total_size);
+			free(priv);
+			vma->priv = NULL;
+			return MAP_FAILED;
+		}
+
+		priv->tiled = addr;
+		addr = priv->untiled;
+	}
+
 	return addr;
 }
 
+static int i915_bo_unmap(struct bo *bo, struct vma *vma)
+{
+	struct i915_private_map_data *priv = vma->priv;
+
+	if (priv) {
+		if (priv->untiled) {
+			vma->addr = priv->tiled;
+			drv_shadow_free(bo, priv->untiled, bo->total_size);
+		}
+
+		free(priv);
+		vma->priv = NULL;
+	}
+
+	return munmap(vma->addr, vma->length);
+}
+
 static int i915_bo_invalidate(struct bo *bo, struct mapping *mapping)
 {
 	int ret;
 	struct drm_i915_gem_set_domain set_domain;
+	struct i915_private_map_data *priv = mapping->vma->priv;
 
 	memset(&set_domain, 0, sizeof(set_domain));
 	set_domain.handle = bo->handles[0].u32;
-	if (bo->tiling == I915_TILING_NONE) {
-		set_domain.read_domains = I915_GEM_DOMAIN_CPU;
-		if (mapping->vma->map_flags & BO_MAP_WRITE)
-			set_domain.write_domain = I915_GEM_DOMAIN_CPU;
-	} else {
+	if (priv->strategy == I915_MAP_GTT)
 		set_domain.read_domains = I915_GEM_DOMAIN_GTT;
-		if (mapping->vma->map_flags & BO_MAP_WRITE)
-			set_domain.write_domain = I915_GEM_DOMAIN_GTT;
-	}
+	else if (priv->strategy == I915_MAP_WC)
+		set_domain.read_domains = I915_GEM_DOMAIN_WC;
+	else
+		set_domain.read_domains = I915_GEM_DOMAIN_CPU;
+
+	if (mapping->vma->map_flags & BO_MAP_WRITE)
+		set_domain.write_domain = set_domain.read_domains;
 
 	ret = drmIoctl(bo->drv->fd, DRM_IOCTL_I915_GEM_SET_DOMAIN, &set_domain);
 	if (ret) {
@@ -531,14 +965,24 @@ static int i915_bo_invalidate(struct bo *bo, struct mapping *mapping)
 		return ret;
 	}
 
+	/* Write-only maps don't need the old contents, since flush only writes back the rect. */
+	if (priv->untiled && (mapping->vma->map_flags & BO_MAP_READ))
+		i915_transfer_tiled_memory(bo, priv, &mapping->rect, I915_READ_TILED_BUFFER);
+
 	return 0;
 }
 
 static int i915_bo_flush(struct bo *bo, struct mapping *mapping)
 {
 	struct i915_device *i915 = bo->drv->priv;
-	if (!i915->has_llc && bo->tiling == I915_TILING_NONE)
-		i915_clflush(mapping->vma->addr, mapping->vma->length);
+	struct i915_private_map_data *priv = mapping->vma->priv;
+	void *addr = priv->untiled ? priv->tiled : mapping->vma->addr;
+
+	if (priv->untiled && (mapping->vma->map_flags & BO_MAP_WRITE))
+		i915_transfer_tiled_memory(bo, priv, &mapping->rect, I915_WRITE_TILED_BUFFER);
+
+	if (!i915->has_llc && priv->strategy == I915_MAP_WB)
+		i915_clflush(addr, mapping->vma->length);
 
 	return 0;
 }
@@ -577,10 +1021,11 @@ const struct backend backend_i915 = {
 	.bo_destroy = drv_gem_bo_destroy,
 	.bo_import = i915_bo_import,
 	.bo_map = i915_bo_map,
-	.bo_unmap = drv_bo_munmap,
+	.bo_unmap = i915_bo_unmap,
 	.bo_invalidate = i915_bo_invalidate,
 	.bo_flush = i915_bo_flush,
 	.resolve_format = i915_resolve_format,
+	.num_planes_from_modifier = i915_num_planes_from_modifier,
 };
 
 #endif
@@ -90,11 +90,12 @@ static void *mediatek_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint3
 	void *addr = mmap(0, bo->total_size, drv_get_prot(map_flags), MAP_SHARED, bo->drv->fd,
 			  gem_map.offset);
 
+	vma->offset = 0;
 	vma->length = bo->total_size;
 
 	if (bo->use_flags & BO_USE_RENDERSCRIPT) {
 		priv = calloc(1, sizeof(*priv));
-		priv->cached_addr = calloc(1, bo->total_size);
+		priv->cached_addr = drv_shadow_alloc(bo, bo->total_size);
 		priv->gem_addr = addr;
 		vma->priv = priv;
 		addr = priv->cached_addr;
@@ -108,7 +109,7 @@ static int mediatek_bo_unmap(struct bo *bo, struct vma *vma)
 	if (vma->priv) {
 		struct mediatek_private_map_data *priv = vma->priv;
 		vma->addr = priv->gem_addr;
-		free(priv->cached_addr);
+		drv_shadow_free(bo, priv->cached_addr, bo->total_size);
 		free(priv);
 		vma->priv = NULL;
 	}
@@ -18,8 +18,24 @@
 #include "helpers.h"
 #include "util.h"
 
+#define AFBC_PIXEL_SIZE 4
+#define AFBC_BLOCK_WIDTH 16
+#define AFBC_BLOCK_HEIGHT 16
+#define AFBC_HEADER_BLOCK_SIZE 16
+#define AFBC_BODY_BLOCK_ALIGNMENT 128
+
+#ifndef DRM_FORMAT_MOD_ARM_AFBC
+#define DRM_FORMAT_MOD_ARM_AFBC(__afbc_mode) fourcc_mod_code(ARM, __afbc_mode)
+#define AFBC_FORMAT_MOD_BLOCK_SIZE_MASK 0xf
+#define AFBC_FORMAT_MOD_BLOCK_SIZE_16x16 (1ULL)
+#define AFBC_FORMAT_MOD_BLOCK_SIZE_32x8 (2ULL)
+#define AFBC_FORMAT_MOD_YTR (1ULL << 4)
+#define AFBC_FORMAT_MOD_SPARSE (1ULL << 6)
+#endif
+
 struct rockchip_private_map_data {
 	void *cached_addr;
+	size_t cached_size;
 	void *gem_addr;
 };
 
@@ -30,50 +46,315 @@ static const uint32_t render_target_formats[] = { DRM_FORMAT_ABGR8888, DRM_FORMA
 static const uint32_t texture_source_formats[] = { DRM_FORMAT_R8, DRM_FORMAT_NV12,
 						   DRM_FORMAT_YVU420, DRM_FORMAT_YVU420_ANDROID };
 
-static int afbc_bo_from_format(struct bo *bo, uint32_t width, uint32_t height, uint32_t format)
-{
-	/* We've restricted ourselves to four bytes per pixel. */
-	const uint32_t pixel_size = 4;
-
-	const uint32_t clump_width = 4;
-	const uint32_t clump_height = 4;
-
-#define AFBC_NARROW 1
-#if AFBC_NARROW == 1
-	const uint32_t block_width = 4 * clump_width;
-	const uint32_t block_height = 4 * clump_height;
-#else
-	const uint32_t block_width = 8 * clump_width;
-	const uint32_t block_height = 2 * clump_height;
-#endif
+// clang-format off
+/*
+ * Position of each 4x4 subblock within a 16x16 superblock, in the order the
+ * subblocks are stored in the header and body.
+ */
+static const uint8_t afbc_subblock_order[16][2] = {
+	{ 1, 1 }, { 1, 0 }, { 0, 0 }, { 0, 1 },
+	{ 0, 2 }, { 0, 3 }, { 1, 3 }, { 1, 2 },
+	{ 2, 2 }, { 2, 3 }, { 3, 3 }, { 3, 2 },
+	{ 3, 1 }, { 3, 0 }, { 2, 0 }, { 2, 1 },
+};
+// clang-format on
+
+struct afbc_layout {
+	uint32_t bits_per_pixel;
+	uint32_t block_width;
+	uint32_t block_height;
+	uint32_t width_in_blocks;
+	uint32_t height_in_blocks;
+	uint32_t stride;
+	uint32_t body_plane_offset;
+	uint32_t body_block_size;
+	uint32_t total_size;
+	bool sparse;
+};
 
-	const uint32_t header_block_size = 16;
-	const uint32_t body_block_size = block_width * block_height * pixel_size;
-	const uint32_t width_in_blocks = DIV_ROUND_UP(width, block_width);
-	const uint32_t height_in_blocks = DIV_ROUND_UP(height, block_height);
-	const uint32_t total_blocks = width_in_blocks * height_in_blocks;
+/*
+ * Bits per pixel of a superblock body. YUV 4:2:0 formats are stored as a
+ * single interleaved plane.
+ */
+static uint32_t afbc_bits_per_pixel(uint32_t format)
+{
+	switch (format) {
+	case DRM_FORMAT_ABGR8888:
+	case DRM_FORMAT_ARGB8888:
+	case DRM_FORMAT_XBGR8888:
+	case DRM_FORMAT_XRGB8888:
+		return 32;
+	case DRM_FORMAT_BGR888:
+	case DRM_FORMAT_RGB888:
+		return 24;
+	case DRM_FORMAT_RGB565:
+		return 16;
+	case DRM_FORMAT_P010:
+		return 15;
+	case DRM_FORMAT_NV12:
+		return 12;
+	default:
+		return 0;
+	}
+}
 
-	const uint32_t header_plane_size = total_blocks * header_block_size;
-	const uint32_t body_plane_size = total_blocks * body_block_size;
+/*
+ * Superblock sizes come from the modifier: our own ChromeOS modifier always
+ * means 16x16 blocks, and the ARM modifiers select 16x16 or 32x8 blocks at
+ * runtime. Split blocks and tiled headers change the layout in ways we don't
+ * implement, so those modifiers are rejected.
+ */
+static int afbc_compute_layout(uint32_t width, uint32_t height, uint32_t format,
+			       uint64_t modifier, struct afbc_layout *layout)
+{
+	const uint32_t header_block_size = AFBC_HEADER_BLOCK_SIZE;
+	uint32_t total_blocks, header_plane_size, body_plane_size;
 
 	/* GPU requires 64 bytes, but EGL import code expects 1024 byte
 	 * alignement for the body plane. */
 	const uint32_t body_plane_alignment = 1024;
 
-	const uint32_t body_plane_offset = ALIGN(header_plane_size, body_plane_alignment);
-	const uint32_t total_size = body_plane_offset + body_plane_size;
+	layout->bits_per_pixel = afbc_bits_per_pixel(format);
+	if (!layout->bits_per_pixel)
+		return -EINVAL;
+
+	if (modifier == DRM_FORMAT_MOD_CHROMEOS_ROCKCHIP_AFBC) {
+		layout->block_width = 16;
+		layout->block_height = 16;
+		layout->sparse = true;
+	} else if ((modifier >> 56) == DRM_FORMAT_MOD_VENDOR_ARM &&
+		   !(modifier & ~(AFBC_FORMAT_MOD_BLOCK_SIZE_MASK | AFBC_FORMAT_MOD_YTR |
+				  AFBC_FORMAT_MOD_SPARSE | fourcc_mod_code(ARM, 0)))) {
+		switch (modifier & AFBC_FORMAT_MOD_BLOCK_SIZE_MASK) {
+		case AFBC_FORMAT_MOD_BLOCK_SIZE_16x16:
+			layout->block_width = 16;
+			layout->block_height = 16;
+			break;
+		case AFBC_FORMAT_MOD_BLOCK_SIZE_32x8:
+			layout->block_width = 32;
+			layout->block_height = 8;
+			break;
+		default:
+			return -EINVAL;
+		}
+
+		layout->sparse = modifier & AFBC_FORMAT_MOD_SPARSE;
+	} else {
+		return -EINVAL;
+	}
+
+	layout->width_in_blocks = DIV_ROUND_UP(width, layout->block_width);
+	layout->height_in_blocks = DIV_ROUND_UP(height, layout->block_height);
+	total_blocks = layout->width_in_blocks * layout->height_in_blocks;
+
+	layout->stride = DIV_ROUND_UP(layout->width_in_blocks * layout->block_width *
+					  layout->bits_per_pixel,
+				      8);
+	layout->body_block_size = ALIGN(DIV_ROUND_UP(layout->block_width * layout->block_height *
+							 layout->bits_per_pixel,
+						     8),
+					AFBC_BODY_BLOCK_ALIGNMENT);
+
+	header_plane_size = total_blocks * header_block_size;
+	body_plane_size = total_blocks * layout->body_block_size;
+
+	layout->body_plane_offset = ALIGN(header_plane_size, body_plane_alignment);
+	layout->total_size = layout->body_plane_offset + body_plane_size;
+
+	return 0;
+}
+
+static int afbc_bo_from_format(struct bo *bo, uint32_t width, uint32_t height, uint32_t format,
+			       uint64_t modifier)
+{
+	int ret;
+	struct afbc_layout layout;
+
+	ret = afbc_compute_layout(width, height, format, modifier, &layout);
+	if (ret)
+		return ret;
+
+	/* Everything, including the chroma of YUV formats, lives in one plane. */
+	bo->num_planes = 1;
 
-	bo->strides[0] = width_in_blocks * block_width * pixel_size;
-	bo->sizes[0] = total_size;
+	bo->strides[0] = layout.stride;
+	bo->sizes[0] = layout.total_size;
 	bo->offsets[0] = 0;
 
-	bo->total_size = total_size;
+	bo->total_size = layout.total_size;
+
+	bo->format_modifiers[0] = modifier;
+
+	return 0;
+}
+
+static bool afbc_is_modifier(uint64_t modifier)
+{
+	return modifier == DRM_FORMAT_MOD_CHROMEOS_ROCKCHIP_AFBC ||
+	       (modifier >> 56) == DRM_FORMAT_MOD_VENDOR_ARM;
+}
+
+/*
+ * Software path for CPU access to AFBC buffers. The linear shadow uses the
+ * AFBC stride and covers every superblock. We only encode superblocks with
+ * uncompressed subblocks, which every AFBC decoder has to accept. Each header
+ * holds a 32 bit body offset from the start of the buffer followed by
+ * sixteen 6 bit subblock sizes, where a size of 1 marks an uncompressed
+ * subblock. A header whose first 8 bytes are zero describes a superblock of
+ * one color, stored from byte 8 on. The decoder reads both of
+ * those back; compressed superblocks, which only the GPU writes, can't be
+ * decoded here, and buffers holding any in the mapped rect can't be mapped.
+ * Only 16x16 superblocks of 32 bit pixels are handled, and only in layouts
+ * that reserve a body slot per superblock, so that the encoder never
+ * overwrites the body of another superblock.
+ */
+static bool afbc_has_codec(const struct afbc_layout *layout)
+{
+	return layout->block_width == 16 && layout->block_height == 16 &&
+	       layout->bits_per_pixel == 32 && layout->sparse;
+}
+
+static uint32_t afbc_subblock_size(const uint8_t *header, uint32_t subblock)
+{
+	uint32_t bit = 32 + subblock * 6;
+	uint32_t value = header[bit / 8];
+
+	if (bit % 8 > 2)
+		value |= header[bit / 8 + 1] << 8;
 
-	bo->format_modifiers[0] = DRM_FORMAT_MOD_CHROMEOS_ROCKCHIP_AFBC;
+	return (value >> (bit % 8)) & 0x3f;
+}
+
+static int afbc_decode_block(const struct afbc_layout *layout, const uint8_t *afbc,
+			     uint8_t *linear, uint32_t stride, uint32_t bx, uint32_t by)
+{
+	const uint8_t *header = afbc + (by * layout->width_in_blocks + bx) * AFBC_HEADER_BLOCK_SIZE;
+	const uint8_t *body;
+	uint32_t body_offset, i, row;
+	uint8_t *dst;
+
+	body_offset =
+	    header[0] | (header[1] << 8) | (header[2] << 16) | ((uint32_t)header[3] << 24);
+	if (!body_offset) {
+		if (header[4] | header[5] | header[6] | header[7])
+			return -EINVAL;
+
+		dst = linear + (size_t)by * AFBC_BLOCK_HEIGHT * stride +
+		      bx * AFBC_BLOCK_WIDTH * AFBC_PIXEL_SIZE;
+		for (row = 0; row < AFBC_BLOCK_HEIGHT; row++, dst += stride)
+			for (i = 0; i < AFBC_BLOCK_WIDTH; i++)
+				memcpy(dst + i * AFBC_PIXEL_SIZE, header + 8, AFBC_PIXEL_SIZE);
+
+		return 0;
+	}
+
+	if (body_offset < layout->body_plane_offset ||
+	    body_offset > layout->total_size - layout->body_block_size)
+		return -EINVAL;
+
+	for (i = 0; i < 16; i++)
+		if (afbc_subblock_size(header, i) != 1)
+			return -EINVAL;
+
+	body = afbc + body_offset;
+	for (i = 0; i < 16; i++) {
+		dst = linear +
+		      (size_t)(by * AFBC_BLOCK_HEIGHT + afbc_subblock_order[i][1] * 4) * stride +
+		      (bx * AFBC_BLOCK_WIDTH + afbc_subblock_order[i][0] * 4) * AFBC_PIXEL_SIZE;
+
+		for (row = 0; row < 4; row++) {
+			memcpy(dst, body, 4 * AFBC_PIXEL_SIZE);
+			dst += stride;
+			body += 4 * AFBC_PIXEL_SIZE;
+		}
+	}
 
 	return 0;
 }
 
+static void afbc_encode_block(const struct afbc_layout *layout, uint8_t *afbc,
+			      const uint8_t *linear, uint32_t stride, uint32_t bx, uint32_t by)
+{
+	uint32_t block = by * layout->width_in_blocks + bx;
+	uint32_t body_offset = layout->body_plane_offset + block * layout->body_block_size;
+	uint8_t *header = afbc + block * AFBC_HEADER_BLOCK_SIZE;
+	uint8_t *body = afbc + body_offset;
+	const uint8_t *src;
+	uint32_t i, row;
+
+	for (i = 0; i < 16; i++) {
+		src = linear +
+		      (size_t)(by * AFBC_BLOCK_HEIGHT + afbc_subblock_order[i][1] * 4) * stride +
+		      (bx * AFBC_BLOCK_WIDTH + afbc_subblock_order[i][0] * 4) * AFBC_PIXEL_SIZE;
+
+		for (row = 0; row < 4; row++) {
+			memcpy(body, src, 4 * AFBC_PIXEL_SIZE);
+			src += stride;
+			body += 4 * AFBC_PIXEL_SIZE;
+		}
+	}
+
+	header[0] = body_offset;
+	header[1] = body_offset >> 8;
+	header[2] = body_offset >> 16;
+	header[3] = body_offset >> 24;
+
+	/* Sixteen 6 bit fields of value 1: the bit pattern 000001 repeated. */
+	for (i = 4; i < AFBC_HEADER_BLOCK_SIZE; i += 3) {
+		header[i] = 0x41;
+		header[i + 1] = 0x10;
+		header[i + 2] = 0x04;
+	}
+}
+
+/*
+ * Decodes (or encodes) the superblocks that intersect rect. When only_partial
+ * is set, only the superblocks that rect doesn't fully cover are decoded; a
+ * write-only mapping needs those so the encoder can write back whole blocks.
+ */
+static int afbc_transfer_rect(struct bo *bo, uint8_t *afbc, uint8_t *linear,
+			      const struct rectangle *rect, bool encode, bool only_partial)
+{
+	struct afbc_layout layout;
+	uint32_t bx, by, bx0, bx1, by0, by1;
+	bool partial;
+	int ret = 0;
+
+	ret = afbc_compute_layout(bo->width, bo->height, bo->format, bo->format_modifiers[0],
+				  &layout);
+	if (ret || !afbc_has_codec(&layout))
+		return -EINVAL;
+
+	bx0 = rect->x / AFBC_BLOCK_WIDTH;
+	by0 = rect->y / AFBC_BLOCK_HEIGHT;
+	bx1 = DIV_ROUND_UP(rect->x + rect->width, AFBC_BLOCK_WIDTH);
+	by1 = DIV_ROUND_UP(rect->y + rect->height, AFBC_BLOCK_HEIGHT);
+
+	for (by = by0; by < by1; by++) {
+		for (bx = bx0; bx < bx1; bx++) {
+			if (encode) {
+				afbc_encode_block(&layout, afbc, linear, bo->strides[0], bx, by);
+				continue;
+			}
+
+			partial = bx * AFBC_BLOCK_WIDTH < rect->x ||
+				  by * AFBC_BLOCK_HEIGHT < rect->y ||
+				  (bx + 1) * AFBC_BLOCK_WIDTH > rect->x + rect->width ||
+				  (by + 1) * AFBC_BLOCK_HEIGHT > rect->y + rect->height;
+			if (only_partial && !partial)
+				continue;
+
+			if (afbc_decode_block(&layout, afbc, linear, bo->strides[0], bx, by))
+				ret = -EINVAL;
+		}
+	}
+
+	if (ret)
+		drv_log("AFBC buffer contains compressed superblocks, which can't be mapped\n");
+
+	return ret;
+}
+
 static int rockchip_add_kms_item(struct driver *drv, const struct kms_item *item)
 {
 	uint32_t i, j;
@@ -81,27 +362,43 @@ static int rockchip_add_kms_item(struct driver *drv, const struct kms_item *item
 	struct combination *combo;
 	struct format_metadata metadata;
 
-	for (i = 0; i < drv_array_size(drv->combos); i++) {
-		combo = (struct combination *)drv_array_at_idx(drv->combos, i);
-		if (combo->format == item->format) {
-			if (item->modifier == DRM_FORMAT_MOD_CHROMEOS_ROCKCHIP_AFBC) {
-				use_flags = BO_USE_RENDERING | BO_USE_SCANOUT | BO_USE_TEXTURE;
-				metadata.modifier = item->modifier;
-				metadata.tiling = 0;
-				metadata.priority = 2;
-
-				for (j = 0; j < ARRAY_SIZE(texture_source_formats); j++) {
-					if (item->format == texture_source_formats[j])
-						use_flags &= ~BO_USE_RENDERING;
-				}
-
-				drv_add_combinations(drv, &item->format, 1, &metadata, use_flags);
-			} else {
+	if (!afbc_is_modifier(item->modifier)) {
+		for (i = 0; i < drv_array_size(drv->combos); i++) {
+			combo = (struct combination *)drv_array_at_idx(drv->combos, i);
+			if (combo->format == item->format)
 				combo->use_flags |= item->use_flags;
-			}
 		}
+
+		return 0;
+	}
+
+	/*
+	 * An AFBC item adds a combination of its own, once, for formats we already
+	 * support and know how to lay out.
+	 */
+	if (!afbc_bits_per_pixel(item->format))
+		return 0;
+
+	for (i = 0; i < drv_array_size(drv->combos); i++) {
+		combo = (struct combination *)drv_array_at_idx(drv->combos, i);
+		if (combo->format == item->format)
+			break;
+	}
+
+	if (i == drv_array_size(drv->combos))
+		return 0;
+
+	use_flags = BO_USE_RENDERING | BO_USE_SCANOUT | BO_USE_TEXTURE;
+	metadata.modifier = item->modifier;
+	metadata.tiling = 0;
+	metadata.priority = 2;
+
+	for (j = 0; j < ARRAY_SIZE(texture_source_formats); j++) {
+		if (item->format == texture_source_formats[j])
+			use_flags &= ~BO_USE_RENDERING;
 	}
 
+	drv_add_combinations(drv, &item->format, 1, &metadata, use_flags);
 	return 0;
 }
 
@@ -161,15 +458,41 @@ static bool has_modifier(const uint64_t *list, uint32_t count, uint64_t modifier
 	return false;
 }
 
+/* Returns the first AFBC modifier in list that we can lay out for format. */
+static bool afbc_pick_modifier(uint32_t width, uint32_t height, uint32_t format,
+			       const uint64_t *list, uint32_t count, uint64_t *modifier)
+{
+	uint32_t i;
+	struct afbc_layout layout;
+
+	for (i = 0; i < count; i++) {
+		if (afbc_is_modifier(list[i]) &&
+		    !afbc_compute_layout(width, height, format, list[i], &layout)) {
+			*modifier = list[i];
+			return true;
+		}
+	}
+
+	return false;
+}
+
 static int rockchip_bo_create_with_modifiers(struct bo *bo, uint32_t width, uint32_t height,
 					     uint32_t format, const uint64_t *modifiers,
 					     uint32_t count)
 {
 	int ret;
 	size_t plane;
+	uint64_t afbc_modifier;
 	struct drm_rockchip_gem_create gem_create;
 
-	if (format == DRM_FORMAT_NV12) {
+	if (width <= 2560 &&
+	    afbc_pick_modifier(width, height, format, modifiers, count, &afbc_modifier)) {
+		/* If the caller has decided they can use AFBC, always
+		 * pick that */
+		ret = afbc_bo_from_format(bo, width, height, format, afbc_modifier);
+		if (ret)
+			return ret;
+	} else if (format == DRM_FORMAT_NV12) {
 		uint32_t w_mbs = DIV_ROUND_UP(ALIGN(width, 16), 16);
 		uint32_t h_mbs = DIV_ROUND_UP(ALIGN(height, 16), 16);
 
@@ -178,11 +501,6 @@ static int rockchip_bo_create_with_modifiers(struct bo *bo, uint32_t width, uint
 
 		drv_bo_from_format(bo, aligned_width, height, format);
 		bo->total_size = bo->strides[0] * aligned_height + w_mbs * h_mbs * 128;
-	} else if (width <= 2560 &&
-		   has_modifier(modifiers, count, DRM_FORMAT_MOD_CHROMEOS_ROCKCHIP_AFBC)) {
-		/* If the caller has decided they can use AFBC, always
-		 * pick that */
-		afbc_bo_from_format(bo, width, height, format);
 	} else {
 		if (!has_modifier(modifiers, count, DRM_FORMAT_MOD_LINEAR)) {
 			errno = EINVAL;
@@ -231,16 +549,31 @@ static int rockchip_bo_create(struct bo *bo, uint32_t width, uint32_t height, ui
 						 ARRAY_SIZE(modifiers));
 }
 
+static int rockchip_bo_import(struct bo *bo, struct drv_import_fd_data *data)
+{
+	/* AFBC stores YUV formats in a single plane. */
+	if (afbc_is_modifier(data->format_modifiers[0]))
+		bo->num_planes = 1;
+
+	return drv_prime_bo_import(bo, data);
+}
+
 static void *rockchip_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint32_t map_flags)
 {
 	int ret;
 	struct drm_rockchip_gem_map_off gem_map;
 	struct rockchip_private_map_data *priv;
-
-	/* We can only map buffers created with SW access flags, which should
-	 * have no modifiers (ie, not AFBC). */
-	if (bo->format_modifiers[0] == DRM_FORMAT_MOD_CHROMEOS_ROCKCHIP_AFBC)
-		return MAP_FAILED;
+	struct afbc_layout layout;
+	bool afbc = afbc_is_modifier(bo->format_modifiers[0]);
+
+	if (afbc) {
+		ret = afbc_compute_layout(bo->width, bo->height, bo->format,
+					  bo->format_modifiers[0], &layout);
+		if (ret || !afbc_has_codec(&layout)) {
+			drv_log("No CPU access to this AFBC layout\n");
+			return MAP_FAILED;
+		}
+	}
 
 	memset(&gem_map, 0, sizeof(gem_map));
 	gem_map.handle = bo->handles[0].u32;
@@ -251,14 +584,28 @@ static void *rockchip_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint3
 		return MAP_FAILED;
 	}
 
-	void *addr = mmap(0, bo->total_size, drv_get_prot(map_flags), MAP_SHARED, bo->drv->fd,
-			  gem_map.offset);
+	/* The AFBC encoder reads back headers, so the GEM mapping always needs read access. */
+	void *addr = mmap(0, bo->total_size, drv_get_prot(map_flags | (afbc ? BO_MAP_READ : 0)),
+			  MAP_SHARED, bo->drv->fd, gem_map.offset);
 
+	vma->offset = 0;
 	vma->length = bo->total_size;
 
-	if (bo->use_flags & BO_USE_RENDERSCRIPT) {
+	if (addr == MAP_FAILED)
+		return addr;
+
+	if (afbc || (bo->use_flags & BO_USE_RENDERSCRIPT)) {
 		priv = calloc(1, sizeof(*priv));
-		priv->cached_addr = calloc(1, bo->total_size);
+		/* AFBC buffers are decoded into a linear shadow with the AFBC stride. */
+		if (afbc)
+			priv->cached_size = (size_t)layout.stride * layout.height_in_blocks *
+					    layout.block_height;
+		else
+			priv->cached_size = bo->total_size;
+
+		priv->cached_addr = drv_shadow_alloc(bo, priv->cached_size);
+		if (afbc && priv->cached_addr)
+			memset(priv->cached_addr, 0, priv->cached_size);
 		priv->gem_addr = addr;
 		vma->priv = priv;
 		addr = priv->cached_addr;
@@ -272,7 +619,7 @@ static int rockchip_bo_unmap(struct bo *bo, struct vma *vma)
 	if (vma->priv) {
 		struct rockchip_private_map_data *priv = vma->priv;
 		vma->addr = priv->gem_addr;
-		free(priv->cached_addr);
+		drv_shadow_free(bo, priv->cached_addr, priv->cached_size);
 		free(priv);
 		vma->priv = NULL;
 	}
@@ -282,20 +629,30 @@ static int rockchip_bo_unmap(struct bo *bo, struct vma *vma)
 
 static int rockchip_bo_invalidate(struct bo *bo, struct mapping *mapping)
 {
-	if (mapping->vma->priv) {
-		struct rockchip_private_map_data *priv = mapping->vma->priv;
-		memcpy(priv->cached_addr, priv->gem_addr, bo->total_size);
-	}
+	struct rockchip_private_map_data *priv = mapping->vma->priv;
+
+	if (!priv)
+		return 0;
+
+	if (afbc_is_modifier(bo->format_modifiers[0]))
+		return afbc_transfer_rect(bo, priv->gem_addr, priv->cached_addr, &mapping->rect,
+					  false, !(mapping->vma->map_flags & BO_MAP_READ));
 
+	memcpy(priv->cached_addr, priv->gem_addr, bo->total_size);
 	return 0;
 }
 
 static int rockchip_bo_flush(struct bo *bo, struct mapping *mapping)
 {
 	struct rockchip_private_map_data *priv = mapping->vma->priv;
-	if (priv && (mapping->vma->map_flags & BO_MAP_WRITE))
-		memcpy(priv->gem_addr, priv->cached_addr, bo->total_size);
+	if (!priv || !(mapping->vma->map_flags & BO_MAP_WRITE))
+		return 0;
+
+	if (afbc_is_modifier(bo->format_modifiers[0]))
+		return afbc_transfer_rect(bo, priv->gem_addr, priv->cached_addr, &mapping->rect,
+					  true, false);
 
+	memcpy(priv->gem_addr, priv->cached_addr, bo->total_size);
 	return 0;
 }
 
@@ -321,7 +678,7 @@ const struct backend backend_rockchip = {
 	.bo_create = rockchip_bo_create,
 	.bo_create_with_modifiers = rockchip_bo_create_with_modifiers,
 	.bo_destroy = drv_gem_bo_destroy,
-	.bo_import = drv_prime_bo_import,
+	.bo_import = rockchip_bo_import,
 	.bo_map = rockchip_bo_map,
 	.bo_unmap = rockchip_bo_unmap,
 	.bo_invalidate = rockchip_bo_invalidate,
@@ -7,6 +7,7 @@
 #ifdef DRV_TEGRA
 
 #include <assert.h>
+#include <errno.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/mman.h>
@@ -295,11 +296,10 @@ static int tegra_bo_import(struct bo *bo, struct drv_import_fd_data *data)
 	return 0;
 }
 
-static void *tegra_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint32_t map_flags)
+static void *tegra_gem_mmap(struct bo *bo, uint32_t map_flags)
 {
 	int ret;
 	struct drm_tegra_gem_mmap gem_map;
-	struct tegra_private_map_data *priv;
 
 	memset(&gem_map, 0, sizeof(gem_map));
 	gem_map.handle = bo->handles[0].u32;
@@ -310,12 +310,20 @@ static void *tegra_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint32_t
 		return MAP_FAILED;
 	}
 
-	void *addr = mmap(0, bo->total_size, drv_get_prot(map_flags), MAP_SHARED, bo->drv->fd,
-			  gem_map.offset);
+	return mmap(0, bo->total_size, drv_get_prot(map_flags), MAP_SHARED, bo->drv->fd,
+		    gem_map.offset);
+}
+
+static void *tegra_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint32_t map_flags)
+{
+	struct tegra_private_map_data *priv;
+	void *addr = tegra_gem_mmap(bo, map_flags);
+
+	vma->offset = 0;
 	vma->length = bo->total_size;
 	if ((bo->tiling & 0xFF) == NV_MEM_KIND_C32_2CRA && addr != MAP_FAILED) {
 		priv = calloc(1, sizeof(*priv));
-		priv->untiled = calloc(1, bo->total_size);
+		priv->untiled = drv_shadow_alloc(bo, bo->total_size);
 		priv->tiled = addr;
 		vma->priv = priv;
 		transfer_tiled_memory(bo, priv->tiled, priv->untiled, TEGRA_READ_TILED_BUFFER);
@@ -330,7 +338,7 @@ static int tegra_bo_unmap(struct bo *bo, struct vma *vma)
 	if (vma->priv) {
 		struct tegra_private_map_data *priv = vma->priv;
 		vma->addr = priv->tiled;
-		free(priv->untiled);
+		drv_shadow_free(bo, priv->untiled, bo->total_size);
 		free(priv);
 		vma->priv = NULL;
 	}
@@ -348,6 +356,36 @@ static int tegra_bo_flush(struct bo *bo, struct mapping *mapping)
 	return 0;
 }
 
+/*
+ * Whole buffers with the same layout are copied as they are laid out in memory, which saves
+ * detiling the source and retiling the destination through the shadow copies.
+ */
+static int tegra_bo_copy(struct bo *dst, struct bo *src, const struct rectangle *rect)
+{
+	void *src_addr, *dst_addr;
+
+	if (rect->x || rect->y || rect->width != src->width || rect->height != src->height ||
+	    src->width != dst->width || src->height != dst->height || src->tiling != dst->tiling ||
+	    src->strides[0] != dst->strides[0] || src->total_size != dst->total_size)
+		return -EOPNOTSUPP;
+
+	src_addr = tegra_gem_mmap(src, BO_MAP_READ);
+	if (src_addr == MAP_FAILED)
+		return -EFAULT;
+
+	dst_addr = tegra_gem_mmap(dst, BO_MAP_WRITE);
+	if (dst_addr == MAP_FAILED) {
+		munmap(src_addr, src->total_size);
+		return -EFAULT;
+	}
+
+	memcpy(dst_addr, src_addr, src->total_size);
+
+	munmap(dst_addr, dst->total_size);
+	munmap(src_addr, src->total_size);
+	return 0;
+}
+
 const struct backend backend_tegra = {
 	.name = "tegra",
 	.init = tegra_init,
@@ -357,6 +395,7 @@ const struct backend backend_tegra = {
 	.bo_map = tegra_bo_map,
 	.bo_unmap = tegra_bo_unmap,
 	.bo_flush = tegra_bo_flush,
+	.bo_copy = tegra_bo_copy,
 };
 
 #endif
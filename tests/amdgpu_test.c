@@ -0,0 +1,434 @@
+/*
+ * Copyright 2020 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include <amdgpu_drm.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <xf86drm.h>
+
+#include "drv.h"
+#include "fake_drm.h"
+#include "gbm.h"
+#include "stub_dri.h"
+#include "test.h"
+#include "util.h"
+
+/* Pre-GFX9 parts leave tiling to radeonsi, which is stub_dri.c here. */
+#define TEST_FAMILY AMDGPU_FAMILY_CZ
+
+/* Combinations that radeonsi allocates. */
+#define DRI_USE_FLAGS (BO_USE_RENDERING | BO_USE_SCANOUT)
+
+/* Any vendor modifier will do; only the stub looks at it. */
+#define TEST_AUX_MODIFIER ((2ull << 56) | 0x1234)
+
+struct stub_dri stub_dri;
+
+static uint32_t family;
+
+static int amdgpu_ioctl(int fd, unsigned long request, void *arg)
+{
+	switch (request) {
+	case DRM_IOCTL_AMDGPU_INFO: {
+		struct drm_amdgpu_info *info = arg;
+		struct drm_amdgpu_info_device *dev_info = (void *)(uintptr_t)info->return_pointer;
+		if (info->query != AMDGPU_INFO_DEV_INFO)
+			return -EINVAL;
+
+		memset(dev_info, 0, info->return_size);
+		dev_info->family = family;
+		return 0;
+	}
+	case DRM_IOCTL_AMDGPU_GEM_CREATE: {
+		union drm_amdgpu_gem_create *create = arg;
+		uint32_t handle = fake_drm_create_object(create->in.bo_size);
+		memset(&create->out, 0, sizeof(create->out));
+		create->out.handle = handle;
+		return handle ? 0 : -ENOMEM;
+	}
+	case DRM_IOCTL_AMDGPU_GEM_MMAP: {
+		union drm_amdgpu_gem_mmap *map = arg;
+		uint64_t offset = fake_drm_object_offset(map->in.handle);
+		map->out.addr_ptr = offset;
+		return 0;
+	}
+	case DRM_IOCTL_AMDGPU_GEM_METADATA:
+		return 0;
+	default:
+		return FAKE_DRM_DEFAULT;
+	}
+}
+
+static struct driver *open_amdgpu(uint32_t id)
+{
+	int fd;
+	struct driver *drv;
+
+	family = id;
+	fd = fake_drm_open("amdgpu", amdgpu_ioctl);
+	CHECK(fd >= 0);
+
+	drv = drv_create(fd);
+	CHECK(drv);
+	return drv;
+}
+
+static void close_amdgpu(struct driver *drv)
+{
+	int fd = drv_get_fd(drv);
+
+	drv_destroy(drv);
+	fake_drm_close(fd);
+}
+
+static void wait_for_idle_unload(void)
+{
+	int i;
+
+	for (i = 0; i < 50 && stub_dri.live_screens; i++)
+		usleep(100000);
+}
+
+/* radeonsi is loaded by the first image, and only its screen goes away when idle. */
+static void test_lazy_load(void)
+{
+	struct bo *bo;
+	struct driver *drv;
+
+	memset(&stub_dri, 0, sizeof(stub_dri));
+	drv = open_amdgpu(TEST_FAMILY);
+	CHECK(!stub_dri.opens && !stub_dri.screens_created);
+
+	/* Linear buffers never need it. */
+	bo = drv_bo_create(drv, 64, 64, DRM_FORMAT_XRGB8888, BO_USE_LINEAR | BO_USE_SW_READ_OFTEN);
+	CHECK(bo);
+	drv_bo_destroy(bo);
+	CHECK(!stub_dri.opens);
+
+	bo = drv_bo_create(drv, 64, 64, DRM_FORMAT_XRGB8888, DRI_USE_FLAGS);
+	CHECK(bo);
+	CHECK(stub_dri.opens == 1 && stub_dri.live_screens == 1 && stub_dri.live_images == 1);
+	drv_bo_destroy(bo);
+	CHECK(!stub_dri.live_images);
+
+	wait_for_idle_unload();
+	CHECK(!stub_dri.live_screens);
+
+	bo = drv_bo_create(drv, 64, 64, DRM_FORMAT_XRGB8888, DRI_USE_FLAGS);
+	CHECK(bo);
+	CHECK(stub_dri.opens == 1 && stub_dri.screens_created == 2);
+	drv_bo_destroy(bo);
+
+	close_amdgpu(drv);
+	CHECK(!stub_dri.live_screens);
+}
+
+/* If radeonsi is there but won't load, its combinations fall back to linear buffers. */
+static void test_failed_load(void)
+{
+	int i;
+	struct bo *bo;
+	struct driver *drv;
+
+	memset(&stub_dri, 0, sizeof(stub_dri));
+	stub_dri.fail_screen = true;
+	drv = open_amdgpu(TEST_FAMILY);
+
+	for (i = 0; i < 2; i++) {
+		bo = drv_bo_create(drv, 64, 64, DRM_FORMAT_XRGB8888, DRI_USE_FLAGS);
+		CHECK(bo);
+		CHECK(drv_bo_get_plane_format_modifier(bo, 0) == DRM_FORMAT_MOD_LINEAR);
+		drv_bo_destroy(bo);
+	}
+
+	/* Loading is only tried once. */
+	CHECK(stub_dri.screens_created == 1 && !stub_dri.live_images);
+	close_amdgpu(drv);
+}
+
+/* Rect-only maps have radeonsi blit just the rows they cover, and only writes flush. */
+static void test_map_rows(void)
+{
+	struct bo *bo;
+	uint8_t *addr, *object;
+	uint32_t y, stride;
+	struct driver *drv;
+	struct mapping *mapping, *other;
+	const size_t row_bytes = 200 * 4;
+	struct rectangle rect = { 0, 64, 200, 16 };
+	struct rectangle all = { 0, 0, 200, 256 };
+
+	memset(&stub_dri, 0, sizeof(stub_dri));
+	drv = open_amdgpu(TEST_FAMILY);
+	bo = drv_bo_create(drv, 200, 256, DRM_FORMAT_XRGB8888,
+			   DRI_USE_FLAGS | BO_USE_SW_READ_RARELY | BO_USE_SW_WRITE_RARELY);
+	CHECK(bo && stub_dri.live_images == 1);
+
+	addr = drv_bo_map(bo, &rect, BO_MAP_WRITE | BO_MAP_RECT_ONLY, &mapping, 0);
+	CHECK(addr != MAP_FAILED);
+	stride = mapping->vma->map_strides[0];
+	for (y = 0; y < rect.height; y++)
+		memset(addr + (size_t)y * stride, y + 1, row_bytes);
+	CHECK(!stub_dri.bytes_blitted);
+	CHECK(!drv_bo_unmap(bo, mapping));
+	CHECK(stub_dri.bytes_blitted == rect.height * row_bytes && stub_dri.flushes == 1);
+
+	/* The rows landed where they belong, at radeonsi's own pitch. */
+	object = fake_drm_object_data(drv_bo_get_plane_handle(bo, 0).u32);
+	stride = drv_bo_get_plane_stride(bo, 0);
+	CHECK(stride != row_bytes);
+	for (y = 0; y < all.height; y++)
+		CHECK(object[(size_t)y * stride + row_bytes - 1] ==
+		      (y >= rect.y && y < rect.y + rect.height ? y - rect.y + 1 : 0));
+
+	stub_dri.bytes_blitted = 0;
+	addr = drv_bo_map(bo, &rect, BO_MAP_READ | BO_MAP_RECT_ONLY, &mapping, 0);
+	CHECK(addr != MAP_FAILED && addr[0] == 1);
+	CHECK(!drv_bo_unmap(bo, mapping));
+	CHECK(stub_dri.bytes_blitted == rect.height * row_bytes && stub_dri.flushes == 1);
+
+	/* A write map unmapped while another is alive still submits its write back. */
+	addr = drv_bo_map(bo, &rect, BO_MAP_WRITE | BO_MAP_RECT_ONLY, &mapping, 0);
+	CHECK(addr != MAP_FAILED);
+	CHECK(drv_bo_map(bo, &all, BO_MAP_WRITE, &other, 0) != MAP_FAILED);
+	CHECK(!drv_bo_unmap(bo, mapping));
+	CHECK(stub_dri.flushes == 2);
+	CHECK(!drv_bo_unmap(bo, other));
+	CHECK(stub_dri.flushes == 3);
+
+	/* Without BO_MAP_RECT_ONLY, the whole plane is blitted. */
+	stub_dri.bytes_blitted = 0;
+	addr = drv_bo_map(bo, &rect, BO_MAP_READ, &mapping, 0);
+	CHECK(addr != MAP_FAILED);
+	CHECK(!drv_bo_unmap(bo, mapping));
+	CHECK(stub_dri.bytes_blitted == all.height * row_bytes);
+
+	drv_bo_destroy(bo);
+	close_amdgpu(drv);
+}
+
+/* radeonsi's metadata planes are laid out after the pixels, and are neither cleared nor mapped. */
+static void test_aux_plane(void)
+{
+	size_t plane;
+	uint32_t handle;
+	struct bo *bo;
+	struct driver *drv;
+	struct mapping *mapping;
+	struct rectangle rect = { 0, 0, 200, 256 };
+
+	memset(&stub_dri, 0, sizeof(stub_dri));
+	stub_dri.aux_modifier = TEST_AUX_MODIFIER;
+	drv = open_amdgpu(TEST_FAMILY);
+	bo = drv_bo_create(drv, 200, 256, DRM_FORMAT_XRGB8888,
+			   DRI_USE_FLAGS | BO_USE_SW_READ_RARELY | BO_USE_CLEAR);
+	CHECK(bo && stub_dri.live_images == 1);
+
+	CHECK(drv_bo_get_num_planes(bo) == 2);
+	handle = drv_bo_get_plane_handle(bo, 0).u32;
+	CHECK(drv_bo_get_plane_handle(bo, 1).u32 == handle);
+	for (plane = 0; plane < 2; plane++)
+		CHECK(drv_bo_get_plane_format_modifier(bo, plane) == TEST_AUX_MODIFIER);
+
+	/* Each plane runs up to the next one, and the last to the end of the buffer. */
+	CHECK(drv_bo_get_plane_offset(bo, 0) == 0);
+	CHECK(drv_bo_get_plane_size(bo, 0) == drv_bo_get_plane_offset(bo, 1));
+	CHECK(drv_bo_get_plane_offset(bo, 1) + drv_bo_get_plane_size(bo, 1) ==
+	      fake_drm_object_size(handle));
+	CHECK(drv_bo_get_plane_stride(bo, 1) < drv_bo_get_plane_stride(bo, 0));
+
+	CHECK(stub_dri.bytes_blitted == rect.height * rect.width * 4);
+	CHECK(drv_bo_map(bo, &rect, BO_MAP_READ, &mapping, 1) == MAP_FAILED);
+
+	drv_bo_destroy(bo);
+	CHECK(!stub_dri.live_images);
+	close_amdgpu(drv);
+}
+
+/* radeonsi maps only the pixels, so gbm_bo_map2 can't hand out the metadata plane. */
+static void test_map2_outside_vma(void)
+{
+	int fd;
+	struct gbm_bo *bo;
+	struct gbm_device *gbm;
+	void *map_data, *addrs[GBM_MAX_PLANES];
+	uint32_t strides[GBM_MAX_PLANES];
+
+	memset(&stub_dri, 0, sizeof(stub_dri));
+	stub_dri.aux_modifier = TEST_AUX_MODIFIER;
+	family = TEST_FAMILY;
+	fd = fake_drm_open("amdgpu", amdgpu_ioctl);
+	CHECK(fd >= 0);
+	gbm = gbm_create_device(fd);
+	CHECK(gbm);
+
+	bo = gbm_bo_create(gbm, 200, 256, GBM_FORMAT_XRGB8888,
+			   GBM_BO_USE_RENDERING | GBM_BO_USE_SW_READ_RARELY);
+	CHECK(bo && gbm_bo_get_num_planes(bo) == 2);
+
+	map_data = &map_data;
+	CHECK(gbm_bo_map2(bo, 0, 0, 200, 256, GBM_BO_TRANSFER_READ, addrs, strides, &map_data) ==
+	      -EINVAL);
+	CHECK(!map_data);
+
+	/* The failed map left nothing behind to unmap. */
+	gbm_bo_destroy(bo);
+	CHECK(!stub_dri.live_images);
+	gbm_device_destroy(gbm);
+	fake_drm_close(fd);
+}
+
+/* NV12 sampled by the GPU is put together from a radeonsi image per plane. */
+static void test_planar(void)
+{
+	uint32_t y;
+	uint8_t *addr, *object;
+	struct bo *bo;
+	struct driver *drv;
+	struct mapping *mapping;
+	struct rectangle rect = { 0, 0, 200, 128 };
+
+	memset(&stub_dri, 0, sizeof(stub_dri));
+	drv = open_amdgpu(TEST_FAMILY);
+	bo = drv_bo_create(drv, rect.width, rect.height, DRM_FORMAT_NV12,
+			   BO_USE_TEXTURE | BO_USE_CLEAR);
+	CHECK(bo);
+
+	/* Only the planar image is left once the planes are imported into it. */
+	CHECK(stub_dri.live_images == 1);
+	CHECK(drv_bo_get_num_planes(bo) == 2);
+	CHECK(drv_bo_get_plane_handle(bo, 0).u32 != drv_bo_get_plane_handle(bo, 1).u32);
+	CHECK(drv_bo_get_plane_offset(bo, 0) == 0 && drv_bo_get_plane_offset(bo, 1) == 0);
+	CHECK(drv_bo_get_plane_stride(bo, 0) == 256 && drv_bo_get_plane_stride(bo, 1) == 256);
+	CHECK(drv_bo_get_plane_size(bo, 0) == 256 * 128);
+	CHECK(drv_bo_get_plane_size(bo, 1) == 256 * 64);
+
+	/* Each plane is cleared through its own plane image. */
+	CHECK(stub_dri.bytes_blitted == 200 * 128 + 100 * 2 * 64);
+
+	rect.height = 64;
+	addr = drv_bo_map(bo, &rect, BO_MAP_WRITE, &mapping, 1);
+	CHECK(addr != MAP_FAILED);
+	for (y = 0; y < rect.height; y++)
+		memset(addr + (size_t)y * mapping->vma->map_strides[1], y + 1, rect.width);
+	CHECK(!drv_bo_unmap(bo, mapping));
+
+	object = fake_drm_object_data(drv_bo_get_plane_handle(bo, 1).u32);
+	for (y = 0; y < rect.height; y++)
+		CHECK(object[y * 256] == y + 1 && object[y * 256 + rect.width - 1] == y + 1);
+
+	drv_bo_destroy(bo);
+	CHECK(!stub_dri.live_images);
+	close_amdgpu(drv);
+}
+
+static void bench_init(void)
+{
+	int i;
+	double start;
+	const int iterations = 100;
+
+	/* radeonsi takes tens of milliseconds to create a screen. */
+	memset(&stub_dri, 0, sizeof(stub_dri));
+	stub_dri.screen_delay_us = 20000;
+
+	start = test_seconds();
+	for (i = 0; i < iterations; i++)
+		close_amdgpu(open_amdgpu(TEST_FAMILY));
+	BENCH_REPORT("amdgpu drv_create with radeonsi", iterations, "/s", test_seconds() - start);
+	CHECK(!stub_dri.screens_created);
+
+	stub_dri.screen_delay_us = 0;
+}
+
+/* Time to first frame of a pool of 4K buffers: allocating them, then drawing into each once. */
+static void bench_first_frame(uint64_t use_flags, const char *name)
+{
+	int i, j;
+	double start, seconds = 0;
+	char label[64];
+	void *addr;
+	struct driver *drv;
+	struct mapping *mapping;
+	struct bo *pool[4];
+	const int iterations = 5;
+	struct rectangle rect = { 0, 0, 3840, 2160 };
+
+	memset(&stub_dri, 0, sizeof(stub_dri));
+	drv = open_amdgpu(TEST_FAMILY);
+	use_flags |= DRI_USE_FLAGS | BO_USE_SW_WRITE_OFTEN;
+
+	for (i = 0; i < iterations; i++) {
+		start = test_seconds();
+		for (j = 0; j < (int)ARRAY_SIZE(pool); j++) {
+			pool[j] = drv_bo_create(drv, rect.width, rect.height, DRM_FORMAT_XRGB8888,
+						use_flags);
+			CHECK(pool[j]);
+			addr = drv_bo_map(pool[j], &rect, BO_MAP_WRITE, &mapping, 0);
+			CHECK(addr != MAP_FAILED);
+			memset(addr, 0x80, (size_t)mapping->vma->map_strides[0] * rect.height);
+			CHECK(!drv_bo_unmap(pool[j], mapping));
+		}
+		seconds += test_seconds() - start;
+
+		for (j = 0; j < (int)ARRAY_SIZE(pool); j++)
+			drv_bo_destroy(pool[j]);
+	}
+
+	snprintf(label, sizeof(label), "4K pool first frame, %s", name);
+	BENCH_REPORT(label, iterations, "pools/s", seconds);
+	close_amdgpu(drv);
+}
+
+/* A 64x64 tile read out of a 4K image, where radeonsi blits the rows the map covers. */
+static void bench_small_rect(uint32_t rect_only, const char *name)
+{
+	int i;
+	double start;
+	char label[64];
+	struct bo *bo;
+	struct driver *drv;
+	struct mapping *mapping;
+	const int iterations = 200;
+	struct rectangle rect = { 1888, 1048, 64, 64 };
+
+	memset(&stub_dri, 0, sizeof(stub_dri));
+	drv = open_amdgpu(TEST_FAMILY);
+	bo = drv_bo_create(drv, 3840, 2160, DRM_FORMAT_XRGB8888,
+			   DRI_USE_FLAGS | BO_USE_SW_READ_RARELY);
+	CHECK(bo && stub_dri.live_images == 1);
+
+	start = test_seconds();
+	for (i = 0; i < iterations; i++) {
+		CHECK(drv_bo_map(bo, &rect, BO_MAP_READ | rect_only, &mapping, 0) != MAP_FAILED);
+		CHECK(!drv_bo_unmap(bo, mapping));
+	}
+
+	snprintf(label, sizeof(label), "map 64x64 of 4K, %s", name);
+	BENCH_REPORT_LATENCY(label, iterations, test_seconds() - start);
+
+	drv_bo_destroy(bo);
+	close_amdgpu(drv);
+}
+
+int main(void)
+{
+	test_lazy_load();
+	test_failed_load();
+	test_map_rows();
+	test_aux_plane();
+	test_map2_outside_vma();
+	test_planar();
+	bench_init();
+	bench_small_rect(0, "whole plane");
+	bench_small_rect(BO_MAP_RECT_ONLY, "rect only");
+	bench_first_frame(0, "no clear");
+	bench_first_frame(BO_USE_CLEAR, "cleared");
+
+	return 0;
+}
@@ -0,0 +1,266 @@
+/*
+ * Copyright 2020 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include <errno.h>
+#include <rockchip_drm.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <xf86drm.h>
+
+#include "convert.h"
+#include "drv.h"
+#include "fake_drm.h"
+#include "test.h"
+#include "util.h"
+
+/* rockchip has linear, CPU-mapped combinations for every format converted here. */
+#define USE_FLAGS (BO_USE_TEXTURE | BO_USE_SW_READ_OFTEN | BO_USE_SW_WRITE_OFTEN)
+
+static int rockchip_ioctl(int fd, unsigned long request, void *arg)
+{
+	switch (request) {
+	case DRM_IOCTL_ROCKCHIP_GEM_CREATE: {
+		struct drm_rockchip_gem_create *create = arg;
+		create->handle = fake_drm_create_object(create->size);
+		return create->handle ? 0 : -ENOMEM;
+	}
+	case DRM_IOCTL_ROCKCHIP_GEM_MAP_OFFSET: {
+		struct drm_rockchip_gem_map_off *map = arg;
+		map->offset = fake_drm_object_offset(map->handle);
+		return 0;
+	}
+	default:
+		return FAKE_DRM_DEFAULT;
+	}
+}
+
+static uint8_t *plane_data(struct bo *bo, size_t plane)
+{
+	uint8_t *data = fake_drm_object_data(drv_bo_get_plane_handle(bo, plane).u32);
+
+	CHECK(data);
+	return data + drv_bo_get_plane_offset(bo, plane);
+}
+
+static struct bo *create_bo(struct driver *drv, uint32_t width, uint32_t height, uint32_t format)
+{
+	struct bo *bo = drv_bo_create(drv, width, height, format, USE_FLAGS);
+
+	CHECK(bo);
+	return bo;
+}
+
+static struct bo *create_filled_bo(struct driver *drv, uint32_t width, uint32_t height,
+				   uint32_t format)
+{
+	size_t plane, i;
+	uint8_t *data;
+	struct bo *bo = create_bo(drv, width, height, format);
+
+	for (plane = 0; plane < drv_bo_get_num_planes(bo); plane++) {
+		data = plane_data(bo, plane);
+		for (i = 0; i < drv_bo_get_plane_size(bo, plane); i++)
+			data[i] = (i * 7 + plane * 31) & 0xff;
+	}
+
+	return bo;
+}
+
+/* Swapping red and blue, and making opaque what had no alpha. */
+static void test_rgb32(struct driver *drv)
+{
+	uint32_t x, y;
+	struct bo *src, *dst;
+	uint8_t *s, *d;
+	struct rectangle rect = { 0, 0, 64, 16 };
+
+	src = create_filled_bo(drv, rect.width, rect.height, DRM_FORMAT_XRGB8888);
+	dst = create_bo(drv, rect.width, rect.height, DRM_FORMAT_ABGR8888);
+	CHECK(!drv_bo_convert(src, dst, &rect));
+
+	for (y = 0; y < rect.height; y++) {
+		for (x = 0; x < rect.width; x++) {
+			s = plane_data(src, 0) + y * drv_bo_get_plane_stride(src, 0) + x * 4;
+			d = plane_data(dst, 0) + y * drv_bo_get_plane_stride(dst, 0) + x * 4;
+			CHECK(d[0] == s[2] && d[1] == s[1] && d[2] == s[0] && d[3] == 0xff);
+		}
+	}
+
+	drv_bo_destroy(src);
+	drv_bo_destroy(dst);
+}
+
+/* NV12 to YV12 splits the chroma planes, V first, and back again merges them losslessly. */
+static void test_yuv(struct driver *drv)
+{
+	uint32_t x, y;
+	struct bo *nv12, *yv12, *back;
+	uint8_t *uv, *v, *u;
+	struct rectangle rect = { 0, 0, 64, 32 };
+
+	nv12 = create_filled_bo(drv, rect.width, rect.height, DRM_FORMAT_NV12);
+	yv12 = create_bo(drv, rect.width, rect.height, DRM_FORMAT_YVU420);
+	back = create_bo(drv, rect.width, rect.height, DRM_FORMAT_NV12);
+	CHECK(!drv_bo_convert(nv12, yv12, &rect));
+	CHECK(!drv_bo_convert(yv12, back, &rect));
+
+	for (y = 0; y < rect.height / 2; y++) {
+		uv = plane_data(nv12, 1) + y * drv_bo_get_plane_stride(nv12, 1);
+		v = plane_data(yv12, 1) + y * drv_bo_get_plane_stride(yv12, 1);
+		u = plane_data(yv12, 2) + y * drv_bo_get_plane_stride(yv12, 2);
+		for (x = 0; x < rect.width / 2; x++)
+			CHECK(u[x] == uv[2 * x] && v[x] == uv[2 * x + 1]);
+
+		CHECK(!memcmp(plane_data(back, 1) + y * drv_bo_get_plane_stride(back, 1), uv,
+			      rect.width));
+	}
+
+	for (y = 0; y < rect.height; y++)
+		CHECK(!memcmp(plane_data(back, 0) + y * drv_bo_get_plane_stride(back, 0),
+			      plane_data(nv12, 0) + y * drv_bo_get_plane_stride(nv12, 0),
+			      rect.width));
+
+	drv_bo_destroy(nv12);
+	drv_bo_destroy(yv12);
+	drv_bo_destroy(back);
+}
+
+static void bench_convert(struct driver *drv, uint32_t src_format, uint32_t dst_format,
+			  const char *name)
+{
+	int i;
+	double start;
+	char label[64];
+	struct bo *src, *dst;
+	const int iterations = 20;
+	struct rectangle rect = { 0, 0, 1920, 1080 };
+
+	src = create_filled_bo(drv, rect.width, rect.height, src_format);
+	dst = create_bo(drv, rect.width, rect.height, dst_format);
+
+	start = test_seconds();
+	for (i = 0; i < iterations; i++)
+		CHECK(!drv_bo_convert(src, dst, &rect));
+
+	snprintf(label, sizeof(label), "convert %s 1080p", name);
+	BENCH_REPORT(label, iterations * rect.width * rect.height / 1e6, "MPix/s",
+		     test_seconds() - start);
+
+	drv_bo_destroy(src);
+	drv_bo_destroy(dst);
+}
+
+static void bench_copy(struct driver *drv, uint32_t format, const char *name)
+{
+	int i;
+	double start;
+	char label[64];
+	struct bo *src, *dst;
+	const int iterations = 20;
+	struct rectangle rect = { 0, 0, 1920, 1080 };
+
+	src = create_filled_bo(drv, rect.width, rect.height, format);
+	dst = create_bo(drv, rect.width, rect.height, format);
+
+	start = test_seconds();
+	for (i = 0; i < iterations; i++)
+		CHECK(!drv_bo_copy(dst, src, &rect));
+
+	snprintf(label, sizeof(label), "copy %s 1080p", name);
+	BENCH_REPORT(label, iterations * rect.width * rect.height / 1e6, "MPix/s",
+		     test_seconds() - start);
+
+	for (i = 0; i < (int)rect.height; i++)
+		CHECK(!memcmp(plane_data(dst, 0) + i * drv_bo_get_plane_stride(dst, 0),
+			      plane_data(src, 0) + i * drv_bo_get_plane_stride(src, 0),
+			      rect.width * drv_bytes_per_pixel_from_format(format, 0)));
+
+	drv_bo_destroy(src);
+	drv_bo_destroy(dst);
+}
+
+/* The baseline for drv_bo_copy: what a client pays to map both buffers and memcpy each row. */
+static void bench_map_copy(struct driver *drv, uint32_t format, const char *name)
+{
+	int i;
+	size_t plane;
+	uint32_t y, rows, row_bytes;
+	double start;
+	char label[64];
+	uint8_t *s, *d;
+	struct bo *src, *dst;
+	struct mapping *src_mapping, *dst_mapping;
+	const int iterations = 20;
+	struct rectangle rect = { 0, 0, 1920, 1080 };
+
+	src = create_filled_bo(drv, rect.width, rect.height, format);
+	dst = create_bo(drv, rect.width, rect.height, format);
+
+	start = test_seconds();
+	for (i = 0; i < iterations; i++) {
+		for (plane = 0; plane < drv_num_planes_from_format(format); plane++) {
+			s = drv_bo_map(src, &rect, BO_MAP_READ, &src_mapping, plane);
+			d = drv_bo_map(dst, &rect, BO_MAP_WRITE, &dst_mapping, plane);
+			CHECK(s != MAP_FAILED && d != MAP_FAILED);
+
+			rows = DIV_ROUND_UP(rect.height,
+					    drv_vertical_subsampling_from_format(format, plane));
+			row_bytes = DIV_ROUND_UP(rect.width, drv_horizontal_subsampling_from_format(
+								 format, plane)) *
+				    drv_bytes_per_pixel_from_format(format, plane);
+			for (y = 0; y < rows; y++)
+				memcpy(d + (size_t)y * dst_mapping->vma->map_strides[plane],
+				       s + (size_t)y * src_mapping->vma->map_strides[plane],
+				       row_bytes);
+
+			CHECK(!drv_bo_unmap(dst, dst_mapping));
+			CHECK(!drv_bo_unmap(src, src_mapping));
+		}
+	}
+
+	snprintf(label, sizeof(label), "map+memcpy %s 1080p", name);
+	BENCH_REPORT(label, iterations * rect.width * rect.height / 1e6, "MPix/s",
+		     test_seconds() - start);
+
+	for (y = 0; y < rect.height; y++)
+		CHECK(!memcmp(plane_data(dst, 0) + y * drv_bo_get_plane_stride(dst, 0),
+			      plane_data(src, 0) + y * drv_bo_get_plane_stride(src, 0),
+			      rect.width * drv_bytes_per_pixel_from_format(format, 0)));
+
+	drv_bo_destroy(src);
+	drv_bo_destroy(dst);
+}
+
+int main(void)
+{
+	int fd;
+	struct driver *drv;
+
+	fd = fake_drm_open("rockchip", rockchip_ioctl);
+	CHECK(fd >= 0);
+	drv = drv_create(fd);
+	CHECK(drv);
+
+	test_rgb32(drv);
+	test_yuv(drv);
+
+	bench_convert(drv, DRM_FORMAT_XRGB8888, DRM_FORMAT_ABGR8888, "XRGB8888 to ABGR8888");
+	bench_convert(drv, DRM_FORMAT_RGB565, DRM_FORMAT_XRGB8888, "RGB565 to XRGB8888");
+	bench_convert(drv, DRM_FORMAT_XRGB8888, DRM_FORMAT_RGB565, "XRGB8888 to RGB565");
+	bench_convert(drv, DRM_FORMAT_NV12, DRM_FORMAT_YVU420, "NV12 to YV12");
+	bench_convert(drv, DRM_FORMAT_YVU420, DRM_FORMAT_NV12, "YV12 to NV12");
+	bench_convert(drv, DRM_FORMAT_XRGB8888, DRM_FORMAT_NV12, "XRGB8888 to NV12");
+	bench_convert(drv, DRM_FORMAT_NV12, DRM_FORMAT_XRGB8888, "NV12 to XRGB8888");
+
+	bench_copy(drv, DRM_FORMAT_XRGB8888, "XRGB8888");
+	bench_map_copy(drv, DRM_FORMAT_XRGB8888, "XRGB8888");
+	bench_copy(drv, DRM_FORMAT_NV12, "NV12");
+	bench_map_copy(drv, DRM_FORMAT_NV12, "NV12");
+
+	drv_destroy(drv);
+	fake_drm_close(fd);
+	return 0;
+}
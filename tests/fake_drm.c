@@ -0,0 +1,683 @@
+/*
+ * Copyright 2020 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+
+#include "drv_priv.h"
+#include "fake_drm.h"
+#include "util.h"
+
+#define FAKE_DRM_MAX_OBJECTS 1024
+#define FAKE_DRM_MAX_EXPORTS 64
+#define FAKE_DRM_MAX_PLANES 8
+#define FAKE_DRM_MAX_REQUESTS 64
+#define FAKE_DRM_MAX_FENCES 64
+
+#define FAKE_DRM_TYPE_PROP 1
+#define FAKE_DRM_IN_FORMATS_PROP 2
+#define FAKE_DRM_BLOB_BASE 100
+
+struct fake_object {
+	uint64_t offset;
+	size_t size;
+	void *data;
+	bool live;
+};
+
+struct fake_export {
+	int fd;
+	uint32_t handle;
+};
+
+struct fake_plane {
+	uint64_t type;
+	uint32_t formats[64];
+	uint32_t num_formats;
+	uint64_t modifiers[16];
+	uint32_t num_modifiers;
+};
+
+struct fake_request_count {
+	unsigned long request;
+	uint32_t count;
+};
+
+struct fake_fence {
+	bool live;
+	int timeline_fd;
+	/* The fd handed out, and our own reference to it, which outlives the caller's. */
+	int fd;
+	int signal_fd;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	int fd;
+	const char *name;
+	fake_drm_ioctl_fn ioctl;
+	uint64_t end;
+	struct fake_object objects[FAKE_DRM_MAX_OBJECTS];
+	uint32_t num_objects;
+	struct fake_export exports[FAKE_DRM_MAX_EXPORTS];
+	struct fake_plane planes[FAKE_DRM_MAX_PLANES];
+	uint32_t num_planes;
+	struct fake_request_count counts[FAKE_DRM_MAX_REQUESTS];
+	struct fake_fence fences[FAKE_DRM_MAX_FENCES];
+	bool no_sw_sync;
+} fake = { .lock = PTHREAD_MUTEX_INITIALIZER, .fd = -1 };
+
+int fake_drm_open(const char *name, fake_drm_ioctl_fn ioctl)
+{
+	fake.fd = syscall(SYS_memfd_create, name, 0);
+	if (fake.fd < 0)
+		return -1;
+
+	fake.name = name;
+	fake.ioctl = ioctl;
+	fake.end = 0;
+	fake.num_objects = 0;
+	fake.num_planes = 0;
+	memset(fake.exports, 0, sizeof(fake.exports));
+	fake_drm_reset_ioctl_counts();
+	return fake.fd;
+}
+
+static struct fake_object *fake_drm_lookup(uint32_t handle)
+{
+	if (!handle || handle > fake.num_objects || !fake.objects[handle - 1].live)
+		return NULL;
+
+	return &fake.objects[handle - 1];
+}
+
+static void fake_drm_destroy_object(struct fake_object *object)
+{
+	if (object->data)
+		munmap(object->data, object->size);
+
+	/* Hands the memory back, so that benchmarks can allocate in a loop. */
+	fallocate(fake.fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, object->offset,
+		  object->size);
+	memset(object, 0, sizeof(*object));
+}
+
+void fake_drm_close(int fd)
+{
+	uint32_t i;
+
+	for (i = 0; i < fake.num_objects; i++)
+		if (fake.objects[i].live)
+			fake_drm_destroy_object(&fake.objects[i]);
+
+	close(fd);
+	fake.fd = -1;
+}
+
+uint32_t fake_drm_create_object(size_t size)
+{
+	uint32_t handle = 0;
+	struct fake_object *object;
+
+	size = ALIGN(size ? size : 1, (size_t)getpagesize());
+
+	pthread_mutex_lock(&fake.lock);
+	if (fake.num_objects < FAKE_DRM_MAX_OBJECTS &&
+	    !ftruncate(fake.fd, fake.end + size)) {
+		object = &fake.objects[fake.num_objects++];
+		object->offset = fake.end;
+		object->size = size;
+		object->live = true;
+		fake.end += size;
+		handle = fake.num_objects;
+	}
+	pthread_mutex_unlock(&fake.lock);
+
+	return handle;
+}
+
+uint64_t fake_drm_object_offset(uint32_t handle)
+{
+	struct fake_object *object = fake_drm_lookup(handle);
+	return object ? object->offset : 0;
+}
+
+size_t fake_drm_object_size(uint32_t handle)
+{
+	struct fake_object *object = fake_drm_lookup(handle);
+	return object ? object->size : 0;
+}
+
+void *fake_drm_object_data(uint32_t handle)
+{
+	void *data = NULL;
+	struct fake_object *object;
+
+	pthread_mutex_lock(&fake.lock);
+	object = fake_drm_lookup(handle);
+	if (object && !object->data) {
+		data = mmap(NULL, object->size, PROT_READ | PROT_WRITE, MAP_SHARED, fake.fd,
+			    object->offset);
+		object->data = data == MAP_FAILED ? NULL : data;
+	}
+
+	if (object)
+		data = object->data;
+	pthread_mutex_unlock(&fake.lock);
+
+	return data;
+}
+
+void fake_drm_add_plane(uint64_t type, const uint32_t *formats, uint32_t num_formats,
+			const uint64_t *modifiers, uint32_t num_modifiers)
+{
+	struct fake_plane *plane = &fake.planes[fake.num_planes++];
+
+	plane->type = type;
+	plane->num_formats = MIN(num_formats, ARRAY_SIZE(plane->formats));
+	memcpy(plane->formats, formats, plane->num_formats * sizeof(*formats));
+	plane->num_modifiers = MIN(num_modifiers, ARRAY_SIZE(plane->modifiers));
+	memcpy(plane->modifiers, modifiers, plane->num_modifiers * sizeof(*modifiers));
+}
+
+uint32_t fake_drm_ioctl_count(unsigned long request)
+{
+	uint32_t i, count = 0;
+
+	pthread_mutex_lock(&fake.lock);
+	for (i = 0; i < FAKE_DRM_MAX_REQUESTS; i++)
+		if (fake.counts[i].request == request)
+			count = fake.counts[i].count;
+	pthread_mutex_unlock(&fake.lock);
+
+	return count;
+}
+
+void fake_drm_reset_ioctl_counts(void)
+{
+	pthread_mutex_lock(&fake.lock);
+	memset(fake.counts, 0, sizeof(fake.counts));
+	pthread_mutex_unlock(&fake.lock);
+}
+
+static void fake_drm_count(unsigned long request)
+{
+	uint32_t i;
+
+	pthread_mutex_lock(&fake.lock);
+	for (i = 0; i < FAKE_DRM_MAX_REQUESTS; i++) {
+		if (!fake.counts[i].count)
+			fake.counts[i].request = request;
+
+		if (fake.counts[i].request == request) {
+			fake.counts[i].count++;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&fake.lock);
+}
+
+static int fake_drm_export(struct drm_prime_handle *prime)
+{
+	uint32_t i;
+	int fd;
+
+	if (!fake_drm_lookup(prime->handle))
+		return -ENOENT;
+
+	/* lseek() on the dma-buf is how importers learn the size. */
+	fd = syscall(SYS_memfd_create, "fake-dma-buf", 0);
+	if (fd < 0)
+		return -errno;
+
+	if (ftruncate(fd, fake_drm_object_size(prime->handle))) {
+		close(fd);
+		return -ENOMEM;
+	}
+
+	/*
+	 * The caller owns the fd, as with a real dma-buf. Forget the exports it has closed, which
+	 * includes any earlier one that had this fd number.
+	 */
+	for (i = 0; i < FAKE_DRM_MAX_EXPORTS; i++)
+		if (fake.exports[i].handle &&
+		    (fake.exports[i].fd == fd || fcntl(fake.exports[i].fd, F_GETFD) < 0))
+			fake.exports[i].handle = 0;
+
+	for (i = 0; i < FAKE_DRM_MAX_EXPORTS; i++) {
+		if (!fake.exports[i].handle) {
+			fake.exports[i].fd = fd;
+			fake.exports[i].handle = prime->handle;
+			prime->fd = fd;
+			return 0;
+		}
+	}
+
+	close(fd);
+	return -EMFILE;
+}
+
+static int fake_drm_import(struct drm_prime_handle *prime)
+{
+	uint32_t i;
+
+	for (i = 0; i < FAKE_DRM_MAX_EXPORTS; i++) {
+		if (fake.exports[i].handle && fake.exports[i].fd == prime->fd &&
+		    fake_drm_lookup(fake.exports[i].handle)) {
+			prime->handle = fake.exports[i].handle;
+			return 0;
+		}
+	}
+
+	return -EINVAL;
+}
+
+static int fake_drm_default_ioctl(unsigned long request, void *arg)
+{
+	struct fake_object *object;
+
+	switch (request) {
+	case DRM_IOCTL_MODE_CREATE_DUMB: {
+		struct drm_mode_create_dumb *create = arg;
+		create->pitch = DIV_ROUND_UP(create->width * create->bpp, 8);
+		create->size = (uint64_t)create->pitch * create->height;
+		create->handle = fake_drm_create_object(create->size);
+		return create->handle ? 0 : -ENOMEM;
+	}
+	case DRM_IOCTL_MODE_MAP_DUMB: {
+		struct drm_mode_map_dumb *map = arg;
+		if (!fake_drm_lookup(map->handle))
+			return -ENOENT;
+
+		map->offset = fake_drm_object_offset(map->handle);
+		return 0;
+	}
+	case DRM_IOCTL_MODE_DESTROY_DUMB:
+	case DRM_IOCTL_GEM_CLOSE: {
+		/* Both start with the handle. */
+		pthread_mutex_lock(&fake.lock);
+		object = fake_drm_lookup(*(uint32_t *)arg);
+		if (object)
+			fake_drm_destroy_object(object);
+		pthread_mutex_unlock(&fake.lock);
+		return object ? 0 : -ENOENT;
+	}
+	case DRM_IOCTL_PRIME_HANDLE_TO_FD:
+		return fake_drm_export(arg);
+	case DRM_IOCTL_PRIME_FD_TO_HANDLE:
+		return fake_drm_import(arg);
+	default:
+		return -ENOTTY;
+	}
+}
+
+void fake_drm_set_sw_sync(bool available)
+{
+	fake.no_sw_sync = !available;
+}
+
+bool fake_drm_is_fence(int fd)
+{
+	uint32_t i;
+	bool found = false;
+
+	pthread_mutex_lock(&fake.lock);
+	for (i = 0; i < FAKE_DRM_MAX_FENCES; i++)
+		if (fake.fences[i].live && fake.fences[i].fd == fd)
+			found = true;
+	pthread_mutex_unlock(&fake.lock);
+
+	return found;
+}
+
+/*
+ * Just enough of sw_sync for timelines that are advanced once: fences are eventfds, and
+ * advancing a timeline signals all of its fences.
+ */
+static int fake_sw_sync_ioctl(int fd, unsigned long request, void *arg)
+{
+	uint32_t i;
+	int ret = 0;
+	struct fake_fence *fence;
+	struct sw_sync_create_fence_data *create = arg;
+
+	pthread_mutex_lock(&fake.lock);
+	switch (request) {
+	case SW_SYNC_IOC_CREATE_FENCE:
+		for (i = 0; i < FAKE_DRM_MAX_FENCES && fake.fences[i].live; i++)
+			;
+
+		if (fake.no_sw_sync || i == FAKE_DRM_MAX_FENCES) {
+			ret = fake.no_sw_sync ? -ENOTTY : -ENOSPC;
+			break;
+		}
+
+		fence = &fake.fences[i];
+		fence->fd = eventfd(0, EFD_CLOEXEC);
+		fence->signal_fd = fence->fd < 0 ? -1 : fcntl(fence->fd, F_DUPFD_CLOEXEC, 0);
+		if (fence->signal_fd < 0) {
+			if (fence->fd >= 0)
+				close(fence->fd);
+			ret = -EMFILE;
+			break;
+		}
+
+		fence->timeline_fd = fd;
+		fence->live = true;
+		create->fence = fence->fd;
+		break;
+	case SW_SYNC_IOC_INC:
+		for (i = 0; i < FAKE_DRM_MAX_FENCES; i++) {
+			fence = &fake.fences[i];
+			if (fence->live && fence->timeline_fd == fd) {
+				eventfd_write(fence->signal_fd, 1);
+				close(fence->signal_fd);
+				fence->live = false;
+			}
+		}
+		break;
+	default:
+		ret = -EBADF;
+	}
+	pthread_mutex_unlock(&fake.lock);
+
+	return ret;
+}
+
+int drmIoctl(int fd, unsigned long request, void *arg)
+{
+	int ret = FAKE_DRM_DEFAULT;
+
+	if (fd != fake.fd) {
+		ret = fake_sw_sync_ioctl(fd, request, arg);
+	} else {
+		fake_drm_count(request);
+
+		if (fake.ioctl)
+			ret = fake.ioctl(fd, request, arg);
+
+		if (ret == FAKE_DRM_DEFAULT)
+			ret = fake_drm_default_ioctl(request, arg);
+	}
+
+	if (ret < 0) {
+		errno = -ret;
+		return -1;
+	}
+
+	return 0;
+}
+
+int drmCommandWrite(int fd, unsigned long index, void *data, unsigned long size)
+{
+	unsigned long request =
+	    DRM_IOC(DRM_IOC_WRITE, DRM_IOCTL_BASE, DRM_COMMAND_BASE + index, size);
+
+	return drmIoctl(fd, request, data) ? -errno : 0;
+}
+
+int drmCommandWriteRead(int fd, unsigned long index, void *data, unsigned long size)
+{
+	unsigned long request =
+	    DRM_IOC(DRM_IOC_READ | DRM_IOC_WRITE, DRM_IOCTL_BASE, DRM_COMMAND_BASE + index, size);
+
+	return drmIoctl(fd, request, data) ? -errno : 0;
+}
+
+drmVersionPtr drmGetVersion(int fd)
+{
+	drmVersionPtr version;
+
+	if (fd != fake.fd)
+		return NULL;
+
+	version = calloc(1, sizeof(*version));
+	if (!version)
+		return NULL;
+
+	version->name = strdup(fake.name);
+	version->name_len = strlen(fake.name);
+	return version;
+}
+
+void drmFreeVersion(drmVersionPtr version)
+{
+	if (!version)
+		return;
+
+	free(version->name);
+	free(version);
+}
+
+int drmPrimeHandleToFD(int fd, uint32_t handle, uint32_t flags, int *prime_fd)
+{
+	struct drm_prime_handle args = { .handle = handle, .flags = flags };
+
+	if (drmIoctl(fd, DRM_IOCTL_PRIME_HANDLE_TO_FD, &args))
+		return -errno;
+
+	*prime_fd = args.fd;
+	return 0;
+}
+
+int drmPrimeFDToHandle(int fd, int prime_fd, uint32_t *handle)
+{
+	struct drm_prime_handle args = { .fd = prime_fd };
+
+	if (drmIoctl(fd, DRM_IOCTL_PRIME_FD_TO_HANDLE, &args))
+		return -errno;
+
+	*handle = args.handle;
+	return 0;
+}
+
+struct fake_hash_entry {
+	unsigned long key;
+	void *value;
+	struct fake_hash_entry *next;
+};
+
+void *drmHashCreate(void)
+{
+	return calloc(1, sizeof(struct fake_hash_entry *));
+}
+
+int drmHashDestroy(void *table)
+{
+	struct fake_hash_entry *entry, *next;
+
+	for (entry = *(struct fake_hash_entry **)table; entry; entry = next) {
+		next = entry->next;
+		free(entry);
+	}
+
+	free(table);
+	return 0;
+}
+
+int drmHashLookup(void *table, unsigned long key, void **value)
+{
+	struct fake_hash_entry *entry;
+
+	for (entry = *(struct fake_hash_entry **)table; entry; entry = entry->next) {
+		if (entry->key == key) {
+			*value = entry->value;
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+int drmHashInsert(void *table, unsigned long key, void *value)
+{
+	void *existing;
+	struct fake_hash_entry *entry;
+
+	if (!drmHashLookup(table, key, &existing))
+		return 1;
+
+	entry = calloc(1, sizeof(*entry));
+	if (!entry)
+		return -1;
+
+	entry->key = key;
+	entry->value = value;
+	entry->next = *(struct fake_hash_entry **)table;
+	*(struct fake_hash_entry **)table = entry;
+	return 0;
+}
+
+int drmHashDelete(void *table, unsigned long key)
+{
+	struct fake_hash_entry *entry, **link;
+
+	for (link = (struct fake_hash_entry **)table; (entry = *link); link = &entry->next) {
+		if (entry->key == key) {
+			*link = entry->next;
+			free(entry);
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+int drmSetClientCap(int fd, uint64_t capability, uint64_t value)
+{
+	return 0;
+}
+
+drmModePlaneResPtr drmModeGetPlaneResources(int fd)
+{
+	uint32_t i;
+	drmModePlaneResPtr resources;
+
+	if (!fake.num_planes)
+		return NULL;
+
+	resources = calloc(1, sizeof(*resources));
+	resources->planes = calloc(fake.num_planes, sizeof(*resources->planes));
+	resources->count_planes = fake.num_planes;
+	for (i = 0; i < fake.num_planes; i++)
+		resources->planes[i] = i + 1;
+
+	return resources;
+}
+
+void drmModeFreePlaneResources(drmModePlaneResPtr resources)
+{
+	free(resources->planes);
+	free(resources);
+}
+
+drmModePlanePtr drmModeGetPlane(int fd, uint32_t plane_id)
+{
+	struct fake_plane *fake_plane = &fake.planes[plane_id - 1];
+	drmModePlanePtr plane = calloc(1, sizeof(*plane));
+
+	plane->plane_id = plane_id;
+	plane->count_formats = fake_plane->num_formats;
+	plane->formats = calloc(fake_plane->num_formats, sizeof(*plane->formats));
+	memcpy(plane->formats, fake_plane->formats,
+	       fake_plane->num_formats * sizeof(*plane->formats));
+	return plane;
+}
+
+void drmModeFreePlane(drmModePlanePtr plane)
+{
+	free(plane->formats);
+	free(plane);
+}
+
+drmModeObjectPropertiesPtr drmModeObjectGetProperties(int fd, uint32_t object_id,
+						      uint32_t object_type)
+{
+	drmModeObjectPropertiesPtr props = calloc(1, sizeof(*props));
+
+	props->props = calloc(2, sizeof(*props->props));
+	props->prop_values = calloc(2, sizeof(*props->prop_values));
+	props->props[props->count_props] = FAKE_DRM_TYPE_PROP;
+	props->prop_values[props->count_props++] = fake.planes[object_id - 1].type;
+
+	if (fake.planes[object_id - 1].num_modifiers) {
+		props->props[props->count_props] = FAKE_DRM_IN_FORMATS_PROP;
+		props->prop_values[props->count_props++] = FAKE_DRM_BLOB_BASE + object_id;
+	}
+
+	return props;
+}
+
+void drmModeFreeObjectProperties(drmModeObjectPropertiesPtr props)
+{
+	free(props->props);
+	free(props->prop_values);
+	free(props);
+}
+
+drmModePropertyPtr drmModeGetProperty(int fd, uint32_t property_id)
+{
+	drmModePropertyPtr prop = calloc(1, sizeof(*prop));
+
+	prop->prop_id = property_id;
+	strcpy(prop->name, property_id == FAKE_DRM_TYPE_PROP ? "type" : "IN_FORMATS");
+	return prop;
+}
+
+void drmModeFreeProperty(drmModePropertyPtr prop)
+{
+	free(prop);
+}
+
+/* Every format of the plane is listed with every modifier. */
+drmModePropertyBlobPtr drmModeGetPropertyBlob(int fd, uint32_t blob_id)
+{
+	uint32_t i;
+	struct drm_format_modifier_blob *header;
+	struct drm_format_modifier *modifiers;
+	struct fake_plane *plane = &fake.planes[blob_id - FAKE_DRM_BLOB_BASE - 1];
+	size_t formats_size = ALIGN(plane->num_formats * sizeof(uint32_t), 8);
+	drmModePropertyBlobPtr blob = calloc(1, sizeof(*blob));
+
+	blob->id = blob_id;
+	blob->length = sizeof(*header) + formats_size +
+		       plane->num_modifiers * sizeof(struct drm_format_modifier);
+	blob->data = calloc(1, blob->length);
+
+	header = blob->data;
+	header->version = FORMAT_BLOB_CURRENT;
+	header->count_formats = plane->num_formats;
+	header->formats_offset = sizeof(*header);
+	header->count_modifiers = plane->num_modifiers;
+	header->modifiers_offset = sizeof(*header) + formats_size;
+	memcpy((char *)header + header->formats_offset, plane->formats,
+	       plane->num_formats * sizeof(uint32_t));
+
+	modifiers = (struct drm_format_modifier *)((char *)header + header->modifiers_offset);
+	for (i = 0; i < plane->num_modifiers; i++) {
+		modifiers[i].formats = plane->num_formats == 64 ? ~0ull
+								: (1ull << plane->num_formats) - 1;
+		modifiers[i].modifier = plane->modifiers[i];
+	}
+
+	return blob;
+}
+
+void drmModeFreePropertyBlob(drmModePropertyBlobPtr blob)
+{
+	free(blob->data);
+	free(blob);
+}
@@ -0,0 +1,50 @@
+/*
+ * Copyright 2020 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#ifndef FAKE_DRM_H
+#define FAKE_DRM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A DRM device for host tests, linked in place of libdrm. The device fd is a memfd that holds
+ * the backing memory of every GEM object, so the mmap offsets it hands out can be mapped through
+ * the fd like those of a real device. Dumb buffers, GEM_CLOSE and PRIME are handled here; a test
+ * passes a handler for the ioctls of the backend it exercises. sw_sync ioctls on any other fd get
+ * a fake sw_sync, whose fences are eventfds.
+ */
+
+/* Returned by an ioctl handler to leave the request to the generic device. */
+#define FAKE_DRM_DEFAULT 1
+
+/* Returns 0, a negative errno, or FAKE_DRM_DEFAULT. */
+typedef int (*fake_drm_ioctl_fn)(int fd, unsigned long request, void *arg);
+
+int fake_drm_open(const char *name, fake_drm_ioctl_fn ioctl);
+void fake_drm_close(int fd);
+
+/* Creates a GEM object of at least size bytes and returns its handle, or 0. */
+uint32_t fake_drm_create_object(size_t size);
+uint64_t fake_drm_object_offset(uint32_t handle);
+size_t fake_drm_object_size(uint32_t handle);
+/* The object's backing memory, as the device sees it. */
+void *fake_drm_object_data(uint32_t handle);
+
+/* Makes the device report a plane of the given type, scanning out formats with modifiers. */
+void fake_drm_add_plane(uint64_t type, const uint32_t *formats, uint32_t num_formats,
+			const uint64_t *modifiers, uint32_t num_modifiers);
+
+/* Whether sw_sync can create fences, which it can unless a test says otherwise. */
+void fake_drm_set_sw_sync(bool available);
+/* Whether fd is a fence of the fake sw_sync that hasn't signalled yet. */
+bool fake_drm_is_fence(int fd);
+
+uint32_t fake_drm_ioctl_count(unsigned long request);
+void fake_drm_reset_ioctl_counts(void);
+
+#endif
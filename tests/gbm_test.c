@@ -0,0 +1,449 @@
+/*
+ * Copyright 2020 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include <errno.h>
+#include <rockchip_drm.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "fake_drm.h"
+#include "gbm.h"
+#include "test.h"
+#include "util.h"
+
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#define SW_USAGE (GBM_BO_USE_LINEAR | GBM_BO_USE_SW_READ_OFTEN | GBM_BO_USE_SW_WRITE_OFTEN)
+
+static struct gbm_surface *create_surface(struct gbm_device *gbm)
+{
+	struct gbm_surface *surface;
+
+	surface = gbm_surface_create(gbm, 64, 64, GBM_FORMAT_XRGB8888,
+				     GBM_BO_USE_RENDERING | GBM_BO_USE_SCANOUT);
+	CHECK(surface);
+	return surface;
+}
+
+/* The compositor locks the frame the client swapped last, not just any buffer. */
+static void test_swap(struct gbm_device *gbm)
+{
+	struct gbm_bo *a, *b, *c, *d;
+	struct gbm_surface *surface = create_surface(gbm);
+
+	CHECK(!gbm_surface_lock_front_buffer(surface));
+	CHECK(gbm_surface_swap_buffers(surface) == -EINVAL);
+
+	a = gbm_surface_acquire_back_buffer(surface);
+	CHECK(a);
+	CHECK(!gbm_surface_acquire_back_buffer(surface));
+	/* Drawn, but not swapped yet. */
+	CHECK(!gbm_surface_lock_front_buffer(surface));
+	CHECK(!gbm_surface_swap_buffers(surface));
+	CHECK(gbm_surface_lock_front_buffer(surface) == a);
+	CHECK(!gbm_surface_lock_front_buffer(surface));
+
+	/* Two frames swapped before the next lock: the newer one wins, the older one is freed. */
+	b = gbm_surface_acquire_back_buffer(surface);
+	CHECK(b && b != a);
+	CHECK(!gbm_surface_swap_buffers(surface));
+	c = gbm_surface_acquire_back_buffer(surface);
+	CHECK(c && c != a && c != b);
+	CHECK(!gbm_surface_swap_buffers(surface));
+	CHECK(gbm_surface_has_free_buffers(surface));
+	CHECK(gbm_surface_lock_front_buffer(surface) == c);
+
+	/* a and c are locked, so b is the only free buffer. */
+	d = gbm_surface_acquire_back_buffer(surface);
+	CHECK(d == b);
+	CHECK(!gbm_surface_has_free_buffers(surface));
+
+	/* Releasing a buffer that isn't locked changes nothing. */
+	gbm_surface_release_buffer(surface, d);
+	CHECK(!gbm_surface_has_free_buffers(surface));
+	gbm_surface_release_buffer(surface, a);
+	CHECK(gbm_surface_has_free_buffers(surface));
+
+	gbm_surface_destroy(surface);
+}
+
+/* Imports are neither counted in the stats nor refused by the budget. */
+static void test_import_budget(struct gbm_device *gbm)
+{
+	struct gbm_bo *bo, *imported;
+	struct gbm_import_fd_data data;
+	struct gbm_device_stats before, after;
+	uint32_t num_formats = 0;
+
+	bo = gbm_bo_create(gbm, 64, 64, GBM_FORMAT_XRGB8888, GBM_BO_USE_LINEAR);
+	CHECK(bo);
+	CHECK(!gbm_device_get_stats(gbm, &before, NULL, &num_formats));
+	CHECK(before.num_bos == 1 && before.bytes);
+	gbm_device_set_memory_budget(gbm, before.bytes);
+
+	memset(&data, 0, sizeof(data));
+	data.fd = gbm_bo_get_fd(bo);
+	data.width = 64;
+	data.height = 64;
+	data.stride = gbm_bo_get_stride(bo);
+	data.format = GBM_FORMAT_XRGB8888;
+	CHECK(data.fd >= 0);
+	imported = gbm_bo_import(gbm, GBM_BO_IMPORT_FD, &data, GBM_BO_USE_LINEAR);
+	CHECK(imported);
+	CHECK(!gbm_device_get_stats(gbm, &after, NULL, &num_formats));
+	CHECK(after.num_bos == before.num_bos && after.bytes == before.bytes);
+
+	/* The budget is used up by the created buffer alone. */
+	errno = 0;
+	CHECK(!gbm_bo_create(gbm, 64, 64, GBM_FORMAT_XRGB8888, GBM_BO_USE_LINEAR));
+	CHECK(errno == ENOSPC);
+
+	gbm_bo_destroy(imported);
+	close(data.fd);
+	CHECK(!gbm_device_get_stats(gbm, &after, NULL, &num_formats));
+	CHECK(after.num_bos == before.num_bos && after.bytes == before.bytes);
+
+	gbm_bo_destroy(bo);
+	CHECK(!gbm_device_get_stats(gbm, &after, NULL, &num_formats));
+	CHECK(!after.num_bos && !after.bytes);
+	gbm_device_set_memory_budget(gbm, 0);
+}
+
+/* rockchip is the device here with both NV12 and YV12 for CPU access. */
+static int rockchip_ioctl(int fd, unsigned long request, void *arg)
+{
+	switch (request) {
+	case DRM_IOCTL_ROCKCHIP_GEM_CREATE: {
+		struct drm_rockchip_gem_create *create = arg;
+		create->handle = fake_drm_create_object(create->size);
+		return create->handle ? 0 : -ENOMEM;
+	}
+	case DRM_IOCTL_ROCKCHIP_GEM_MAP_OFFSET: {
+		struct drm_rockchip_gem_map_off *map = arg;
+		map->offset = fake_drm_object_offset(map->handle);
+		return 0;
+	}
+	default:
+		return FAKE_DRM_DEFAULT;
+	}
+}
+
+static struct gbm_bo *create_yuv(struct gbm_device *gbm, uint32_t width, uint32_t height,
+				 uint32_t format)
+{
+	struct gbm_bo *bo = gbm_bo_create(gbm, width, height, format,
+					  GBM_BO_USE_SW_READ_OFTEN | GBM_BO_USE_SW_WRITE_OFTEN);
+
+	CHECK(bo);
+	return bo;
+}
+
+/*
+ * Every plane's pointer is pixel (x, y) of that plane, at the offset and stride gbm reports for
+ * it. cpps gives each plane's bytes per pixel, and chroma planes are subsampled 2x2.
+ */
+static void check_map2(struct gbm_bo *bo, uint32_t x, uint32_t y, const uint32_t *cpps)
+{
+	size_t plane;
+	uint8_t *base;
+	void *map_data, *addrs[GBM_MAX_PLANES];
+	uint32_t sub, strides[GBM_MAX_PLANES];
+
+	CHECK(!gbm_bo_map2(bo, x, y, 16, 8, GBM_BO_TRANSFER_READ_WRITE, addrs, strides,
+			   &map_data));
+
+	base = (uint8_t *)addrs[0] - gbm_bo_get_plane_offset(bo, 0) -
+	       (size_t)y * strides[0] - x * cpps[0];
+	for (plane = 0; plane < gbm_bo_get_num_planes(bo); plane++) {
+		sub = plane ? 2 : 1;
+		CHECK(strides[plane] == gbm_bo_get_plane_stride(bo, plane));
+		CHECK((uint8_t *)addrs[plane] == base + gbm_bo_get_plane_offset(bo, plane) +
+						     (size_t)(y / sub) * strides[plane] +
+						     (x / sub) * cpps[plane]);
+	}
+
+	/* Writes through the chroma pointer land in that plane. */
+	memset(addrs[1], 0x5a, cpps[1]);
+	CHECK(base[gbm_bo_get_plane_offset(bo, 1) + (size_t)(y / 2) * strides[1] +
+		   (x / 2) * cpps[1]] == 0x5a);
+
+	gbm_bo_unmap(bo, map_data);
+}
+
+static void test_map2(struct gbm_device *gbm)
+{
+	struct gbm_bo *bo;
+	const uint32_t nv12_cpps[] = { 1, 2 };
+	const uint32_t yv12_cpps[] = { 1, 1, 1 };
+
+	bo = create_yuv(gbm, 64, 32, GBM_FORMAT_NV12);
+	CHECK(gbm_bo_get_num_planes(bo) == 2);
+	check_map2(bo, 0, 0, nv12_cpps);
+	check_map2(bo, 10, 6, nv12_cpps);
+	gbm_bo_destroy(bo);
+
+	bo = create_yuv(gbm, 64, 32, GBM_FORMAT_YVU420);
+	CHECK(gbm_bo_get_num_planes(bo) == 3);
+	check_map2(bo, 0, 0, yv12_cpps);
+	check_map2(bo, 10, 6, yv12_cpps);
+	gbm_bo_destroy(bo);
+}
+
+static void bench_map2(struct gbm_device *gbm, uint32_t format, const char *name)
+{
+	int i;
+	double start;
+	char label[64];
+	void *map_data, *addrs[GBM_MAX_PLANES];
+	uint32_t strides[GBM_MAX_PLANES];
+	const int iterations = 100000;
+	struct gbm_bo *bo = create_yuv(gbm, 1920, 1080, format);
+
+	start = test_seconds();
+	for (i = 0; i < iterations; i++) {
+		CHECK(!gbm_bo_map2(bo, 0, 0, gbm_bo_get_width(bo), gbm_bo_get_height(bo),
+				   GBM_BO_TRANSFER_WRITE, addrs, strides, &map_data));
+		gbm_bo_unmap(bo, map_data);
+	}
+
+	snprintf(label, sizeof(label), "gbm_bo_map2+unmap %s 1080p", name);
+	BENCH_REPORT(label, iterations / 1e6, "M/s", test_seconds() - start);
+	gbm_bo_destroy(bo);
+}
+
+static uint8_t pattern(size_t offset)
+{
+	return offset ^ (offset >> 7) ^ (offset >> 13);
+}
+
+/*
+ * vgem maps through fake offsets, which only map from the start of the object, so a rect-only map
+ * of a plane at row y still has to return the address of that row and pixel.
+ */
+static void check_rect_map(struct gbm_bo *bo, size_t plane, uint32_t x, uint32_t y, uint32_t cpp,
+			   uint32_t sub)
+{
+	size_t i, offset;
+	uint8_t *addr, *object;
+	uint32_t stride;
+	void *map_data;
+
+	object = fake_drm_object_data(gbm_bo_get_handle(bo).u32);
+	CHECK(object);
+	offset = gbm_bo_get_plane_offset(bo, plane) +
+		 (size_t)(y / sub) * gbm_bo_get_plane_stride(bo, plane) + (x / sub) * cpp;
+
+	addr = gbm_bo_map(bo, x, y, 16, 16, GBM_BO_TRANSFER_READ_WRITE, &stride, &map_data, plane);
+	CHECK(addr && stride == gbm_bo_get_plane_stride(bo, plane));
+	for (i = 0; i < 16; i++) {
+		CHECK(addr[i] == pattern(offset + i));
+		CHECK(addr[stride + i] == pattern(offset + stride + i));
+	}
+
+	addr[0] = ~pattern(offset);
+	gbm_bo_unmap(bo, map_data);
+	CHECK(object[offset] == (uint8_t)~pattern(offset));
+}
+
+static void test_rect_map(struct gbm_device *gbm)
+{
+	size_t i, size;
+	int fd;
+	uint8_t *object;
+	struct gbm_bo *bo;
+
+	bo = gbm_bo_create(gbm, 256, 512, GBM_FORMAT_YVU420, GBM_BO_USE_SW_WRITE_OFTEN);
+	CHECK(bo);
+
+	object = fake_drm_object_data(gbm_bo_get_handle(bo).u32);
+	fd = gbm_bo_get_fd(bo);
+	CHECK(object && fd >= 0);
+	size = lseek(fd, 0, SEEK_END);
+	close(fd);
+	for (i = 0; i < size; i++)
+		object[i] = pattern(i);
+
+	/* Rows well past the first page of each plane, and an odd x and y for the chroma planes. */
+	check_rect_map(bo, 0, 6, 300, 1, 1);
+	check_rect_map(bo, 1, 10, 301, 1, 2);
+	check_rect_map(bo, 2, 10, 301, 1, 2);
+	gbm_bo_destroy(bo);
+}
+
+/* Buffers that ask for huge pages end on a huge page and are mapped starting on one. */
+static void test_huge_pages(struct gbm_device *gbm)
+{
+	int fd;
+	struct gbm_bo *bo;
+	void *map_data, *addrs[GBM_MAX_PLANES];
+	uint32_t strides[GBM_MAX_PLANES];
+
+	bo = gbm_bo_create(gbm, 1920, 1080, GBM_FORMAT_XRGB8888, SW_USAGE | GBM_BO_USE_HUGE_PAGES);
+	CHECK(bo);
+
+	fd = gbm_bo_get_fd(bo);
+	CHECK(fd >= 0);
+	CHECK(lseek(fd, 0, SEEK_END) >=
+	      ALIGN((off_t)gbm_bo_get_stride(bo) * gbm_bo_get_height(bo), HUGE_PAGE_SIZE));
+	close(fd);
+
+	CHECK(!gbm_bo_map2(bo, 0, 0, 1920, 1080, GBM_BO_TRANSFER_READ_WRITE, addrs, strides,
+			   &map_data));
+	CHECK(!((uintptr_t)addrs[0] & (HUGE_PAGE_SIZE - 1)));
+	memset(addrs[0], 0xa5, (size_t)strides[0] * 1080);
+	gbm_bo_unmap(bo, map_data);
+
+	gbm_bo_destroy(bo);
+}
+
+/*
+ * Reads a 4K buffer front to back, then one word of each page in a scattered order, which
+ * misses the TLB on every page unless huge pages back it.
+ */
+static void bench_huge_pages(struct gbm_device *gbm, uint32_t usage, const char *name)
+{
+	int i;
+	double start;
+	char label[64];
+	struct gbm_bo *bo;
+	uint64_t *data, sum = 0;
+	size_t j, size, num_pages;
+	void *map_data, *addrs[GBM_MAX_PLANES];
+	uint32_t strides[GBM_MAX_PLANES];
+	const int iterations = 10;
+
+	bo = gbm_bo_create(gbm, 3840, 2160, GBM_FORMAT_XRGB8888, SW_USAGE | usage);
+	CHECK(bo);
+	CHECK(!gbm_bo_map2(bo, 0, 0, 3840, 2160, GBM_BO_TRANSFER_READ_WRITE, addrs, strides,
+			   &map_data));
+	data = addrs[0];
+	size = (size_t)strides[0] * 2160;
+	num_pages = size / 4096;
+
+	/* Faulting the pages in is not what's measured here. */
+	memset(data, 1, size);
+
+	start = test_seconds();
+	for (i = 0; i < iterations; i++)
+		for (j = 0; j < size / sizeof(*data); j++)
+			sum += data[j];
+	snprintf(label, sizeof(label), "stream 4K %s", name);
+	BENCH_REPORT(label, iterations * size / 1e9, "GB/s", test_seconds() - start);
+
+	start = test_seconds();
+	for (i = 0; i < iterations * 16; i++)
+		for (j = 0; j < num_pages; j++)
+			sum += data[(j * 4099 % num_pages) * (4096 / sizeof(*data))];
+	snprintf(label, sizeof(label), "page hops 4K %s", name);
+	BENCH_REPORT(label, iterations * 16 * num_pages / 1e6, "M/s", test_seconds() - start);
+
+	CHECK(sum);
+	gbm_bo_unmap(bo, map_data);
+	gbm_bo_destroy(bo);
+}
+
+/*
+ * What a camera or decoder client sees when it writes a fresh 1080p frame: prefaulting moves the
+ * page faults of the first pass into the map call, where they are taken in one go.
+ */
+static void bench_first_touch(struct gbm_device *gbm, uint32_t prefault, const char *name)
+{
+	int i;
+	uint32_t y;
+	struct gbm_bo *bo;
+	char label[64];
+	double start, mapped, map_time = 0, touch_time = 0;
+	void *map_data, *addrs[GBM_MAX_PLANES];
+	uint32_t strides[GBM_MAX_PLANES];
+	const int iterations = 50;
+
+	for (i = 0; i < iterations; i++) {
+		/* Each frame comes in a new buffer, whose pages nothing has touched yet. */
+		bo = gbm_bo_create(gbm, 1920, 1080, GBM_FORMAT_XRGB8888, SW_USAGE);
+		CHECK(bo);
+
+		start = test_seconds();
+		CHECK(!gbm_bo_map2(bo, 0, 0, 1920, 1080, GBM_BO_TRANSFER_WRITE | prefault, addrs,
+				   strides, &map_data));
+		mapped = test_seconds();
+		for (y = 0; y < 1080; y++)
+			memset((uint8_t *)addrs[0] + (size_t)y * strides[0], y, 1920 * 4);
+		touch_time += test_seconds() - mapped;
+		map_time += mapped - start;
+
+		gbm_bo_unmap(bo, map_data);
+		gbm_bo_destroy(bo);
+	}
+
+	snprintf(label, sizeof(label), "map 1080p, %s", name);
+	BENCH_REPORT_LATENCY(label, iterations, map_time);
+	snprintf(label, sizeof(label), "first write 1080p, %s", name);
+	BENCH_REPORT_LATENCY(label, iterations, touch_time);
+	snprintf(label, sizeof(label), "map+first write 1080p, %s", name);
+	BENCH_REPORT_LATENCY(label, iterations, map_time + touch_time);
+}
+
+static void bench_swap(struct gbm_device *gbm)
+{
+	int i;
+	double start;
+	struct gbm_bo *front = NULL, *bo;
+	const int iterations = 1000000;
+	struct gbm_surface *surface = create_surface(gbm);
+
+	/* A client and a compositor that each keep one buffer while the other works. */
+	start = test_seconds();
+	for (i = 0; i < iterations; i++) {
+		CHECK(gbm_surface_acquire_back_buffer(surface));
+		CHECK(!gbm_surface_swap_buffers(surface));
+		bo = gbm_surface_lock_front_buffer(surface);
+		CHECK(bo);
+		if (front)
+			gbm_surface_release_buffer(surface, front);
+		front = bo;
+	}
+	BENCH_REPORT("gbm_surface swap cycles", iterations / 1e6, "M/s", test_seconds() - start);
+
+	gbm_surface_destroy(surface);
+}
+
+int main(void)
+{
+	int fd;
+	struct gbm_device *gbm;
+
+	fd = fake_drm_open("vgem", NULL);
+	CHECK(fd >= 0);
+	gbm = gbm_create_device(fd);
+	CHECK(gbm);
+
+	test_swap(gbm);
+	test_import_budget(gbm);
+	test_huge_pages(gbm);
+	test_rect_map(gbm);
+	bench_swap(gbm);
+	bench_huge_pages(gbm, 0, "small pages");
+	bench_huge_pages(gbm, GBM_BO_USE_HUGE_PAGES, "huge pages");
+	bench_first_touch(gbm, 0, "no prefault");
+	bench_first_touch(gbm, GBM_BO_TRANSFER_PREFAULT, "prefault");
+
+	gbm_device_destroy(gbm);
+	fake_drm_close(fd);
+
+	fd = fake_drm_open("rockchip", rockchip_ioctl);
+	CHECK(fd >= 0);
+	gbm = gbm_create_device(fd);
+	CHECK(gbm);
+
+	test_map2(gbm);
+	bench_map2(gbm, GBM_FORMAT_NV12, "NV12");
+	bench_map2(gbm, GBM_FORMAT_YVU420, "YV12");
+
+	gbm_device_destroy(gbm);
+	fake_drm_close(fd);
+	return 0;
+}
@@ -0,0 +1,366 @@
+/*
+ * Copyright 2020 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include <errno.h>
+#include <i915_drm.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+
+#include "drv.h"
+#include "fake_drm.h"
+#include "test.h"
+#include "util.h"
+
+static int chipset_id;
+static uint32_t tiling_modes[1024];
+
+static int i915_ioctl(int fd, unsigned long request, void *arg)
+{
+	switch (request) {
+	case DRM_IOCTL_I915_GETPARAM: {
+		drm_i915_getparam_t *param = arg;
+		if (param->param == I915_PARAM_CHIPSET_ID)
+			*param->value = chipset_id;
+		else if (param->param == I915_PARAM_HAS_LLC)
+			*param->value = 1;
+		else if (param->param == I915_PARAM_MMAP_GTT_VERSION)
+			*param->value = 4;
+		else
+			return -EINVAL;
+
+		return 0;
+	}
+	case DRM_IOCTL_I915_GEM_CREATE: {
+		struct drm_i915_gem_create *create = arg;
+		create->handle = fake_drm_create_object(create->size);
+		return create->handle ? 0 : -ENOMEM;
+	}
+	case DRM_IOCTL_I915_GEM_SET_TILING: {
+		struct drm_i915_gem_set_tiling *set_tiling = arg;
+		tiling_modes[set_tiling->handle] = set_tiling->tiling_mode;
+		return 0;
+	}
+	case DRM_IOCTL_I915_GEM_GET_TILING: {
+		struct drm_i915_gem_get_tiling *get_tiling = arg;
+		get_tiling->tiling_mode = tiling_modes[get_tiling->handle];
+		get_tiling->swizzle_mode = I915_BIT_6_SWIZZLE_NONE;
+		return 0;
+	}
+#ifdef DRM_IOCTL_I915_GEM_MMAP_OFFSET
+	case DRM_IOCTL_I915_GEM_MMAP_OFFSET: {
+		struct drm_i915_gem_mmap_offset *map = arg;
+		map->offset = fake_drm_object_offset(map->handle);
+		return 0;
+	}
+#endif
+	case DRM_IOCTL_I915_GEM_MMAP: {
+		struct drm_i915_gem_mmap *map = arg;
+		void *addr = mmap(NULL, map->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+				  fake_drm_object_offset(map->handle) + map->offset);
+		if (addr == MAP_FAILED)
+			return -errno;
+
+		map->addr_ptr = (uintptr_t)addr;
+		return 0;
+	}
+	case DRM_IOCTL_I915_GEM_SET_DOMAIN:
+		return 0;
+	default:
+		return FAKE_DRM_DEFAULT;
+	}
+}
+
+static struct driver *open_i915(int id)
+{
+	int fd;
+	struct driver *drv;
+
+	chipset_id = id;
+	fd = fake_drm_open("i915", i915_ioctl);
+	CHECK(fd >= 0);
+
+	drv = drv_create(fd);
+	CHECK(drv);
+	return drv;
+}
+
+static void close_i915(struct driver *drv)
+{
+	int fd = drv_get_fd(drv);
+
+	drv_destroy(drv);
+	fake_drm_close(fd);
+}
+
+static bool has_modifier(struct driver *drv, uint32_t format, uint64_t use_flags,
+			 uint64_t modifier)
+{
+	uint64_t modifiers[16];
+	uint32_t i, count;
+
+	count = drv_query_modifiers(drv, format, use_flags, modifiers, ARRAY_SIZE(modifiers));
+	for (i = 0; i < count && i < ARRAY_SIZE(modifiers); i++)
+		if (modifiers[i] == modifier)
+			return true;
+
+	return false;
+}
+
+/* CCS is offered on listed gen9 and gen11 parts only, and for scanout only if KMS takes it. */
+static void test_ccs_combinations(void)
+{
+	struct driver *drv;
+	const uint32_t format = DRM_FORMAT_XRGB8888;
+	const uint64_t modifier = I915_FORMAT_MOD_Y_TILED_CCS;
+
+	/* Kabylake GT2. */
+	drv = open_i915(0x5916);
+	CHECK(has_modifier(drv, format, BO_USE_RENDERING | BO_USE_TEXTURE, modifier));
+	CHECK(!has_modifier(drv, format, BO_USE_RENDERING | BO_USE_SCANOUT, modifier));
+	close_i915(drv);
+
+	/* Tigerlake and Haswell share no generation with the CCS parts. */
+	drv = open_i915(0x9A49);
+	CHECK(!has_modifier(drv, format, BO_USE_RENDERING, modifier));
+	close_i915(drv);
+
+	drv = open_i915(0x0416);
+	CHECK(!has_modifier(drv, format, BO_USE_RENDERING, modifier));
+	close_i915(drv);
+}
+
+/* Buffers created for scanout without modifiers stay X-tiled, whatever KMS lists. */
+static void check_plain_scanout(struct driver *drv, uint32_t format)
+{
+	struct bo *bo = drv_bo_create(drv, 64, 64, format, BO_USE_RENDERING | BO_USE_SCANOUT);
+
+	CHECK(bo);
+	CHECK(drv_bo_get_plane_format_modifier(bo, 0) == I915_FORMAT_MOD_X_TILED);
+	drv_bo_destroy(bo);
+}
+
+/* Of the tiled modifiers KMS lists, only CCS gains scanout. */
+static void test_ccs_scanout(void)
+{
+	int fd;
+	struct driver *drv;
+	const uint32_t format = DRM_FORMAT_XRGB8888;
+	const uint64_t modifiers[] = { I915_FORMAT_MOD_Y_TILED, I915_FORMAT_MOD_Y_TILED_CCS };
+
+	chipset_id = 0x3E9B;
+	fd = fake_drm_open("i915", i915_ioctl);
+	CHECK(fd >= 0);
+	fake_drm_add_plane(DRM_PLANE_TYPE_PRIMARY, &format, 1, modifiers, 1);
+	drv = drv_create(fd);
+	CHECK(drv);
+	CHECK(!has_modifier(drv, format, BO_USE_RENDERING | BO_USE_SCANOUT,
+			    I915_FORMAT_MOD_Y_TILED));
+	CHECK(!has_modifier(drv, format, BO_USE_RENDERING | BO_USE_SCANOUT,
+			    I915_FORMAT_MOD_Y_TILED_CCS));
+	check_plain_scanout(drv, format);
+	close_i915(drv);
+
+	fd = fake_drm_open("i915", i915_ioctl);
+	CHECK(fd >= 0);
+	fake_drm_add_plane(DRM_PLANE_TYPE_PRIMARY, &format, 1, modifiers, 2);
+	drv = drv_create(fd);
+	CHECK(drv);
+	CHECK(has_modifier(drv, format, BO_USE_RENDERING | BO_USE_SCANOUT,
+			   I915_FORMAT_MOD_Y_TILED_CCS));
+	check_plain_scanout(drv, format);
+	close_i915(drv);
+}
+
+static void check_ccs_layout(struct driver *drv, uint32_t width, uint32_t height,
+			     uint32_t stride, uint32_t size, uint32_t aux_stride, uint32_t aux_size)
+{
+	size_t plane;
+	struct bo *bo;
+	const uint64_t modifier = I915_FORMAT_MOD_Y_TILED_CCS;
+
+	bo = drv_bo_create_with_modifiers(drv, width, height, DRM_FORMAT_XRGB8888, &modifier, 1);
+	CHECK(bo);
+	CHECK(drv_bo_get_num_planes(bo) == 2);
+	for (plane = 0; plane < 2; plane++) {
+		CHECK(drv_bo_get_plane_format_modifier(bo, plane) == modifier);
+		CHECK(drv_bo_get_plane_handle(bo, plane).u32 == drv_bo_get_plane_handle(bo, 0).u32);
+	}
+
+	CHECK(drv_bo_get_plane_offset(bo, 0) == 0);
+	CHECK(drv_bo_get_plane_stride(bo, 0) == stride);
+	CHECK(drv_bo_get_plane_size(bo, 0) == size);
+	CHECK(drv_bo_get_plane_offset(bo, 1) == size);
+	CHECK(drv_bo_get_plane_stride(bo, 1) == aux_stride);
+	CHECK(drv_bo_get_plane_size(bo, 1) == aux_size);
+	CHECK(fake_drm_object_size(drv_bo_get_plane_handle(bo, 0).u32) >= size + aux_size);
+
+	drv_bo_destroy(bo);
+}
+
+/*
+ * The CCS follows the Y-tiled main surface, one 128 byte wide, 32 row CCS tile per 32x16 Y
+ * tiles, each surface a whole number of 4 KiB tiles.
+ */
+static void test_ccs_layout(void)
+{
+	struct driver *drv = open_i915(0x5916);
+
+	/* 60x34 Y tiles, covered by 2x3 CCS tiles. */
+	check_ccs_layout(drv, 1920, 1080, 7680, 60 * 34 * 4096, 2 * 128, 2 * 3 * 4096);
+	/* 400 bytes round up to 4 Y tiles across, 50 rows to 2 down, and one CCS tile does. */
+	check_ccs_layout(drv, 100, 50, 512, 4 * 2 * 4096, 128, 4096);
+	/* Exactly 32x16 Y tiles still fit a single CCS tile. */
+	check_ccs_layout(drv, 1024, 512, 4096, 32 * 16 * 4096, 128, 4096);
+	close_i915(drv);
+}
+
+/* Byte offsets within a tiled plane, straight from the tile layouts. */
+static size_t y_tiled_offset(uint32_t stride, uint32_t x, uint32_t y)
+{
+	return (size_t)(y / 32) * stride * 32 + (x / 128) * 4096 + (x % 128 / 16) * 512 +
+	       (y % 32) * 16 + x % 16;
+}
+
+static size_t x_tiled_offset(uint32_t stride, uint32_t x, uint32_t y)
+{
+	return (size_t)(y / 8) * stride * 8 + (x / 512) * 4096 + (y % 8) * 512 + x % 512;
+}
+
+static uint8_t pattern(uint32_t x, uint32_t y, uint32_t seed)
+{
+	return (x * 7 + y * 13 + seed) & 0xff;
+}
+
+static int unmap(struct bo *bo, struct mapping *mapping)
+{
+	/* i915 flushes without unmapping. */
+	int ret = drv_bo_flush_or_unmap(bo, mapping);
+	return ret ? ret : drv_bo_unmap(bo, mapping);
+}
+
+static void check_tiling(struct driver *drv, uint64_t modifier,
+			 size_t (*tiled_offset)(uint32_t, uint32_t, uint32_t))
+{
+	struct bo *bo;
+	uint8_t *tiled, *linear;
+	struct mapping *mapping;
+	uint32_t x, y, stride, bytes_x0, bytes_x1;
+	/* Odd edges, so partial OWords and tile rows are covered. */
+	struct rectangle rect = { 37, 29, 213, 71 };
+	struct rectangle all = { 0, 0, 300, 200 };
+
+	bo = drv_bo_create_with_modifiers(drv, 300, 200, DRM_FORMAT_ARGB8888, &modifier, 1);
+	CHECK(bo);
+	CHECK(drv_bo_get_plane_format_modifier(bo, 0) == modifier);
+
+	stride = drv_bo_get_plane_stride(bo, 0);
+	tiled = fake_drm_object_data(drv_bo_get_plane_handle(bo, 0).u32);
+	CHECK(tiled);
+	for (y = 0; y < 200; y++)
+		for (x = 0; x < stride; x++)
+			tiled[tiled_offset(stride, x, y)] = pattern(x, y, 0);
+
+	/* Reads detile the whole buffer... */
+	linear = drv_bo_map(bo, &all, BO_MAP_READ, &mapping, 0);
+	CHECK(linear != MAP_FAILED);
+	for (y = 0; y < 200; y++)
+		for (x = 0; x < 300 * 4; x++)
+			CHECK(linear[(size_t)y * stride + x] == pattern(x, y, 0));
+	CHECK(!unmap(bo, mapping));
+
+	/* ...and write-only maps write back the rect and nothing else. */
+	bytes_x0 = rect.x * 4;
+	bytes_x1 = (rect.x + rect.width) * 4;
+	linear = drv_bo_map(bo, &rect, BO_MAP_WRITE, &mapping, 0);
+	CHECK(linear != MAP_FAILED);
+	for (y = rect.y; y < rect.y + rect.height; y++)
+		for (x = bytes_x0; x < bytes_x1; x++)
+			linear[(size_t)y * stride + x] = pattern(x, y, 1);
+	CHECK(!unmap(bo, mapping));
+
+	for (y = 0; y < 200; y++) {
+		for (x = 0; x < stride; x++) {
+			bool inside = y >= rect.y && y < rect.y + rect.height && x >= bytes_x0 &&
+				      x < bytes_x1;
+			CHECK(tiled[tiled_offset(stride, x, y)] == pattern(x, y, inside));
+		}
+	}
+
+	drv_bo_destroy(bo);
+}
+
+static void test_tiling(void)
+{
+	struct driver *drv = open_i915(0x5916);
+
+	CHECK(y_tiled_offset(512, 16, 0) == 512);
+	CHECK(y_tiled_offset(512, 0, 1) == 16);
+	CHECK(y_tiled_offset(512, 128, 0) == 4096);
+	CHECK(x_tiled_offset(1024, 512, 0) == 4096);
+
+	check_tiling(drv, I915_FORMAT_MOD_Y_TILED, y_tiled_offset);
+	check_tiling(drv, I915_FORMAT_MOD_X_TILED, x_tiled_offset);
+	close_i915(drv);
+}
+
+static void bench_tiling(struct driver *drv, uint64_t modifier, const char *name)
+{
+	int i;
+	struct bo *bo;
+	char label[64];
+	uint8_t *linear;
+	struct mapping *mapping;
+	double start, read_time, write_time;
+	const int iterations = 20;
+	struct rectangle rect = { 0, 0, 1920, 1080 };
+
+	bo = drv_bo_create_with_modifiers(drv, rect.width, rect.height, DRM_FORMAT_ARGB8888,
+					  &modifier, 1);
+	CHECK(bo);
+
+	start = test_seconds();
+	for (i = 0; i < iterations; i++) {
+		linear = drv_bo_map(bo, &rect, BO_MAP_READ, &mapping, 0);
+		CHECK(linear != MAP_FAILED);
+		CHECK(!drv_bo_unmap(bo, mapping));
+	}
+	read_time = test_seconds() - start;
+
+	start = test_seconds();
+	for (i = 0; i < iterations; i++) {
+		linear = drv_bo_map(bo, &rect, BO_MAP_WRITE, &mapping, 0);
+		CHECK(linear != MAP_FAILED);
+		CHECK(!unmap(bo, mapping));
+	}
+	write_time = test_seconds() - start;
+
+	snprintf(label, sizeof(label), "%s detile 1080p", name);
+	BENCH_REPORT(label, iterations * drv_bo_get_plane_size(bo, 0) / 1e6, "MB/s", read_time);
+	snprintf(label, sizeof(label), "%s retile 1080p", name);
+	BENCH_REPORT(label, iterations * drv_bo_get_plane_size(bo, 0) / 1e6, "MB/s", write_time);
+
+	drv_bo_destroy(bo);
+}
+
+int main(void)
+{
+	struct driver *drv;
+
+	test_ccs_combinations();
+	test_ccs_scanout();
+	test_ccs_layout();
+	test_tiling();
+
+	drv = open_i915(0x5916);
+	bench_tiling(drv, I915_FORMAT_MOD_Y_TILED, "Y-tiled");
+	bench_tiling(drv, I915_FORMAT_MOD_X_TILED, "X-tiled");
+	close_i915(drv);
+
+	return 0;
+}
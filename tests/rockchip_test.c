@@ -0,0 +1,371 @@
+/*
+ * Copyright 2020 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include <errno.h>
+#include <rockchip_drm.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+
+#include "drv.h"
+#include "fake_drm.h"
+#include "test.h"
+#include "util.h"
+
+/* A 32x32 ARGB buffer: 2x2 superblocks, a 1024 byte aligned header plane, 1024 byte bodies. */
+#define WIDTH 32
+#define HEIGHT 32
+#define STRIDE (WIDTH * 4)
+#define BODY_PLANE_OFFSET 1024
+#define BODY_BLOCK_SIZE 1024
+#define TOTAL_SIZE (BODY_PLANE_OFFSET + 4 * BODY_BLOCK_SIZE)
+
+/* Subblock positions in storage order, as given by the AFBC spec. */
+static const uint8_t subblock_order[16][2] = {
+	{ 1, 1 }, { 1, 0 }, { 0, 0 }, { 0, 1 }, { 0, 2 }, { 0, 3 }, { 1, 3 }, { 1, 2 },
+	{ 2, 2 }, { 2, 3 }, { 3, 3 }, { 3, 2 }, { 3, 1 }, { 3, 0 }, { 2, 0 }, { 2, 1 },
+};
+
+/* The header of an uncompressed superblock: its body offset, then sixteen subblock sizes of 1. */
+static const uint8_t uncompressed_header[16] = { 0x00, 0x04, 0x00, 0x00, 0x41, 0x10,
+						 0x04, 0x41, 0x10, 0x04, 0x41, 0x10,
+						 0x04, 0x41, 0x10, 0x04 };
+
+static int rockchip_ioctl(int fd, unsigned long request, void *arg)
+{
+	switch (request) {
+	case DRM_IOCTL_ROCKCHIP_GEM_CREATE: {
+		struct drm_rockchip_gem_create *create = arg;
+		create->handle = fake_drm_create_object(create->size);
+		return create->handle ? 0 : -ENOMEM;
+	}
+	case DRM_IOCTL_ROCKCHIP_GEM_MAP_OFFSET: {
+		struct drm_rockchip_gem_map_off *map = arg;
+		map->offset = fake_drm_object_offset(map->handle);
+		return 0;
+	}
+	default:
+		return FAKE_DRM_DEFAULT;
+	}
+}
+
+#ifndef DRM_FORMAT_MOD_ARM_AFBC
+#define DRM_FORMAT_MOD_ARM_AFBC(__afbc_mode) fourcc_mod_code(ARM, __afbc_mode)
+#define AFBC_FORMAT_MOD_BLOCK_SIZE_16x16 (1ULL)
+#define AFBC_FORMAT_MOD_BLOCK_SIZE_32x8 (2ULL)
+#define AFBC_FORMAT_MOD_YTR (1ULL << 4)
+#define AFBC_FORMAT_MOD_SPLIT (1ULL << 5)
+#define AFBC_FORMAT_MOD_SPARSE (1ULL << 6)
+#endif
+
+#define AFBC_16x16                                                                                 \
+	DRM_FORMAT_MOD_ARM_AFBC(AFBC_FORMAT_MOD_BLOCK_SIZE_16x16 | AFBC_FORMAT_MOD_SPARSE)
+#define AFBC_32x8 DRM_FORMAT_MOD_ARM_AFBC(AFBC_FORMAT_MOD_BLOCK_SIZE_32x8 | AFBC_FORMAT_MOD_SPARSE)
+
+struct afbc_size {
+	uint32_t width;
+	uint32_t height;
+	uint32_t format;
+	uint64_t modifier;
+	uint32_t stride;
+	uint32_t size;
+};
+
+/*
+ * Worked out by hand: headers take 16 bytes per superblock and the body plane starts at the
+ * next 1 KiB; each body takes a superblock of pixels rounded up to 128 bytes.
+ */
+static const struct afbc_size afbc_sizes[] = {
+	/* 2x2 superblocks of 1024 bytes. */
+	{ 32, 32, DRM_FORMAT_ARGB8888, DRM_FORMAT_MOD_CHROMEOS_ROCKCHIP_AFBC, 128,
+	  1024 + 4 * 1024 },
+	/* 7x4 superblocks, 384 bytes of 12 bit pixels each. */
+	{ 100, 50, DRM_FORMAT_NV12, AFBC_16x16, 168, 1024 + 28 * 384 },
+	/* 4x4 superblocks, 480 bytes of 15 bit pixels padded to 512. */
+	{ 64, 64, DRM_FORMAT_P010, AFBC_16x16, 120, 1024 + 16 * 512 },
+	/* 4x7 wide superblocks of 512 bytes. */
+	{ 100, 50, DRM_FORMAT_RGB565, AFBC_32x8, 256, 1024 + 28 * 512 },
+	/* 4x4 superblocks of 768 bytes. */
+	{ 64, 64, DRM_FORMAT_RGB888, AFBC_16x16, 192, 1024 + 16 * 768 },
+	/* 160 superblocks take 2560 bytes of headers, so the bodies start at 3072. */
+	{ 320, 128, DRM_FORMAT_XRGB8888, AFBC_16x16, 1280, 3072 + 160 * 1024 },
+};
+
+static void test_layout(struct driver *drv)
+{
+	size_t i;
+	struct bo *bo;
+	const struct afbc_size *s;
+	uint64_t modifiers[2];
+
+	for (i = 0; i < ARRAY_SIZE(afbc_sizes); i++) {
+		s = &afbc_sizes[i];
+		bo = drv_bo_create_with_modifiers(drv, s->width, s->height, s->format, &s->modifier,
+						  1);
+		CHECK(bo);
+		CHECK(drv_bo_get_num_planes(bo) == 1);
+		CHECK(drv_bo_get_plane_format_modifier(bo, 0) == s->modifier);
+		CHECK(drv_bo_get_plane_stride(bo, 0) == s->stride);
+		CHECK(drv_bo_get_plane_size(bo, 0) == s->size);
+		drv_bo_destroy(bo);
+	}
+
+	/* Split blocks aren't laid out, so with no fallback there is no buffer... */
+	modifiers[0] = DRM_FORMAT_MOD_ARM_AFBC(AFBC_FORMAT_MOD_BLOCK_SIZE_16x16 |
+					       AFBC_FORMAT_MOD_SPLIT | AFBC_FORMAT_MOD_SPARSE);
+	CHECK(!drv_bo_create_with_modifiers(drv, 64, 64, DRM_FORMAT_ARGB8888, modifiers, 1));
+
+	/* ...and with one, the buffer is linear. */
+	modifiers[1] = DRM_FORMAT_MOD_LINEAR;
+	bo = drv_bo_create_with_modifiers(drv, 64, 64, DRM_FORMAT_ARGB8888, modifiers, 2);
+	CHECK(bo);
+	CHECK(drv_bo_get_plane_format_modifier(bo, 0) == DRM_FORMAT_MOD_LINEAR);
+	drv_bo_destroy(bo);
+}
+
+static bool has_modifier(struct driver *drv, uint32_t format, uint64_t use_flags,
+			 uint64_t modifier)
+{
+	uint64_t modifiers[16];
+	uint32_t i, count;
+
+	count = drv_query_modifiers(drv, format, use_flags, modifiers, ARRAY_SIZE(modifiers));
+	for (i = 0; i < count && i < ARRAY_SIZE(modifiers); i++)
+		if (modifiers[i] == modifier)
+			return true;
+
+	return false;
+}
+
+/* AFBC combinations follow what the planes scan out; YUV ones are never render targets. */
+static void test_combinations(void)
+{
+	int fd;
+	struct driver *drv;
+	const uint32_t formats[] = { DRM_FORMAT_XRGB8888, DRM_FORMAT_NV12 };
+	const uint64_t modifiers[] = { AFBC_16x16 };
+
+	fd = fake_drm_open("rockchip", rockchip_ioctl);
+	CHECK(fd >= 0);
+	fake_drm_add_plane(DRM_PLANE_TYPE_PRIMARY, formats, ARRAY_SIZE(formats), modifiers,
+			   ARRAY_SIZE(modifiers));
+	drv = drv_create(fd);
+	CHECK(drv);
+
+	CHECK(has_modifier(drv, DRM_FORMAT_XRGB8888, BO_USE_RENDERING | BO_USE_SCANOUT,
+			   AFBC_16x16));
+	CHECK(has_modifier(drv, DRM_FORMAT_NV12, BO_USE_TEXTURE | BO_USE_SCANOUT, AFBC_16x16));
+	CHECK(!has_modifier(drv, DRM_FORMAT_NV12, BO_USE_RENDERING, AFBC_16x16));
+	CHECK(!has_modifier(drv, DRM_FORMAT_RGB565, BO_USE_RENDERING, AFBC_16x16));
+
+	drv_destroy(drv);
+	fake_drm_close(fd);
+}
+
+static int unmap(struct bo *bo, struct mapping *mapping)
+{
+	/* Rockchip flushes without unmapping. */
+	int ret = drv_bo_flush_or_unmap(bo, mapping);
+	return ret ? ret : drv_bo_unmap(bo, mapping);
+}
+
+static uint32_t read_pixel(const uint8_t *linear, uint32_t x, uint32_t y)
+{
+	uint32_t pixel;
+
+	memcpy(&pixel, linear + y * STRIDE + x * 4, sizeof(pixel));
+	return pixel;
+}
+
+static void write_pixel(uint8_t *linear, uint32_t x, uint32_t y, uint32_t pixel)
+{
+	memcpy(linear + y * STRIDE + x * 4, &pixel, sizeof(pixel));
+}
+
+/* The byte offset, within a superblock body, of pixel (x, y) of that superblock. */
+static uint32_t body_offset(uint32_t x, uint32_t y)
+{
+	uint32_t i;
+
+	for (i = 0; i < 16; i++)
+		if (subblock_order[i][0] == x / 4 && subblock_order[i][1] == y / 4)
+			break;
+
+	return (i * 16 + (y % 4) * 4 + x % 4) * 4;
+}
+
+static struct bo *create_afbc(struct driver *drv)
+{
+	struct bo *bo;
+	uint64_t modifier = DRM_FORMAT_MOD_CHROMEOS_ROCKCHIP_AFBC;
+
+	bo = drv_bo_create_with_modifiers(drv, WIDTH, HEIGHT, DRM_FORMAT_ARGB8888, &modifier, 1);
+	CHECK(bo);
+	CHECK(drv_bo_get_plane_format_modifier(bo, 0) == modifier);
+	CHECK(drv_bo_get_plane_stride(bo, 0) == STRIDE);
+	CHECK(drv_bo_get_plane_size(bo, 0) == TOTAL_SIZE);
+	return bo;
+}
+
+/*
+ * Superblock 0 is uncompressed with body pixel i holding i, superblock 1 is solid 0x11223344
+ * and the rest are solid 0, as they are in a freshly allocated buffer.
+ */
+static void fill_golden(uint8_t *afbc)
+{
+	uint32_t i;
+	const uint32_t solid = 0x11223344;
+
+	memset(afbc, 0, TOTAL_SIZE);
+	memcpy(afbc, uncompressed_header, sizeof(uncompressed_header));
+	for (i = 0; i < 256; i++)
+		memcpy(afbc + BODY_PLANE_OFFSET + i * 4, &i, sizeof(i));
+
+	memcpy(afbc + 16 + 8, &solid, sizeof(solid));
+}
+
+static void test_decode(struct driver *drv)
+{
+	uint8_t *afbc, *linear;
+	uint32_t x, y;
+	struct mapping *mapping;
+	struct bo *bo = create_afbc(drv);
+	struct rectangle all = { 0, 0, WIDTH, HEIGHT };
+
+	afbc = fake_drm_object_data(drv_bo_get_plane_handle(bo, 0).u32);
+	fill_golden(afbc);
+
+	linear = drv_bo_map(bo, &all, BO_MAP_READ, &mapping, 0);
+	CHECK(linear != MAP_FAILED);
+
+	/* Spot checks against the subblock order of the spec... */
+	CHECK(read_pixel(linear, 4, 4) == 0);
+	CHECK(read_pixel(linear, 5, 6) == 9);
+	CHECK(read_pixel(linear, 4, 0) == 16);
+	CHECK(read_pixel(linear, 0, 0) == 32);
+	CHECK(read_pixel(linear, 0, 4) == 48);
+	CHECK(read_pixel(linear, 0, 8) == 64);
+	CHECK(read_pixel(linear, 8, 0) == 224);
+
+	/* ...then every pixel. */
+	for (y = 0; y < HEIGHT; y++) {
+		for (x = 0; x < WIDTH; x++) {
+			uint32_t expected = 0;
+			if (x < 16 && y < 16)
+				expected = body_offset(x, y) / 4;
+			else if (y < 16)
+				expected = 0x11223344;
+
+			CHECK(read_pixel(linear, x, y) == expected);
+		}
+	}
+
+	CHECK(!unmap(bo, mapping));
+	drv_bo_destroy(bo);
+}
+
+/* Compressed superblocks can't be decoded, so the map fails and leaves the buffer alone. */
+static void test_compressed(struct driver *drv)
+{
+	uint8_t *afbc, *linear;
+	uint8_t saved[TOTAL_SIZE];
+	struct mapping *mapping;
+	struct bo *bo = create_afbc(drv);
+	struct rectangle all = { 0, 0, WIDTH, HEIGHT };
+	struct rectangle inner = { 16, 0, 16, 16 };
+	struct rectangle partial = { 4, 4, 8, 8 };
+
+	afbc = fake_drm_object_data(drv_bo_get_plane_handle(bo, 0).u32);
+	fill_golden(afbc);
+	/* Subblock 0 of superblock 0 now takes two body units. */
+	afbc[4] = 0x42;
+	memcpy(saved, afbc, TOTAL_SIZE);
+
+	CHECK(drv_bo_map(bo, &all, BO_MAP_READ_WRITE, &mapping, 0) == MAP_FAILED);
+	CHECK(!mapping);
+	CHECK(drv_bo_map(bo, &partial, BO_MAP_WRITE, &mapping, 0) == MAP_FAILED);
+	CHECK(!memcmp(afbc, saved, TOTAL_SIZE));
+
+	/* Rects that leave the compressed superblock out still map. */
+	linear = drv_bo_map(bo, &inner, BO_MAP_READ_WRITE, &mapping, 0);
+	CHECK(linear != MAP_FAILED);
+	CHECK(read_pixel(linear, 16, 0) == 0x11223344);
+	CHECK(!unmap(bo, mapping));
+	CHECK(!memcmp(afbc, saved, 16));
+
+	drv_bo_destroy(bo);
+}
+
+static void test_encode(struct driver *drv)
+{
+	uint8_t *afbc, *linear;
+	uint32_t x, y, block, pixel;
+	uint8_t header[16];
+	struct mapping *mapping;
+	struct bo *bo = create_afbc(drv);
+	struct rectangle all = { 0, 0, WIDTH, HEIGHT };
+
+	afbc = fake_drm_object_data(drv_bo_get_plane_handle(bo, 0).u32);
+
+	linear = drv_bo_map(bo, &all, BO_MAP_WRITE, &mapping, 0);
+	CHECK(linear != MAP_FAILED);
+	for (y = 0; y < HEIGHT; y++)
+		for (x = 0; x < WIDTH; x++)
+			write_pixel(linear, x, y, y << 8 | x);
+	CHECK(!unmap(bo, mapping));
+
+	/* Every superblock is stored uncompressed, in its own body slot. */
+	for (block = 0; block < 4; block++) {
+		memcpy(header, uncompressed_header, sizeof(header));
+		header[1] = (BODY_PLANE_OFFSET + block * BODY_BLOCK_SIZE) >> 8;
+		CHECK(!memcmp(afbc + block * 16, header, sizeof(header)));
+	}
+
+	for (y = 0; y < HEIGHT; y++) {
+		for (x = 0; x < WIDTH; x++) {
+			block = (y / 16) * 2 + x / 16;
+			memcpy(&pixel,
+			       afbc + BODY_PLANE_OFFSET + block * BODY_BLOCK_SIZE +
+				   body_offset(x % 16, y % 16),
+			       sizeof(pixel));
+			CHECK(pixel == (y << 8 | x));
+		}
+	}
+
+	/* What we encode, we decode. */
+	linear = drv_bo_map(bo, &all, BO_MAP_READ, &mapping, 0);
+	CHECK(linear != MAP_FAILED);
+	for (y = 0; y < HEIGHT; y++)
+		for (x = 0; x < WIDTH; x++)
+			CHECK(read_pixel(linear, x, y) == (y << 8 | x));
+	CHECK(!unmap(bo, mapping));
+
+	drv_bo_destroy(bo);
+}
+
+int main(void)
+{
+	int fd;
+	struct driver *drv;
+
+	fd = fake_drm_open("rockchip", rockchip_ioctl);
+	CHECK(fd >= 0);
+	drv = drv_create(fd);
+	CHECK(drv);
+
+	test_layout(drv);
+	test_decode(drv);
+	test_compressed(drv);
+	test_encode(drv);
+
+	drv_destroy(drv);
+	fake_drm_close(fd);
+
+	test_combinations();
+	return 0;
+}
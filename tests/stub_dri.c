@@ -0,0 +1,424 @@
+/*
+ * Copyright 2020 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * Just enough of a DRI driver for dri.c, built as radeonsi_dri.so for amdgpu_test. Images are
+ * fake GEM objects with a pitch of their own; maps go through a staging copy, like they do on a
+ * tiled GPU, and stub_dri counts what the driver does. Images share objects the way radeonsi's
+ * do, by counting references to each GEM handle.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <xf86drm.h>
+
+typedef int GLint;
+typedef unsigned int GLuint;
+typedef unsigned char GLboolean;
+
+#include "GL/internal/dri_interface.h"
+#include "fake_drm.h"
+#include "stub_dri.h"
+#include "util.h"
+
+#define STUB_PITCH_ALIGN 256
+/* Metadata planes have a byte per 8x8 block, in rows of at least 64 bytes. */
+#define STUB_AUX_BLOCK 8
+#define STUB_AUX_PITCH_ALIGN 64
+#define STUB_MAX_HANDLES 1024
+
+struct __DRIscreenRec {
+	int fd;
+};
+
+struct __DRIcontextRec {
+	__DRIscreen *screen;
+};
+
+struct __DRIconfigRec {
+	int unused;
+};
+
+struct __DRIimageRec {
+	__DRIscreen *screen;
+	/* Set on the images fromPlanar hands out, which don't own their objects. */
+	__DRIimage *parent;
+	/* The object and bytes per pixel of the first plane, which is all a plane image has. */
+	uint32_t handle;
+	int width;
+	int height;
+	int cpp;
+	int num_planes;
+	uint32_t handles[4];
+	int cpps[4];
+	int strides[4];
+	int offsets[4];
+	uint64_t modifier;
+};
+
+struct stub_map {
+	void *data;
+	int x0;
+	int y0;
+	int height;
+	int row_bytes;
+	unsigned int flags;
+};
+
+static const struct {
+	int dri_format;
+	int cpp;
+} stub_formats[] = {
+	{ __DRI_IMAGE_FORMAT_R8, 1 },	    { __DRI_IMAGE_FORMAT_GR88, 2 },
+	{ __DRI_IMAGE_FORMAT_RGB565, 2 },   { __DRI_IMAGE_FORMAT_XRGB8888, 4 },
+	{ __DRI_IMAGE_FORMAT_ARGB8888, 4 }, { __DRI_IMAGE_FORMAT_XBGR8888, 4 },
+	{ __DRI_IMAGE_FORMAT_ABGR8888, 4 },
+};
+
+static uint32_t stub_handle_refs[STUB_MAX_HANDLES];
+
+static const __DRIconfig stub_config;
+static const __DRIconfig *stub_configs[] = { &stub_config, NULL };
+
+__attribute__((constructor)) static void stub_dri_open(void)
+{
+	stub_dri.opens++;
+}
+
+static __DRIimage *stub_create_image(__DRIscreen *screen, int width, int height, int format,
+				     unsigned int use, void *loader_private)
+{
+	size_t i, size;
+	__DRIimage *image;
+
+	for (i = 0; i < ARRAY_SIZE(stub_formats); i++)
+		if (stub_formats[i].dri_format == format)
+			break;
+
+	if (i == ARRAY_SIZE(stub_formats)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	image = calloc(1, sizeof(*image));
+	if (!image)
+		return NULL;
+
+	image->screen = screen;
+	image->width = width;
+	image->height = height;
+	image->cpp = stub_formats[i].cpp;
+	image->cpps[0] = image->cpp;
+	image->cpps[1] = 1;
+	image->num_planes = 1;
+	image->strides[0] = ALIGN(width * image->cpp, STUB_PITCH_ALIGN);
+	size = (size_t)image->strides[0] * height;
+
+	if (stub_dri.aux_modifier) {
+		image->num_planes = 2;
+		image->modifier = stub_dri.aux_modifier;
+		image->offsets[1] = ALIGN(size, 4096);
+		image->strides[1] =
+		    ALIGN(DIV_ROUND_UP(width, STUB_AUX_BLOCK), STUB_AUX_PITCH_ALIGN);
+		size = image->offsets[1] +
+		       (size_t)image->strides[1] * DIV_ROUND_UP(height, STUB_AUX_BLOCK);
+	}
+
+	image->handle = fake_drm_create_object(size);
+	if (!image->handle || image->handle >= STUB_MAX_HANDLES) {
+		free(image);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	image->handles[0] = image->handle;
+	image->handles[1] = image->handle;
+	stub_handle_refs[image->handle] += image->num_planes;
+	stub_dri.live_images++;
+	return image;
+}
+
+static __DRIimage *stub_create_image_from_fds(__DRIscreen *screen, int width, int height,
+					      int fourcc, int *fds, int num_fds, int *strides,
+					      int *offsets, void *loader_private)
+{
+	int plane;
+	__DRIimage *image;
+
+	image = calloc(1, sizeof(*image));
+	if (!image)
+		return NULL;
+
+	if (num_fds < 1 || num_fds > 4) {
+		free(image);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	for (plane = 0; plane < num_fds; plane++) {
+		if (drmPrimeFDToHandle(screen->fd, fds[plane], &image->handles[plane]) ||
+		    image->handles[plane] >= STUB_MAX_HANDLES) {
+			free(image);
+			errno = EINVAL;
+			return NULL;
+		}
+	}
+
+	image->screen = screen;
+	image->width = width;
+	image->height = height;
+	image->num_planes = num_fds;
+	for (plane = 0; plane < num_fds; plane++) {
+		if (fourcc == __DRI_IMAGE_FOURCC_NV12)
+			image->cpps[plane] = plane + 1;
+		else if (fourcc == __DRI_IMAGE_FOURCC_YVU420)
+			image->cpps[plane] = 1;
+		else
+			image->cpps[plane] = 4;
+
+		image->strides[plane] = strides[plane];
+		image->offsets[plane] = offsets[plane];
+		stub_handle_refs[image->handles[plane]]++;
+	}
+
+	image->handle = image->handles[0];
+	image->cpp = image->cpps[0];
+
+	stub_dri.live_images++;
+	return image;
+}
+
+static void stub_destroy_image(__DRIimage *image)
+{
+	int plane;
+	struct drm_gem_close gem_close = { 0 };
+
+	if (!image->parent) {
+		/* Each plane holds a reference. minigbm may have closed the handles already. */
+		for (plane = 0; plane < image->num_planes; plane++) {
+			gem_close.handle = image->handles[plane];
+			if (!--stub_handle_refs[gem_close.handle])
+				drmIoctl(image->screen->fd, DRM_IOCTL_GEM_CLOSE, &gem_close);
+		}
+		stub_dri.live_images--;
+	}
+
+	free(image);
+}
+
+static GLboolean stub_query_image(__DRIimage *image, int attrib, int *value)
+{
+	switch (attrib) {
+	case __DRI_IMAGE_ATTRIB_NUM_PLANES:
+		*value = image->num_planes;
+		return 1;
+	case __DRI_IMAGE_ATTRIB_STRIDE:
+		*value = image->strides[0];
+		return 1;
+	case __DRI_IMAGE_ATTRIB_OFFSET:
+		*value = image->offsets[0];
+		return 1;
+	case __DRI_IMAGE_ATTRIB_MODIFIER_UPPER:
+		*value = image->modifier >> 32;
+		return image->modifier != 0;
+	case __DRI_IMAGE_ATTRIB_MODIFIER_LOWER:
+		*value = (uint32_t)image->modifier;
+		return image->modifier != 0;
+	case __DRI_IMAGE_ATTRIB_FD:
+		return !drmPrimeHandleToFD(image->screen->fd, image->handle, DRM_CLOEXEC, value);
+	default:
+		return 0;
+	}
+}
+
+static __DRIimage *stub_from_planar(__DRIimage *image, int plane, void *loader_private)
+{
+	__DRIimage *view;
+
+	if (plane < 0 || plane >= image->num_planes)
+		return NULL;
+
+	view = calloc(1, sizeof(*view));
+	if (!view)
+		return NULL;
+
+	*view = *image;
+	view->parent = image;
+	view->num_planes = 1;
+	view->handle = image->handles[plane];
+	view->cpp = image->cpps[plane];
+	view->strides[0] = image->strides[plane];
+	view->offsets[0] = image->offsets[plane];
+	return view;
+}
+
+static void *stub_map_image(__DRIcontext *context, __DRIimage *image, int x0, int y0, int width,
+			    int height, unsigned int flags, int *stride, void **data)
+{
+	int y;
+	uint8_t *object;
+	struct stub_map *map;
+
+	object = fake_drm_object_data(image->handle);
+	map = calloc(1, sizeof(*map));
+	if (!object || !map) {
+		free(map);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	map->x0 = x0;
+	map->y0 = y0;
+	map->height = height;
+	map->row_bytes = width * image->cpp;
+	map->flags = flags;
+	map->data = malloc((size_t)map->row_bytes * height);
+	if (!map->data) {
+		free(map);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	if (flags & __DRI_IMAGE_TRANSFER_READ) {
+		for (y = 0; y < height; y++)
+			memcpy((uint8_t *)map->data + (size_t)y * map->row_bytes,
+			       object + image->offsets[0] + (size_t)(y0 + y) * image->strides[0] +
+				   x0 * image->cpp,
+			       map->row_bytes);
+		stub_dri.bytes_blitted += (size_t)map->row_bytes * height;
+	}
+
+	*stride = map->row_bytes;
+	*data = map;
+	return map->data;
+}
+
+static void stub_unmap_image(__DRIcontext *context, __DRIimage *image, void *data)
+{
+	int y;
+	uint8_t *row;
+	struct stub_map *map = data;
+	uint8_t *object = fake_drm_object_data(image->handle);
+
+	if (map->flags & __DRI_IMAGE_TRANSFER_WRITE) {
+		object += image->offsets[0] + map->x0 * image->cpp;
+		for (y = 0; y < map->height; y++) {
+			row = object + (size_t)(map->y0 + y) * image->strides[0];
+			memcpy(row, (uint8_t *)map->data + (size_t)y * map->row_bytes,
+			       map->row_bytes);
+		}
+		stub_dri.bytes_blitted += (size_t)map->row_bytes * map->height;
+	}
+
+	free(map->data);
+	free(map);
+}
+
+static const __DRIimageExtension stub_image_extension = {
+	.base = { __DRI_IMAGE, 12 },
+	.createImage = stub_create_image,
+	.destroyImage = stub_destroy_image,
+	.queryImage = stub_query_image,
+	.fromPlanar = stub_from_planar,
+	.createImageFromFds = stub_create_image_from_fds,
+	.mapImage = stub_map_image,
+	.unmapImage = stub_unmap_image,
+};
+
+static void stub_flush_with_flags(__DRIcontext *context, __DRIdrawable *drawable, unsigned flags,
+				  enum __DRI2throttleReason reason)
+{
+	stub_dri.flushes++;
+}
+
+static const __DRI2flushExtension stub_flush_extension = {
+	.base = { __DRI2_FLUSH, 4 },
+	.flush_with_flags = stub_flush_with_flags,
+};
+
+static const __DRIextension *stub_screen_extensions[] = {
+	&stub_image_extension.base,
+	&stub_flush_extension.base,
+	NULL,
+};
+
+static void stub_destroy_screen(__DRIscreen *screen)
+{
+	stub_dri.live_screens--;
+	free(screen);
+}
+
+static const __DRIextension **stub_get_extensions(__DRIscreen *screen)
+{
+	return stub_screen_extensions;
+}
+
+static void stub_destroy_context(__DRIcontext *context)
+{
+	free(context);
+}
+
+static const __DRIcoreExtension stub_core_extension = {
+	.base = { __DRI_CORE, 2 },
+	.destroyScreen = stub_destroy_screen,
+	.getExtensions = stub_get_extensions,
+	.destroyContext = stub_destroy_context,
+};
+
+static __DRIscreen *stub_create_new_screen2(int screen_index, int fd,
+					    const __DRIextension **extensions,
+					    const __DRIextension **driver_extensions,
+					    const __DRIconfig ***driver_configs,
+					    void *loader_private)
+{
+	__DRIscreen *screen;
+
+	stub_dri.screens_created++;
+	if (stub_dri.screen_delay_us)
+		usleep(stub_dri.screen_delay_us);
+
+	if (stub_dri.fail_screen)
+		return NULL;
+
+	screen = calloc(1, sizeof(*screen));
+	if (!screen)
+		return NULL;
+
+	screen->fd = fd;
+	*driver_configs = stub_configs;
+	stub_dri.live_screens++;
+	return screen;
+}
+
+static __DRIcontext *stub_create_new_context(__DRIscreen *screen, const __DRIconfig *config,
+					     __DRIcontext *shared, void *loader_private)
+{
+	__DRIcontext *context = calloc(1, sizeof(*context));
+
+	if (context)
+		context->screen = screen;
+
+	return context;
+}
+
+static const __DRIdri2Extension stub_dri2_extension = {
+	.base = { __DRI_DRI2, 4 },
+	.createNewScreen2 = stub_create_new_screen2,
+	.createNewContext = stub_create_new_context,
+};
+
+static const __DRIextension *stub_driver_extensions[] = {
+	&stub_core_extension.base,
+	&stub_dri2_extension.base,
+	NULL,
+};
+
+const __DRIextension **__driDriverGetExtensions_radeonsi(void)
+{
+	return stub_driver_extensions;
+}
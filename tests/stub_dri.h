@@ -0,0 +1,38 @@
+/*
+ * Copyright 2020 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#ifndef STUB_DRI_H
+#define STUB_DRI_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * State shared with the stub DRI driver in stub_dri.c, which the tests build as radeonsi_dri.so.
+ * The test binary defines it and exports it, so the driver finds it once dri.c dlopens it.
+ */
+struct stub_dri {
+	/* Set by the test. */
+	bool fail_screen;
+	/* How long creating a screen takes, standing in for radeonsi's own start-up. */
+	uint32_t screen_delay_us;
+	/* When set, new images get a metadata plane after the pixels and report this modifier. */
+	uint64_t aux_modifier;
+
+	/* Kept by the driver. */
+	uint32_t opens;
+	uint32_t screens_created;
+	uint32_t live_screens;
+	uint32_t live_images;
+	uint32_t flushes;
+	/* Bytes copied between images and their staging maps, in either direction. */
+	size_t bytes_blitted;
+};
+
+extern struct stub_dri stub_dri;
+
+#endif
@@ -0,0 +1,38 @@
+/*
+ * Copyright 2020 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#ifndef TEST_H
+#define TEST_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define CHECK(cond)                                                                                \
+	do {                                                                                       \
+		if (!(cond)) {                                                                     \
+			fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond);   \
+			exit(1);                                                                   \
+		}                                                                                  \
+	} while (0)
+
+static inline double test_seconds(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Benchmarks only report their numbers; timing never fails a test. */
+#define BENCH_REPORT(name, amount, unit, seconds)                                                  \
+	printf("%-40s %10.1f %s\n", name, (amount) / (seconds), unit)
+
+/* For latencies: the average time each of count operations took, in microseconds. */
+#define BENCH_REPORT_LATENCY(name, count, seconds)                                                 \
+	printf("%-40s %10.1f us\n", name, (seconds) * 1e6 / (count))
+
+#endif
@@ -0,0 +1,554 @@
+/*
+ * Copyright 2020 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <virtgpu_drm.h>
+#include <xf86drm.h>
+
+#include "drv.h"
+#include "fake_drm.h"
+#include "test.h"
+#include "util.h"
+
+#define MAX_TRANSFERS 64
+#define USE_FLAGS (BO_USE_RENDERING | BO_USE_SW_WRITE_RARELY)
+#define SW_USE_FLAGS (BO_USE_RENDERING | BO_USE_SW_READ_OFTEN | BO_USE_SW_WRITE_OFTEN)
+
+#ifndef DRM_IOCTL_VIRTGPU_RESOURCE_CREATE_BLOB
+#define VIRTGPU_PARAM_RESOURCE_BLOB 3
+#define VIRTGPU_PARAM_HOST_VISIBLE 4
+#define VIRTGPU_BLOB_MEM_HOST3D 0x0002
+
+struct drm_virtgpu_resource_create_blob {
+	__u32 blob_mem;
+	__u32 blob_flags;
+	__u32 bo_handle;
+	__u32 res_handle;
+	__u64 size;
+	__u32 pad;
+	__u32 cmd_size;
+	__u64 cmd;
+	__u64 blob_id;
+};
+
+#define DRM_IOCTL_VIRTGPU_RESOURCE_CREATE_BLOB                                                     \
+	DRM_IOWR(DRM_COMMAND_BASE + 0x0a, struct drm_virtgpu_resource_create_blob)
+#endif
+
+/* struct drm_virtgpu_resource_info, whose last field older headers call stride. */
+struct resource_info {
+	__u32 bo_handle;
+	__u32 res_handle;
+	__u32 size;
+	__u32 blob_mem;
+};
+
+static bool has_blob;
+static uint32_t blob_mems[1024];
+static uint64_t blob_ids[16];
+static uint32_t num_blob_ids;
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct drm_virtgpu_3d_box boxes[MAX_TRANSFERS];
+	uint32_t num_boxes;
+	/* Transfers the host has finished. */
+	uint32_t num_done;
+	/* While set, transfers to the host wait, so flushes pile up behind the first one. */
+	bool stall;
+	bool stalled;
+	/* How long each transfer takes the host, for benchmarks. */
+	useconds_t delay_us;
+} host = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+static void host_transfer(const struct drm_virtgpu_3d_box *box)
+{
+	pthread_mutex_lock(&host.lock);
+	CHECK(host.num_boxes < MAX_TRANSFERS);
+	host.boxes[host.num_boxes++] = *box;
+
+	host.stalled = true;
+	pthread_cond_broadcast(&host.cond);
+	while (host.stall)
+		pthread_cond_wait(&host.cond, &host.lock);
+	pthread_mutex_unlock(&host.lock);
+
+	if (host.delay_us)
+		usleep(host.delay_us);
+
+	pthread_mutex_lock(&host.lock);
+	host.num_done++;
+	pthread_mutex_unlock(&host.lock);
+}
+
+static int virtio_gpu_ioctl(int fd, unsigned long request, void *arg)
+{
+	switch (request) {
+	case DRM_IOCTL_VIRTGPU_GETPARAM: {
+		struct drm_virtgpu_getparam *param = arg;
+		int *value = (int *)(uintptr_t)param->value;
+		if (param->param == VIRTGPU_PARAM_3D_FEATURES)
+			*value = 1;
+		else if (param->param == VIRTGPU_PARAM_RESOURCE_BLOB ||
+			 param->param == VIRTGPU_PARAM_HOST_VISIBLE)
+			*value = has_blob;
+		else
+			return -EINVAL;
+
+		return 0;
+	}
+	case DRM_IOCTL_VIRTGPU_RESOURCE_CREATE_BLOB: {
+		struct drm_virtgpu_resource_create_blob *create = arg;
+		create->bo_handle = fake_drm_create_object(create->size);
+		create->res_handle = create->bo_handle;
+		if (!create->bo_handle)
+			return -ENOMEM;
+
+		blob_mems[create->bo_handle] = create->blob_mem;
+		CHECK(num_blob_ids < ARRAY_SIZE(blob_ids));
+		blob_ids[num_blob_ids++] = create->blob_id;
+		return 0;
+	}
+	case DRM_IOCTL_VIRTGPU_RESOURCE_INFO: {
+		struct resource_info *info = arg;
+		info->res_handle = info->bo_handle;
+		info->size = fake_drm_object_size(info->bo_handle);
+		info->blob_mem = blob_mems[info->bo_handle];
+		return 0;
+	}
+	case DRM_IOCTL_VIRTGPU_RESOURCE_CREATE: {
+		struct drm_virtgpu_resource_create *create = arg;
+		create->bo_handle = fake_drm_create_object(create->size);
+		create->res_handle = create->bo_handle;
+		if (!create->bo_handle)
+			return -ENOMEM;
+
+		blob_mems[create->bo_handle] = 0;
+		return 0;
+	}
+	case DRM_IOCTL_VIRTGPU_MAP: {
+		struct drm_virtgpu_map *map = arg;
+		map->offset = fake_drm_object_offset(map->handle);
+		return 0;
+	}
+	case DRM_IOCTL_VIRTGPU_TRANSFER_TO_HOST: {
+		struct drm_virtgpu_3d_transfer_to_host *xfer = arg;
+		host_transfer(&xfer->box);
+		return 0;
+	}
+	case DRM_IOCTL_VIRTGPU_TRANSFER_FROM_HOST:
+		return 0;
+	default:
+		return FAKE_DRM_DEFAULT;
+	}
+}
+
+static struct driver *open_virtio_gpu(bool async)
+{
+	int fd;
+	struct driver *drv;
+
+	if (async)
+		setenv("MINIGBM_ASYNC_FLUSH", "1", 1);
+
+	fd = fake_drm_open("virtio_gpu", virtio_gpu_ioctl);
+	CHECK(fd >= 0);
+	drv = drv_create(fd);
+	CHECK(drv);
+
+	unsetenv("MINIGBM_ASYNC_FLUSH");
+	return drv;
+}
+
+static void close_virtio_gpu(struct driver *drv)
+{
+	int fd = drv_get_fd(drv);
+
+	drv_destroy(drv);
+	fake_drm_close(fd);
+}
+
+static void reset_host(bool stall)
+{
+	pthread_mutex_lock(&host.lock);
+	host.num_boxes = 0;
+	host.num_done = 0;
+	host.stall = stall;
+	host.stalled = false;
+	pthread_mutex_unlock(&host.lock);
+}
+
+static void wait_for_stall(void)
+{
+	pthread_mutex_lock(&host.lock);
+	while (!host.stalled)
+		pthread_cond_wait(&host.cond, &host.lock);
+	pthread_mutex_unlock(&host.lock);
+}
+
+static void release_stall(void)
+{
+	pthread_mutex_lock(&host.lock);
+	host.stall = false;
+	pthread_cond_broadcast(&host.cond);
+	pthread_mutex_unlock(&host.lock);
+}
+
+static bool has_box(uint32_t first, uint32_t x, uint32_t y, uint32_t w, uint32_t h)
+{
+	uint32_t i;
+
+	for (i = first; i < host.num_boxes; i++)
+		if (host.boxes[i].x == x && host.boxes[i].y == y && host.boxes[i].w == w &&
+		    host.boxes[i].h == h)
+			return true;
+
+	return false;
+}
+
+static bool fence_signalled(int fd)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+	return poll(&pfd, 1, 0) == 1;
+}
+
+static bool fence_wait(int fd)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+	return poll(&pfd, 1, 5000) == 1;
+}
+
+/*
+ * Write-only maps of each rect, flushed while the host holds up the first transfer, so the
+ * flush pool batches all the others. Returns the number of transfers behind the first one.
+ */
+static uint32_t flush_batch(struct driver *drv, const struct rectangle *rects, uint32_t count)
+{
+	int fence;
+	uint32_t i;
+	struct bo *bo;
+	struct mapping *mappings[16];
+
+	CHECK(count <= ARRAY_SIZE(mappings));
+	bo = drv_bo_create(drv, 256, 256, DRM_FORMAT_XRGB8888, USE_FLAGS);
+	CHECK(bo);
+
+	for (i = 0; i < count; i++)
+		CHECK(drv_bo_map(bo, &rects[i], BO_MAP_WRITE, &mappings[i], 0) != MAP_FAILED);
+
+	reset_host(true);
+	CHECK(!drv_bo_flush_or_unmap(bo, mappings[0]));
+	wait_for_stall();
+	for (i = 1; i < count; i++)
+		CHECK(!drv_bo_flush_or_unmap(bo, mappings[i]));
+
+	/* The release fence of the batch is only signalled once the pool is done. */
+	fence = drv_bo_get_flush_fence(bo);
+	CHECK(fake_drm_is_fence(fence));
+	CHECK(!fence_signalled(fence));
+	release_stall();
+	drv_bo_wait_flush(bo);
+	CHECK(fence_signalled(fence));
+	close(fence);
+	CHECK(drv_bo_get_flush_fence(bo) < 0);
+
+	CHECK(host.boxes[0].x == rects[0].x && host.boxes[0].y == rects[0].y);
+	for (i = 0; i < count; i++)
+		CHECK(!drv_bo_unmap(bo, mappings[i]));
+
+	/* Unmapping found nothing left to send. */
+	drv_bo_destroy(bo);
+	return host.num_boxes - 1;
+}
+
+static uint32_t count_transfers(void)
+{
+	return fake_drm_ioctl_count(DRM_IOCTL_VIRTGPU_TRANSFER_TO_HOST) +
+	       fake_drm_ioctl_count(DRM_IOCTL_VIRTGPU_TRANSFER_FROM_HOST);
+}
+
+static void test_transfers(void)
+{
+	uint32_t y;
+	struct bo *bo;
+	struct mapping *mapping, *reader, *rows[16];
+	struct driver *drv;
+	struct rectangle rect = { 10, 20, 30, 40 };
+	struct rectangle row = { 0, 0, 256, 1 };
+
+	/* Without the flush pool, flushes are batched up until a sync point, here the fence. */
+	drv = open_virtio_gpu(false);
+	bo = drv_bo_create(drv, 256, 256, DRM_FORMAT_XRGB8888, USE_FLAGS);
+	CHECK(bo);
+	reset_host(false);
+	fake_drm_reset_ioctl_counts();
+	CHECK(drv_bo_map(bo, &rect, BO_MAP_WRITE, &mapping, 0) != MAP_FAILED);
+	CHECK(!drv_bo_flush_or_unmap(bo, mapping));
+	CHECK(!drv_bo_flush_or_unmap(bo, mapping));
+	CHECK(host.num_boxes == 0);
+	CHECK(drv_bo_get_flush_fence(bo) < 0);
+	CHECK(host.num_boxes == 1 && has_box(0, 10, 20, 30, 40));
+	CHECK(!drv_bo_unmap(bo, mapping));
+	CHECK(host.num_boxes == 1);
+
+	/* A row at a time costs one transfer in all, once the mapping goes away. */
+	reset_host(false);
+	for (y = 0; y < ARRAY_SIZE(rows); y++) {
+		row.y = y;
+		CHECK(drv_bo_map(bo, &row, BO_MAP_WRITE, &rows[y], 0) != MAP_FAILED);
+		CHECK(!drv_bo_flush_or_unmap(bo, rows[y]));
+	}
+	CHECK(host.num_boxes == 0);
+	for (y = 0; y < ARRAY_SIZE(rows); y++)
+		CHECK(!drv_bo_unmap(bo, rows[y]));
+	CHECK(host.num_boxes == 1 && has_box(0, 0, 0, 256, 16));
+	CHECK(fake_drm_ioctl_count(DRM_IOCTL_VIRTGPU_TRANSFER_TO_HOST) == 2);
+
+	/* Reading back through another mapping sends this one's writes first. */
+	reset_host(false);
+	CHECK(drv_bo_map(bo, &rect, BO_MAP_WRITE, &mapping, 0) != MAP_FAILED);
+	CHECK(!drv_bo_flush_or_unmap(bo, mapping));
+	CHECK(drv_bo_map(bo, &rect, BO_MAP_READ, &reader, 0) != MAP_FAILED);
+	CHECK(host.num_boxes == 1);
+	CHECK(!drv_bo_unmap(bo, reader));
+	CHECK(!drv_bo_unmap(bo, mapping));
+	drv_bo_destroy(bo);
+
+	/*
+	 * Multi-plane resources go back whole, so even a write-only map has to read them first,
+	 * or stale pixels outside the rect would overwrite the host's.
+	 */
+	bo = drv_bo_create(drv, 256, 256, DRM_FORMAT_NV12, USE_FLAGS);
+	CHECK(bo);
+	reset_host(false);
+	fake_drm_reset_ioctl_counts();
+	CHECK(drv_bo_map(bo, &rect, BO_MAP_WRITE, &mapping, 0) != MAP_FAILED);
+	CHECK(fake_drm_ioctl_count(DRM_IOCTL_VIRTGPU_TRANSFER_FROM_HOST) == 1);
+	CHECK(!drv_bo_flush_or_unmap(bo, mapping));
+	CHECK(drv_bo_get_flush_fence(bo) < 0);
+	CHECK(host.num_boxes == 1 && has_box(0, 0, 0, 256, 256));
+	CHECK(!drv_bo_unmap(bo, mapping));
+	drv_bo_destroy(bo);
+
+	close_virtio_gpu(drv);
+}
+
+static void test_merges(void)
+{
+	uint32_t i;
+	struct rectangle apart[10];
+	struct driver *drv = open_virtio_gpu(true);
+
+	/* Stacked rows and a rect inside them make one box; rects that would leave gaps don't. */
+	const struct rectangle merged[] = {
+		{ 0, 0, 256, 1 },   { 0, 10, 256, 10 }, { 0, 20, 256, 10 },
+		{ 5, 12, 20, 10 },  { 0, 100, 10, 10 }, { 50, 100, 10, 10 },
+		{ 10, 100, 10, 10 }, { 0, 200, 10, 10 }, { 5, 205, 10, 10 },
+	};
+
+	CHECK(flush_batch(drv, merged, ARRAY_SIZE(merged)) == 5);
+	CHECK(has_box(1, 0, 10, 256, 20));
+	CHECK(has_box(1, 0, 100, 20, 10));
+	CHECK(has_box(1, 50, 100, 10, 10));
+	CHECK(has_box(1, 0, 200, 10, 10));
+	CHECK(has_box(1, 5, 205, 10, 10));
+
+	/* A full queue is sent as it is instead of being widened. */
+	for (i = 0; i < ARRAY_SIZE(apart); i++) {
+		apart[i].x = i * 20;
+		apart[i].y = i * 20;
+		apart[i].width = 10;
+		apart[i].height = 10;
+	}
+
+	CHECK(flush_batch(drv, apart, ARRAY_SIZE(apart)) == 9);
+	for (i = 1; i < ARRAY_SIZE(apart); i++)
+		CHECK(has_box(1, i * 20, i * 20, 10, 10));
+
+	close_virtio_gpu(drv);
+}
+
+/*
+ * What gralloc's unlockAsync does with a write mapping: the release fence is a sync_file that
+ * signals once the transfer to the host is done, or -1 once it is already done.
+ */
+static void test_fence(void)
+{
+	int fence;
+	struct bo *bo;
+	struct mapping *mapping;
+	struct driver *drv = open_virtio_gpu(true);
+	struct rectangle rect = { 0, 0, 64, 64 };
+
+	bo = drv_bo_create(drv, 64, 64, DRM_FORMAT_XRGB8888, USE_FLAGS);
+	CHECK(bo);
+
+	reset_host(true);
+	CHECK(drv_bo_map(bo, &rect, BO_MAP_WRITE, &mapping, 0) != MAP_FAILED);
+	CHECK(!drv_bo_flush_or_unmap(bo, mapping));
+	fence = drv_bo_get_flush_fence(bo);
+	CHECK(fake_drm_is_fence(fence));
+	wait_for_stall();
+	CHECK(!fence_signalled(fence));
+	release_stall();
+	CHECK(fence_wait(fence));
+	CHECK(host.num_done == 1);
+	close(fence);
+	CHECK(!drv_bo_unmap(bo, mapping));
+
+	/* Without sw_sync, unlock waits for the transfer instead. */
+	fake_drm_set_sw_sync(false);
+	reset_host(false);
+	host.delay_us = 20000;
+	CHECK(drv_bo_map(bo, &rect, BO_MAP_WRITE, &mapping, 0) != MAP_FAILED);
+	CHECK(!drv_bo_flush_or_unmap(bo, mapping));
+	CHECK(drv_bo_get_flush_fence(bo) < 0);
+	CHECK(host.num_done == 1);
+	CHECK(!drv_bo_unmap(bo, mapping));
+	host.delay_us = 0;
+	fake_drm_set_sw_sync(true);
+
+	drv_bo_destroy(bo);
+	close_virtio_gpu(drv);
+}
+
+/* Maps all of bo for reading and writing, then flushes and unmaps it. */
+static void map_and_flush(struct bo *bo)
+{
+	struct mapping *mapping;
+	struct rectangle rect = { 0, 0, drv_bo_get_width(bo), drv_bo_get_height(bo) };
+
+	CHECK(drv_bo_map(bo, &rect, BO_MAP_READ_WRITE, &mapping, 0) != MAP_FAILED);
+	CHECK(!drv_bo_flush_or_unmap(bo, mapping));
+	CHECK(!drv_bo_unmap(bo, mapping));
+}
+
+/* Imports a new resource of the given kind, as another process would hand it to us. */
+static struct bo *import_resource(struct driver *drv, uint32_t blob_mem)
+{
+	struct bo *bo;
+	uint32_t handle;
+	struct drv_import_fd_data data;
+
+	handle = fake_drm_create_object(64 * 64 * 4);
+	CHECK(handle);
+	blob_mems[handle] = blob_mem;
+
+	memset(&data, 0, sizeof(data));
+	CHECK(!drmPrimeHandleToFD(drv_get_fd(drv), handle, DRM_CLOEXEC, &data.fds[0]));
+	data.strides[0] = 64 * 4;
+	data.width = 64;
+	data.height = 64;
+	data.format = DRM_FORMAT_XRGB8888;
+	data.use_flags = SW_USE_FLAGS;
+
+	bo = drv_bo_import(drv, &data);
+	CHECK(bo);
+	close(data.fds[0]);
+	return bo;
+}
+
+/* Blob resources, created or imported, are mapped directly and never see transfers. */
+static void test_blobs(void)
+{
+	struct bo *bo, *other;
+	struct driver *drv;
+
+	has_blob = true;
+	num_blob_ids = 0;
+	drv = open_virtio_gpu(false);
+	reset_host(false);
+	fake_drm_reset_ioctl_counts();
+
+	bo = drv_bo_create(drv, 64, 64, DRM_FORMAT_XRGB8888, SW_USE_FLAGS);
+	CHECK(bo);
+	other = drv_bo_create(drv, 64, 64, DRM_FORMAT_XRGB8888, SW_USE_FLAGS);
+	CHECK(other);
+	/* The host reads a blob id of 0 as no blob at all. */
+	CHECK(num_blob_ids == 2 && blob_ids[0] == 1 && blob_ids[1] == 2);
+
+	map_and_flush(bo);
+	CHECK(count_transfers() == 0);
+	drv_bo_destroy(other);
+	drv_bo_destroy(bo);
+
+	bo = import_resource(drv, VIRTGPU_BLOB_MEM_HOST3D);
+	map_and_flush(bo);
+	CHECK(count_transfers() == 0);
+	drv_bo_destroy(bo);
+
+	/* Classic resources still go both ways. */
+	bo = import_resource(drv, 0);
+	map_and_flush(bo);
+	CHECK(fake_drm_ioctl_count(DRM_IOCTL_VIRTGPU_TRANSFER_FROM_HOST) == 1);
+	CHECK(fake_drm_ioctl_count(DRM_IOCTL_VIRTGPU_TRANSFER_TO_HOST) == 1);
+	drv_bo_destroy(bo);
+
+	close_virtio_gpu(drv);
+	has_blob = false;
+}
+
+/* How long gralloc's unlock, a flush and a release fence, holds up the caller at 1080p. */
+static void bench_unlock(bool async)
+{
+	int i, fence;
+	double start, seconds = 0;
+	struct bo *bo;
+	struct mapping *mapping;
+	struct driver *drv = open_virtio_gpu(async);
+	const int iterations = 20;
+	struct rectangle rect = { 0, 0, 1920, 1080 };
+
+	bo = drv_bo_create(drv, rect.width, rect.height, DRM_FORMAT_XRGB8888, USE_FLAGS);
+	CHECK(bo);
+	host.delay_us = 2000;
+
+	for (i = 0; i < iterations; i++) {
+		reset_host(false);
+		CHECK(drv_bo_map(bo, &rect, BO_MAP_WRITE, &mapping, 0) != MAP_FAILED);
+
+		start = test_seconds();
+		CHECK(!drv_bo_flush_or_unmap(bo, mapping));
+		fence = drv_bo_get_flush_fence(bo);
+		seconds += test_seconds() - start;
+
+		CHECK(async == (fence >= 0));
+		if (fence >= 0)
+			close(fence);
+
+		drv_bo_wait_flush(bo);
+		CHECK(!drv_bo_unmap(bo, mapping));
+	}
+
+	BENCH_REPORT(async ? "unlock 1080p, flush pool" : "unlock 1080p, no flush pool",
+		     iterations, "unlocks/s", seconds);
+
+	host.delay_us = 0;
+	drv_bo_destroy(bo);
+	close_virtio_gpu(drv);
+}
+
+int main(void)
+{
+	test_transfers();
+	test_merges();
+	test_fence();
+	test_blobs();
+
+	bench_unlock(false);
+	bench_unlock(true);
+	return 0;
+}
@@ -0,0 +1,141 @@
+/*
+ * Copyright 2020 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "drv_priv.h"
+#include "trace.h"
+#include "util.h"
+
+#define DRV_TRACE_RING_SIZE 4096
+
+enum drv_trace_modes {
+	DRV_TRACE_OFF = 0,
+	DRV_TRACE_MARKER = 1,
+	DRV_TRACE_RING = 2,
+};
+
+struct drv_trace_record {
+	uint64_t time_ns;
+	pid_t tid;
+	char phase;
+	const char *name;
+	uint32_t width;
+	uint32_t height;
+	uint32_t format;
+	size_t size;
+	uint64_t modifier;
+};
+
+int drv_trace_mode = DRV_TRACE_OFF;
+
+static pthread_once_t drv_trace_once = PTHREAD_ONCE_INIT;
+static int drv_trace_fd = -1;
+static struct drv_trace_record *drv_trace_ring;
+static uint64_t drv_trace_next;
+
+static const char *const drv_trace_marker_paths[] = {
+	"/sys/kernel/tracing/trace_marker",
+	"/sys/kernel/debug/tracing/trace_marker",
+};
+
+static void drv_trace_setup(void)
+{
+	size_t i;
+	const char *env = getenv("MINIGBM_TRACE");
+
+	if (!env)
+		return;
+
+	if (!strcmp(env, "marker")) {
+		for (i = 0; i < ARRAY_SIZE(drv_trace_marker_paths) && drv_trace_fd < 0; i++)
+			drv_trace_fd = open(drv_trace_marker_paths[i], O_WRONLY | O_CLOEXEC);
+
+		if (drv_trace_fd < 0) {
+			drv_log("Unable to open trace_marker, tracing disabled\n");
+			return;
+		}
+
+		drv_trace_mode = DRV_TRACE_MARKER;
+	} else if (!strcmp(env, "ring")) {
+		drv_trace_ring = calloc(DRV_TRACE_RING_SIZE, sizeof(*drv_trace_ring));
+		if (!drv_trace_ring)
+			return;
+
+		drv_trace_mode = DRV_TRACE_RING;
+	} else {
+		drv_log("Unknown MINIGBM_TRACE mode %s\n", env);
+	}
+}
+
+void drv_trace_init(void)
+{
+	pthread_once(&drv_trace_once, drv_trace_setup);
+}
+
+void drv_trace_event(char phase, const char *name, struct bo *bo)
+{
+	int len;
+	char buf[160];
+	struct timespec ts;
+	struct drv_trace_record *record;
+
+	if (drv_trace_mode == DRV_TRACE_MARKER) {
+		/*
+		 * The systrace format. Parsers that want nothing after the pid of an end event
+		 * skip the arguments, which is where the size of a new bo is first known.
+		 */
+		len = snprintf(buf, sizeof(buf),
+			       "%c|%d|minigbm %s %ux%u %4.4s size=%zu modifier=0x%llx", phase,
+			       getpid(), name, bo->width, bo->height, (char *)&bo->format,
+			       bo->total_size, (unsigned long long)bo->format_modifiers[0]);
+
+		if (write(drv_trace_fd, buf, MIN(len, (int)sizeof(buf) - 1)) < 0)
+			drv_trace_mode = DRV_TRACE_OFF;
+
+		return;
+	}
+
+	clock_gettime(CLOCK_BOOTTIME, &ts);
+
+	record = &drv_trace_ring[__atomic_fetch_add(&drv_trace_next, 1, __ATOMIC_RELAXED) %
+				 DRV_TRACE_RING_SIZE];
+	record->time_ns = (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+	record->tid = syscall(SYS_gettid);
+	record->phase = phase;
+	record->name = name;
+	record->width = bo->width;
+	record->height = bo->height;
+	record->format = bo->format;
+	record->size = bo->total_size;
+	record->modifier = bo->format_modifiers[0];
+}
+
+/* Logs the ring buffer, oldest event first. Events written during the dump may be torn. */
+void drv_trace_dump(void)
+{
+	uint64_t i, end;
+	struct drv_trace_record *record;
+
+	if (drv_trace_mode != DRV_TRACE_RING)
+		return;
+
+	end = __atomic_load_n(&drv_trace_next, __ATOMIC_RELAXED);
+	for (i = end > DRV_TRACE_RING_SIZE ? end - DRV_TRACE_RING_SIZE : 0; i < end; i++) {
+		record = &drv_trace_ring[i % DRV_TRACE_RING_SIZE];
+		drv_log("%llu %d %c %s %ux%u %4.4s size=%zu modifier=0x%llx\n",
+			(unsigned long long)record->time_ns, record->tid, record->phase,
+			record->name, record->width, record->height, (char *)&record->format,
+			record->size, (unsigned long long)record->modifier);
+	}
+}
@@ -0,0 +1,43 @@
+/*
+ * Copyright 2020 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "drv.h"
+
+/*
+ * Buffer lifecycle events, enabled by setting MINIGBM_TRACE to "marker" (ftrace trace_marker,
+ * which systrace and Perfetto pick up) or "ring" (an in-memory ring buffer, dumped to the log
+ * when the driver is destroyed). When tracing is off, an event costs one load and branch.
+ */
+extern int drv_trace_mode;
+
+void drv_trace_init(void);
+void drv_trace_event(char phase, const char *name, struct bo *bo);
+void drv_trace_dump(void);
+
+#define drv_trace_begin(name, bo)                                                                  \
+	do {                                                                                       \
+		if (__builtin_expect(drv_trace_mode, 0))                                           \
+			drv_trace_event('B', name, bo);                                            \
+	} while (0)
+
+#define drv_trace_end(name, bo)                                                                    \
+	do {                                                                                       \
+		if (__builtin_expect(drv_trace_mode, 0))                                           \
+			drv_trace_event('E', name, bo);                                            \
+	} while (0)
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
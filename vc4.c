@@ -72,8 +72,8 @@ static void *vc4_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint32_t m
 		return MAP_FAILED;
 	}
 
-	vma->length = bo->total_size;
-	return mmap(NULL, bo->total_size, drv_get_prot(map_flags), MAP_SHARED, bo->drv->fd,
+	drv_vma_from_object_start(vma);
+	return mmap(NULL, vma->length, drv_get_prot(map_flags), MAP_SHARED, bo->drv->fd,
 		    bo_map.offset);
 }
 
@@ -5,6 +5,7 @@
  */
 
 #include <errno.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
@@ -25,6 +26,62 @@
 #define MESA_LLVMPIPE_TILE_ORDER 6
 #define MESA_LLVMPIPE_TILE_SIZE (1 << MESA_LLVMPIPE_TILE_ORDER)
 
+// clang-format off
+#ifndef DRM_IOCTL_VIRTGPU_RESOURCE_CREATE_BLOB
+#define VIRTGPU_PARAM_RESOURCE_BLOB 3
+#define VIRTGPU_PARAM_HOST_VISIBLE 4
+
+#define VIRTGPU_BLOB_MEM_GUEST 0x0001
+#define VIRTGPU_BLOB_MEM_HOST3D 0x0002
+#define VIRTGPU_BLOB_MEM_HOST3D_GUEST 0x0003
+
+#define VIRTGPU_BLOB_FLAG_USE_MAPPABLE 0x0001
+#define VIRTGPU_BLOB_FLAG_USE_SHAREABLE 0x0002
+
+struct drm_virtgpu_resource_create_blob {
+	__u32 blob_mem;
+	__u32 blob_flags;
+	__u32 bo_handle;
+	__u32 res_handle;
+	__u64 size;
+	__u32 pad;
+	__u32 cmd_size;
+	__u64 cmd;
+	__u64 blob_id;
+};
+
+#define DRM_IOCTL_VIRTGPU_RESOURCE_CREATE_BLOB \
+	DRM_IOWR(DRM_COMMAND_BASE + 0x0a, struct drm_virtgpu_resource_create_blob)
+#endif
+
+/*
+ * struct drm_virtgpu_resource_info as of blob support. Older headers name the last field stride,
+ * which kernels without blobs leave as we pass it.
+ */
+struct virtio_gpu_resource_info {
+	__u32 bo_handle;
+	__u32 res_handle;
+	__u32 size;
+	__u32 blob_mem;
+};
+
+/* From virgl_protocol.h: the command describing a host resource backing a blob. */
+#define VIRGL_CMD0(cmd, obj, len) ((cmd) | ((obj) << 8) | ((len) << 16))
+#define VIRGL_CCMD_PIPE_RESOURCE_CREATE 48
+#define VIRGL_PIPE_RES_CREATE_SIZE 11
+#define VIRGL_PIPE_RES_CREATE_FORMAT 1
+#define VIRGL_PIPE_RES_CREATE_BIND 2
+#define VIRGL_PIPE_RES_CREATE_TARGET 3
+#define VIRGL_PIPE_RES_CREATE_WIDTH 4
+#define VIRGL_PIPE_RES_CREATE_HEIGHT 5
+#define VIRGL_PIPE_RES_CREATE_DEPTH 6
+#define VIRGL_PIPE_RES_CREATE_ARRAY_SIZE 7
+#define VIRGL_PIPE_RES_CREATE_LAST_LEVEL 8
+#define VIRGL_PIPE_RES_CREATE_NR_SAMPLES 9
+#define VIRGL_PIPE_RES_CREATE_FLAGS 10
+#define VIRGL_PIPE_RES_CREATE_BLOB_ID 11
+// clang-format on
+
 static const uint32_t render_target_formats[] = { DRM_FORMAT_ABGR8888, DRM_FORMAT_ARGB8888,
 						  DRM_FORMAT_BGR888,   DRM_FORMAT_RGB565,
 						  DRM_FORMAT_XBGR8888, DRM_FORMAT_XRGB8888 };
@@ -32,13 +89,35 @@ static const uint32_t render_target_formats[] = { DRM_FORMAT_ABGR8888, DRM_FORMA
 static const uint32_t dumb_texture_source_formats[] = { DRM_FORMAT_R8, DRM_FORMAT_YVU420,
 							DRM_FORMAT_YVU420_ANDROID };
 
-static const uint32_t texture_source_formats[] = { DRM_FORMAT_R8, DRM_FORMAT_RG88 };
+static const uint32_t texture_source_formats[] = { DRM_FORMAT_NV12, DRM_FORMAT_R8, DRM_FORMAT_RG88,
+						   DRM_FORMAT_YVU420, DRM_FORMAT_YVU420_ANDROID };
 
 struct virtio_gpu_priv {
 	int has_3d;
+	int has_blob;
+	uint32_t next_blob_id;
+};
+
+/* Only set on blob resources, whether we created or imported them. */
+struct virtio_gpu_bo_priv {
+	uint32_t blob_mem;
 };
 
-static uint32_t translate_format(uint32_t drm_fourcc, uint32_t plane)
+#define VIRTIO_GPU_MAX_QUEUED_BOXES 8
+
+/*
+ * Dirty boxes of a mapped resource that haven't been sent to the host yet. Boxes whose union
+ * is a box are merged, so a batch of small updates costs as few transfers as possible.
+ * Flushes on the flush pool and invalidates under driver_lock both use the queue, so it has a
+ * lock of its own.
+ */
+struct virtio_gpu_transfer_queue {
+	pthread_mutex_t lock;
+	struct drm_virtgpu_3d_box boxes[VIRTIO_GPU_MAX_QUEUED_BOXES];
+	uint32_t num_boxes;
+};
+
+static uint32_t translate_format(uint32_t drm_fourcc)
 {
 	switch (drm_fourcc) {
 	case DRM_FORMAT_XRGB8888:
@@ -55,6 +134,11 @@ static uint32_t translate_format(uint32_t drm_fourcc, uint32_t plane)
 		return VIRGL_FORMAT_R8_UNORM;
 	case DRM_FORMAT_RG88:
 		return VIRGL_FORMAT_R8G8_UNORM;
+	case DRM_FORMAT_NV12:
+		return VIRGL_FORMAT_NV12;
+	case DRM_FORMAT_YVU420:
+	case DRM_FORMAT_YVU420_ANDROID:
+		return VIRGL_FORMAT_YV12;
 	default:
 		return 0;
 	}
@@ -77,70 +161,264 @@ static int virtio_virgl_bo_create(struct bo *bo, uint32_t width, uint32_t height
 				  uint64_t use_flags)
 {
 	int ret;
-	ssize_t plane;
-	ssize_t num_planes = drv_num_planes_from_format(format);
-	uint32_t stride0;
-
-	for (plane = 0; plane < num_planes; plane++) {
-		uint32_t stride = drv_stride_from_format(format, width, plane);
-		uint32_t size = drv_size_from_format(format, stride, height, plane);
-		uint32_t res_format = translate_format(format, plane);
-		struct drm_virtgpu_resource_create res_create;
-
-		memset(&res_create, 0, sizeof(res_create));
-		size = ALIGN(size, PAGE_SIZE);
-		/*
-		 * Setting the target is intended to ensure this resource gets bound as a 2D
-		 * texture in the host renderer's GL state. All of these resource properties are
-		 * sent unchanged by the kernel to the host, which in turn sends them unchanged to
-		 * virglrenderer. When virglrenderer makes a resource, it will convert the target
-		 * enum to the equivalent one in GL and then bind the resource to that target.
-		 */
-		res_create.target = PIPE_TEXTURE_2D;
-		res_create.format = res_format;
-		res_create.bind = VIRGL_BIND_RENDER_TARGET;
-		res_create.width = width;
-		res_create.height = height;
-		res_create.depth = 1;
-		res_create.array_size = 1;
-		res_create.last_level = 0;
-		res_create.nr_samples = 0;
-		res_create.stride = stride;
-		res_create.size = size;
-
-		ret = drmIoctl(bo->drv->fd, DRM_IOCTL_VIRTGPU_RESOURCE_CREATE, &res_create);
-		if (ret) {
-			drv_log("DRM_IOCTL_VIRTGPU_RESOURCE_CREATE failed with %s\n",
-				strerror(errno));
-			goto fail;
-		}
+	size_t plane;
+	uint32_t stride;
+	struct drm_virtgpu_resource_create res_create;
+
+	/* All planes share one host resource, at the offsets our layout gives them. */
+	stride = drv_stride_from_format(format, width, 0);
+	drv_bo_from_format(bo, stride, height, format);
+
+	memset(&res_create, 0, sizeof(res_create));
+	/*
+	 * Setting the target is intended to ensure this resource gets bound as a 2D
+	 * texture in the host renderer's GL state. All of these resource properties are
+	 * sent unchanged by the kernel to the host, which in turn sends them unchanged to
+	 * virglrenderer. When virglrenderer makes a resource, it will convert the target
+	 * enum to the equivalent one in GL and then bind the resource to that target.
+	 */
+	res_create.target = PIPE_TEXTURE_2D;
+	res_create.format = translate_format(format);
+	res_create.bind = VIRGL_BIND_RENDER_TARGET;
+	res_create.width = width;
+	res_create.height = height;
+	res_create.depth = 1;
+	res_create.array_size = 1;
+	res_create.last_level = 0;
+	res_create.nr_samples = 0;
+	res_create.stride = stride;
+	res_create.size = ALIGN(bo->total_size, PAGE_SIZE);
+
+	ret = drmIoctl(bo->drv->fd, DRM_IOCTL_VIRTGPU_RESOURCE_CREATE, &res_create);
+	if (ret) {
+		drv_log("DRM_IOCTL_VIRTGPU_RESOURCE_CREATE failed with %s\n", strerror(errno));
+		return ret;
+	}
 
+	for (plane = 0; plane < bo->num_planes; plane++)
 		bo->handles[plane].u32 = res_create.bo_handle;
+
+	return 0;
+}
+
+/*
+ * Blob resources live in host memory that the guest maps directly, so CPU access needs no
+ * transfers. That only pays off for buffers the CPU touches often; everything else keeps the
+ * classic resources the host renderer handles best.
+ */
+static bool virtio_gpu_should_use_blob(struct driver *drv, uint32_t format, uint64_t use_flags)
+{
+	struct virtio_gpu_priv *priv = (struct virtio_gpu_priv *)drv->priv;
+
+	if (!priv->has_3d || !priv->has_blob)
+		return false;
+
+	if (!(use_flags & (BO_USE_SW_OFTEN)))
+		return false;
+
+	return drv_num_planes_from_format(format) == 1 && translate_format(format);
+}
+
+static int virtio_gpu_bo_create_blob(struct bo *bo, uint32_t width, uint32_t height,
+				     uint32_t format, uint64_t use_flags)
+{
+	int ret;
+	uint32_t stride;
+	uint32_t cmd[VIRGL_PIPE_RES_CREATE_SIZE + 1] = { 0 };
+	struct drm_virtgpu_resource_create_blob res_create;
+	struct virtio_gpu_priv *priv = (struct virtio_gpu_priv *)bo->drv->priv;
+	struct virtio_gpu_bo_priv *bo_priv;
+
+	bo_priv = calloc(1, sizeof(*bo_priv));
+	if (!bo_priv)
+		return -ENOMEM;
+
+	bo_priv->blob_mem = VIRTGPU_BLOB_MEM_HOST3D;
+
+	stride = drv_stride_from_format(format, width, 0);
+	drv_bo_from_format(bo, stride, height, format);
+	bo->total_size = ALIGN(bo->total_size, PAGE_SIZE);
+
+	cmd[0] = VIRGL_CMD0(VIRGL_CCMD_PIPE_RESOURCE_CREATE, 0, VIRGL_PIPE_RES_CREATE_SIZE);
+	cmd[VIRGL_PIPE_RES_CREATE_FORMAT] = translate_format(format);
+	cmd[VIRGL_PIPE_RES_CREATE_BIND] = VIRGL_BIND_RENDER_TARGET;
+	cmd[VIRGL_PIPE_RES_CREATE_TARGET] = PIPE_TEXTURE_2D;
+	cmd[VIRGL_PIPE_RES_CREATE_WIDTH] = width;
+	cmd[VIRGL_PIPE_RES_CREATE_HEIGHT] = height;
+	cmd[VIRGL_PIPE_RES_CREATE_DEPTH] = 1;
+	cmd[VIRGL_PIPE_RES_CREATE_ARRAY_SIZE] = 1;
+	cmd[VIRGL_PIPE_RES_CREATE_BLOB_ID] = __atomic_fetch_add(&priv->next_blob_id, 1,
+								__ATOMIC_RELAXED);
+
+	memset(&res_create, 0, sizeof(res_create));
+	res_create.blob_mem = bo_priv->blob_mem;
+	res_create.blob_flags = VIRTGPU_BLOB_FLAG_USE_MAPPABLE | VIRTGPU_BLOB_FLAG_USE_SHAREABLE;
+	res_create.blob_id = cmd[VIRGL_PIPE_RES_CREATE_BLOB_ID];
+	res_create.size = bo->total_size;
+	res_create.cmd = (uint64_t)(uintptr_t)cmd;
+	res_create.cmd_size = sizeof(cmd);
+
+	ret = drmIoctl(bo->drv->fd, DRM_IOCTL_VIRTGPU_RESOURCE_CREATE_BLOB, &res_create);
+	if (ret) {
+		drv_log("DRM_IOCTL_VIRTGPU_RESOURCE_CREATE_BLOB failed with %s\n", strerror(errno));
+		free(bo_priv);
+		return ret;
 	}
 
-	stride0 = drv_stride_from_format(format, width, 0);
-	drv_bo_from_format(bo, stride0, height, format);
+	bo->handles[0].u32 = res_create.bo_handle;
+	bo->priv = bo_priv;
+
+	return 0;
+}
+
+static bool virtio_gpu_bo_is_blob(struct bo *bo)
+{
+	return bo->priv != NULL;
+}
+
+static bool virtio_gpu_box_contains(const struct drm_virtgpu_3d_box *a,
+				    const struct drm_virtgpu_3d_box *b)
+{
+	return a->x <= b->x && a->y <= b->y && a->x + a->w >= b->x + b->w &&
+	       a->y + a->h >= b->y + b->h;
+}
+
+/* Merging only pays off when the union is exactly a box, so no clean pixels are sent. */
+static bool virtio_gpu_boxes_mergeable(const struct drm_virtgpu_3d_box *a,
+				       const struct drm_virtgpu_3d_box *b)
+{
+	if (virtio_gpu_box_contains(a, b) || virtio_gpu_box_contains(b, a))
+		return true;
+
+	if (a->x == b->x && a->w == b->w)
+		return a->y <= b->y + b->h && b->y <= a->y + a->h;
+
+	if (a->y == b->y && a->h == b->h)
+		return a->x <= b->x + b->w && b->x <= a->x + a->w;
+
+	return false;
+}
+
+static void virtio_gpu_merge_box(struct drm_virtgpu_3d_box *dst,
+				 const struct drm_virtgpu_3d_box *src)
+{
+	uint32_t x1 = MAX(dst->x + dst->w, src->x + src->w);
+	uint32_t y1 = MAX(dst->y + dst->h, src->y + src->h);
+
+	dst->x = MIN(dst->x, src->x);
+	dst->y = MIN(dst->y, src->y);
+	dst->w = x1 - dst->x;
+	dst->h = y1 - dst->y;
+}
+
+/* Called with the queue lock held. */
+static int virtio_gpu_send_boxes(struct bo *bo, struct vma *vma)
+{
+	int ret;
+	uint32_t i;
+	struct drm_virtgpu_3d_transfer_to_host xfer;
+	struct virtio_gpu_transfer_queue *queue = vma->priv;
 
-	for (plane = 0; plane < num_planes; plane++)
-		bo->offsets[plane] = 0;
+	for (i = 0; i < queue->num_boxes; i++) {
+		memset(&xfer, 0, sizeof(xfer));
+		xfer.bo_handle = vma->handle;
+		xfer.box = queue->boxes[i];
 
+		ret = drmIoctl(bo->drv->fd, DRM_IOCTL_VIRTGPU_TRANSFER_TO_HOST, &xfer);
+		if (ret) {
+			drv_log("DRM_IOCTL_VIRTGPU_TRANSFER_TO_HOST failed with %s\n",
+				strerror(errno));
+			return ret;
+		}
+	}
+
+	queue->num_boxes = 0;
 	return 0;
+}
+
+/* Called with the queue lock held. */
+static int virtio_gpu_queue_box(struct bo *bo, struct vma *vma, const struct rectangle *rect)
+{
+	int ret;
+	uint32_t i;
+	struct virtio_gpu_transfer_queue *queue = vma->priv;
+	struct drm_virtgpu_3d_box box = {
+		.x = rect->x, .y = rect->y, .z = 0, .w = rect->width, .h = rect->height, .d = 1
+	};
+
+	/* Absorb every queued box the new one merges with; the merged box may merge with more. */
+	i = 0;
+	while (i < queue->num_boxes) {
+		if (!virtio_gpu_boxes_mergeable(&box, &queue->boxes[i])) {
+			i++;
+			continue;
+		}
 
-fail:
-	for (plane--; plane >= 0; plane--) {
-		struct drm_gem_close gem_close;
-		memset(&gem_close, 0, sizeof(gem_close));
-		gem_close.handle = bo->handles[plane].u32;
-		drmIoctl(bo->drv->fd, DRM_IOCTL_GEM_CLOSE, &gem_close);
+		virtio_gpu_merge_box(&box, &queue->boxes[i]);
+		queue->boxes[i] = queue->boxes[--queue->num_boxes];
+		i = 0;
 	}
 
+	/* Rather than widen boxes over clean pixels, send the full queue now. */
+	if (queue->num_boxes == VIRTIO_GPU_MAX_QUEUED_BOXES) {
+		ret = virtio_gpu_send_boxes(bo, vma);
+		if (ret)
+			return ret;
+	}
+
+	queue->boxes[queue->num_boxes++] = box;
+	return 0;
+}
+
+/*
+ * The chroma planes of a YUV resource sit below its luma rows, outside any box in luma
+ * coordinates, so those resources are always transferred whole.
+ */
+static struct rectangle virtio_gpu_transfer_rect(struct bo *bo, struct mapping *mapping)
+{
+	struct rectangle full = { 0, 0, bo->width, bo->height };
+
+	return bo->num_planes > 1 ? full : mapping->rect;
+}
+
+static int virtio_gpu_submit_transfers(struct bo *bo, struct vma *vma)
+{
+	int ret;
+	struct virtio_gpu_transfer_queue *queue = vma->priv;
+
+	pthread_mutex_lock(&queue->lock);
+	ret = virtio_gpu_send_boxes(bo, vma);
+	pthread_mutex_unlock(&queue->lock);
+
 	return ret;
 }
 
+/* Sends what every mapping of the bo has queued. Called with driver_lock held. */
+static int virtio_gpu_submit_bo_transfers(struct bo *bo)
+{
+	int ret;
+	uint32_t i;
+	struct mapping *mapping;
+
+	for (i = 0; i < drv_array_size(bo->drv->mappings); i++) {
+		mapping = (struct mapping *)drv_array_at_idx(bo->drv->mappings, i);
+		if (mapping->vma->handle != bo->handles[0].u32 || !mapping->vma->priv)
+			continue;
+
+		ret = virtio_gpu_submit_transfers(bo, mapping->vma);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
 static void *virtio_virgl_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint32_t map_flags)
 {
 	int ret;
+	void *addr;
 	struct drm_virtgpu_map gem_map;
+	struct virtio_gpu_transfer_queue *queue;
 
 	memset(&gem_map, 0, sizeof(gem_map));
 	gem_map.handle = bo->handles[0].u32;
@@ -151,9 +429,21 @@ static void *virtio_virgl_bo_map(struct bo *bo, struct vma *vma, size_t plane, u
 		return MAP_FAILED;
 	}
 
-	vma->length = bo->total_size;
-	return mmap(0, bo->total_size, drv_get_prot(map_flags), MAP_SHARED, bo->drv->fd,
+	drv_vma_from_object_start(vma);
+	addr = mmap(0, vma->length, drv_get_prot(map_flags), MAP_SHARED, bo->drv->fd,
 		    gem_map.offset);
+	if (addr == MAP_FAILED || virtio_gpu_bo_is_blob(bo))
+		return addr;
+
+	queue = calloc(1, sizeof(*queue));
+	if (!queue) {
+		munmap(addr, vma->length);
+		return MAP_FAILED;
+	}
+
+	pthread_mutex_init(&queue->lock, NULL);
+	vma->priv = queue;
+	return addr;
 }
 
 static int virtio_gpu_init(struct driver *drv)
@@ -164,6 +454,8 @@ static int virtio_gpu_init(struct driver *drv)
 
 	priv = calloc(1, sizeof(*priv));
 	drv->priv = priv;
+	/* The host takes a blob id of 0 to mean the resource has no blob. */
+	priv->next_blob_id = 1;
 
 	memset(&args, 0, sizeof(args));
 	args.param = VIRTGPU_PARAM_3D_FEATURES;
@@ -175,14 +467,36 @@ static int virtio_gpu_init(struct driver *drv)
 		priv->has_3d = 0;
 	}
 
+	if (priv->has_3d) {
+		int has_resource_blob = 0, has_host_visible = 0;
+
+		memset(&args, 0, sizeof(args));
+		args.param = VIRTGPU_PARAM_RESOURCE_BLOB;
+		args.value = (uint64_t)(uintptr_t)&has_resource_blob;
+		if (drmIoctl(drv->fd, DRM_IOCTL_VIRTGPU_GETPARAM, &args))
+			has_resource_blob = 0;
+
+		memset(&args, 0, sizeof(args));
+		args.param = VIRTGPU_PARAM_HOST_VISIBLE;
+		args.value = (uint64_t)(uintptr_t)&has_host_visible;
+		if (drmIoctl(drv->fd, DRM_IOCTL_VIRTGPU_GETPARAM, &args))
+			has_host_visible = 0;
+
+		priv->has_blob = has_resource_blob && has_host_visible;
+	}
+
 	drv_add_combinations(drv, render_target_formats, ARRAY_SIZE(render_target_formats),
 			     &LINEAR_METADATA, BO_USE_RENDER_MASK);
 
-	if (priv->has_3d)
+	if (priv->has_3d) {
 		drv_add_combinations(drv, texture_source_formats,
 				     ARRAY_SIZE(texture_source_formats), &LINEAR_METADATA,
 				     BO_USE_TEXTURE_MASK);
-	else
+
+		/* Single-resource NV12 lets video frames reach the host without conversion. */
+		drv_modify_combination(drv, DRM_FORMAT_NV12, &LINEAR_METADATA,
+				       BO_USE_HW_VIDEO_DECODER | BO_USE_HW_VIDEO_ENCODER);
+	} else
 		drv_add_combinations(drv, dumb_texture_source_formats,
 				     ARRAY_SIZE(dumb_texture_source_formats), &LINEAR_METADATA,
 				     BO_USE_TEXTURE_MASK);
@@ -200,15 +514,65 @@ static int virtio_gpu_bo_create(struct bo *bo, uint32_t width, uint32_t height,
 				uint64_t use_flags)
 {
 	struct virtio_gpu_priv *priv = (struct virtio_gpu_priv *)bo->drv->priv;
+	if (virtio_gpu_should_use_blob(bo->drv, format, use_flags) &&
+	    !virtio_gpu_bo_create_blob(bo, width, height, format, use_flags))
+		return 0;
+
 	if (priv->has_3d)
 		return virtio_virgl_bo_create(bo, width, height, format, use_flags);
 	else
 		return virtio_dumb_bo_create(bo, width, height, format, use_flags);
 }
 
+/*
+ * Blobs live in memory the guest maps directly, so they must never see transfers. Imports come
+ * with no such hint, so ask the kernel what kind of resource we got.
+ */
+static int virtio_gpu_bo_import(struct bo *bo, struct drv_import_fd_data *data)
+{
+	int ret;
+	struct virtio_gpu_resource_info info;
+	struct virtio_gpu_bo_priv *bo_priv;
+	struct virtio_gpu_priv *priv = (struct virtio_gpu_priv *)bo->drv->priv;
+
+	if (!priv->has_3d)
+		return drv_prime_bo_import(bo, data);
+
+	/* Allocated up front, as the handle may be shared with other bos once imported. */
+	bo_priv = calloc(1, sizeof(*bo_priv));
+	if (!bo_priv)
+		return -ENOMEM;
+
+	ret = drv_prime_bo_import(bo, data);
+	if (ret) {
+		free(bo_priv);
+		return ret;
+	}
+
+	memset(&info, 0, sizeof(info));
+	info.bo_handle = bo->handles[0].u32;
+	if (drmIoctl(bo->drv->fd, DRM_IOCTL_VIRTGPU_RESOURCE_INFO, &info)) {
+		drv_log("DRM_IOCTL_VIRTGPU_RESOURCE_INFO failed with %s\n", strerror(errno));
+		info.blob_mem = 0;
+	}
+
+	if (!info.blob_mem) {
+		free(bo_priv);
+		return 0;
+	}
+
+	bo_priv->blob_mem = info.blob_mem;
+	bo->priv = bo_priv;
+	return 0;
+}
+
 static int virtio_gpu_bo_destroy(struct bo *bo)
 {
 	struct virtio_gpu_priv *priv = (struct virtio_gpu_priv *)bo->drv->priv;
+
+	free(bo->priv);
+	bo->priv = NULL;
+
 	if (priv->has_3d)
 		return drv_gem_bo_destroy(bo);
 	else
@@ -224,21 +588,51 @@ static void *virtio_gpu_bo_map(struct bo *bo, struct vma *vma, size_t plane, uin
 		return drv_dumb_bo_map(bo, vma, plane, map_flags);
 }
 
+static int virtio_gpu_bo_unmap(struct bo *bo, struct vma *vma)
+{
+	struct virtio_gpu_transfer_queue *queue = vma->priv;
+
+	if (queue) {
+		/* Anything still queued has to reach the host before the mapping goes away. */
+		virtio_gpu_submit_transfers(bo, vma);
+		pthread_mutex_destroy(&queue->lock);
+		free(queue);
+		vma->priv = NULL;
+	}
+
+	return munmap(vma->addr, vma->length);
+}
+
 static int virtio_gpu_bo_invalidate(struct bo *bo, struct mapping *mapping)
 {
 	int ret;
+	struct rectangle rect;
 	struct drm_virtgpu_3d_transfer_from_host xfer;
 	struct virtio_gpu_priv *priv = (struct virtio_gpu_priv *)bo->drv->priv;
 
-	if (!priv->has_3d)
+	if (!priv->has_3d || virtio_gpu_bo_is_blob(bo))
+		return 0;
+
+	/*
+	 * A write-only mapping never looks at the old contents, unless the flush sends the whole
+	 * resource back: then what lies outside the rect has to be current first.
+	 */
+	if (!(mapping->vma->map_flags & BO_MAP_READ) && bo->num_planes == 1)
 		return 0;
 
+	/* Reading back from the host would clobber writes it hasn't seen yet, from any mapping. */
+	ret = virtio_gpu_submit_bo_transfers(bo);
+	if (ret)
+		return ret;
+
+	rect = virtio_gpu_transfer_rect(bo, mapping);
+
 	memset(&xfer, 0, sizeof(xfer));
 	xfer.bo_handle = mapping->vma->handle;
-	xfer.box.x = mapping->rect.x;
-	xfer.box.y = mapping->rect.y;
-	xfer.box.w = mapping->rect.width;
-	xfer.box.h = mapping->rect.height;
+	xfer.box.x = rect.x;
+	xfer.box.y = rect.y;
+	xfer.box.w = rect.width;
+	xfer.box.h = rect.height;
 	xfer.box.d = 1;
 
 	ret = drmIoctl(bo->drv->fd, DRM_IOCTL_VIRTGPU_TRANSFER_FROM_HOST, &xfer);
@@ -252,31 +646,43 @@ static int virtio_gpu_bo_invalidate(struct bo *bo, struct mapping *mapping)
 
 static int virtio_gpu_bo_flush(struct bo *bo, struct mapping *mapping)
 {
-	int ret;
-	struct drm_virtgpu_3d_transfer_to_host xfer;
+	int ret = 0;
+	struct rectangle rect;
+	struct virtio_gpu_transfer_queue *queue;
 	struct virtio_gpu_priv *priv = (struct virtio_gpu_priv *)bo->drv->priv;
 
-	if (!priv->has_3d)
+	if (!priv->has_3d || virtio_gpu_bo_is_blob(bo))
 		return 0;
 
 	if (!(mapping->vma->map_flags & BO_MAP_WRITE))
 		return 0;
 
-	memset(&xfer, 0, sizeof(xfer));
-	xfer.bo_handle = mapping->vma->handle;
-	xfer.box.x = mapping->rect.x;
-	xfer.box.y = mapping->rect.y;
-	xfer.box.w = mapping->rect.width;
-	xfer.box.h = mapping->rect.height;
-	xfer.box.d = 1;
+	rect = virtio_gpu_transfer_rect(bo, mapping);
+	queue = mapping->vma->priv;
 
-	ret = drmIoctl(bo->drv->fd, DRM_IOCTL_VIRTGPU_TRANSFER_TO_HOST, &xfer);
-	if (ret) {
-		drv_log("DRM_IOCTL_VIRTGPU_TRANSFER_TO_HOST failed with %s\n", strerror(errno));
-		return ret;
-	}
+	pthread_mutex_lock(&queue->lock);
+	ret = virtio_gpu_queue_box(bo, mapping->vma, &rect);
 
-	return 0;
+	/*
+	 * A flush on the pool is what the release fence waits for, so it sends the batch, unless
+	 * the pool holds another flush of this mapping that will. Otherwise boxes wait for a sync
+	 * point: a fence export, an fd export, an unmap or a read back from the host.
+	 */
+	if (!ret && bo->drv->num_flush_threads && !drv_flush_pending(bo->drv, mapping->vma))
+		ret = virtio_gpu_send_boxes(bo, mapping->vma);
+	pthread_mutex_unlock(&queue->lock);
+
+	return ret;
+}
+
+static int virtio_gpu_bo_submit(struct bo *bo)
+{
+	struct virtio_gpu_priv *priv = (struct virtio_gpu_priv *)bo->drv->priv;
+
+	if (!priv->has_3d || virtio_gpu_bo_is_blob(bo))
+		return 0;
+
+	return virtio_gpu_submit_bo_transfers(bo);
 }
 
 static uint32_t virtio_gpu_resolve_format(uint32_t format, uint64_t use_flags)
@@ -298,10 +704,11 @@ const struct backend backend_virtio_gpu = {
 	.close = virtio_gpu_close,
 	.bo_create = virtio_gpu_bo_create,
 	.bo_destroy = virtio_gpu_bo_destroy,
-	.bo_import = drv_prime_bo_import,
+	.bo_import = virtio_gpu_bo_import,
 	.bo_map = virtio_gpu_bo_map,
-	.bo_unmap = drv_bo_munmap,
+	.bo_unmap = virtio_gpu_bo_unmap,
 	.bo_invalidate = virtio_gpu_bo_invalidate,
 	.bo_flush = virtio_gpu_bo_flush,
+	.bo_submit = virtio_gpu_bo_submit,
 	.resolve_format = virtio_gpu_resolve_format,
 };